@@ -373,14 +373,22 @@ LUA_API int lua_toboolean (lua_State *L, int idx) {
 LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
   StkId o = index2addr(L, idx);
   if (!ttisstring(o)) {
-    if (!cvt2str(o)) {  /* not convertible? */
+    lua_lock(L);  /* 'luaO_tostring' may create a new string */
+    if (cvt2str(o)) {
+      luaO_tostring(L, o);
+      luaC_checkGC(L);
+    }
+    else if (luaV_tostringhook(L, o)) {  /* string-like userdata? */
+      /* replace it by its string, as numbers */
+      setobj2s(L, index2addr(L, idx), L->top - 1);
+      L->top--;
+    }
+    else {  /* not convertible */
+      lua_unlock(L);
       if (len != NULL) *len = 0;
       return NULL;
     }
-    lua_lock(L);  /* 'luaO_tostring' may create a new string */
-    luaO_tostring(L, o);
-    luaC_checkGC(L);
-    o = index2addr(L, idx);  /* previous call may reallocate the stack */
+    o = index2addr(L, idx);  /* previous calls may reallocate the stack */
     lua_unlock(L);
   }
   if (len != NULL)
@@ -1180,6 +1188,18 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+LUA_API void lua_setstringhook (lua_State *L, lua_CFunction f) {
+  global_State *g = G(L);
+  lua_lock(L);
+  api_checknelems(L, 1);
+  api_check(L, ttisnil(L->top - 1) || ttistable(L->top - 1), "table expected");
+  g->strhookmt = ttisnil(L->top - 1) ? NULL : hvalue(L->top - 1);
+  g->strhook = (g->strhookmt == NULL) ? NULL : f;
+  L->top--;
+  lua_unlock(L);
+}
+
+
 LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
   Udata *u;
   lua_lock(L);
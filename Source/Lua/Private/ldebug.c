@@ -76,14 +76,16 @@ static void swapextra (lua_State *L) {
 ** get arbitrary values (causes at most one wrong hook call). 'hookmask'
 ** is an atomic value. We assume that pointers are atomic too (e.g., gcc
 ** ensures that for all platforms where it runs). Moreover, 'hook' is
-** always checked before being called (see 'luaD_hook').
+** always checked before being called (see 'luaD_hook'). 'L->ci' is
+** only read when line hooks are requested, so that count hooks can be
+** set from another thread (e.g. a sampling timer) while 'L' runs.
 */
 LUA_API void lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
   if (func == NULL || mask == 0) {  /* turn off hooks? */
     mask = 0;
     func = NULL;
   }
-  if (isLua(L->ci))
+  if ((mask & LUA_MASKLINE) && isLua(L->ci))
     L->oldpc = L->ci->u.l.savedpc;
   L->hook = func;
   L->basehookcount = count;
@@ -290,6 +290,7 @@ static void markmt (global_State *g) {
   int i;
   for (i=0; i < LUA_NUMTAGS; i++)
     markobjectN(g, g->mt[i]);
+  markobjectN(g, g->strhookmt);
 }
 
 
@@ -1158,7 +1159,10 @@ void luaC_step (lua_State *L) {
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(g->gckind == KGC_NORMAL);
-  if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
+  if (isemergency) {
+    g->gckind = KGC_EMERGENCY;  /* set flag */
+    luaE_clearthreadpool(L);  /* release pooled threads */
+  }
   if (keepinvariant(g)) {  /* black objects? */
     entersweep(L); /* sweep everything to turn them back to white */
   }
@@ -148,13 +148,13 @@ void luaE_shrinkCI (lua_State *L) {
 }
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
+/*
+** (re)initialize an allocated stack: erase it and set its first ci
+*/
+static void stack_reset (lua_State *L1) {
   int i; CallInfo *ci;
-  /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
-  L1->stacksize = BASIC_STACK_SIZE;
-  for (i = 0; i < BASIC_STACK_SIZE; i++)
-    setnilvalue(L1->stack + i);  /* erase new stack */
+  for (i = 0; i < L1->stacksize; i++)
+    setnilvalue(L1->stack + i);  /* erase stack */
   L1->top = L1->stack;
   L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
   /* initialize first ci */
@@ -168,6 +168,14 @@ static void stack_init (lua_State *L1, lua_State *L) {
 }
 
 
+static void stack_init (lua_State *L1, lua_State *L) {
+  /* initialize stack array */
+  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
+  L1->stacksize = BASIC_STACK_SIZE;
+  stack_reset(L1);
+}
+
+
 static void freestack (lua_State *L) {
   if (L->stack == NULL)
     return;  /* stack not completely built yet */
@@ -243,6 +251,7 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
+  luaE_clearthreadpool(L);  /* free threads pooled by the collection */
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
@@ -252,13 +261,39 @@ static void close_state (lua_State *L) {
 }
 
 
+/*
+** take a thread from the pool, if any: its block and stack are reused,
+** saving their allocations
+*/
+static lua_State *reusethread (lua_State *L) {
+  global_State *g = G(L);
+  lua_State *L1 = g->threadpool;
+  if (L1 == NULL)
+    return NULL;
+  g->threadpool = L1->twups;
+  g->nthreadpool--;
+  return L1;
+}
+
+
 LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
   lua_State *L1;
+  StkId stack;
+  int stacksize;
   lua_lock(L);
   luaC_checkGC(L);
-  /* create new thread */
-  L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
+  /* create new thread, or recycle a dead one */
+  L1 = reusethread(L);
+  if (L1 != NULL) {
+    stack = L1->stack;
+    stacksize = L1->stacksize;
+  }
+  else {
+    L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
+    stack = NULL;
+    stacksize = 0;
+  }
   L1->marked = luaC_white(g);
   L1->tt = LUA_TTHREAD;
   /* link it on list 'allgc' */
@@ -276,19 +311,63 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (stack != NULL) {  /* recycled thread? */
+    L1->stack = stack;
+    L1->stacksize = stacksize;
+    stack_reset(L1);  /* reuse its stack */
+  }
+  else
+    stack_init(L1, L);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** A dead thread goes to the pool unless it is full or the collection
+** is an emergency one (memory must be released then). Its ci list is
+** freed and its stack is shrunk to LUAI_POOLSTACKSIZE, bounding the
+** memory held by the pool. Pooled threads are not in any gc list (they
+** are unreachable); they are chained through 'twups'.
+*/
 void luaE_freethread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
-  freestack(L1);
-  luaM_free(L, l);
+  if (g->nthreadpool < LUAI_THREADPOOL && g->gckind != KGC_EMERGENCY &&
+      L1->stack != NULL) {
+    L1->ci = &L1->base_ci;  /* keep only the base ci */
+    luaE_freeCI(L1);
+    if (L1->stacksize > LUAI_POOLSTACKSIZE) {  /* shrink stack */
+      luaM_reallocvector(L, L1->stack, L1->stacksize, LUAI_POOLSTACKSIZE,
+                         TValue);
+      L1->stacksize = LUAI_POOLSTACKSIZE;
+    }
+    L1->twups = g->threadpool;
+    g->threadpool = L1;
+    g->nthreadpool++;
+  }
+  else {
+    freestack(L1);
+    luaM_free(L, l);
+  }
+}
+
+
+/*
+** free all threads in the pool
+*/
+void luaE_clearthreadpool (lua_State *L) {
+  global_State *g = G(L);
+  while (g->threadpool != NULL) {
+    lua_State *L1 = g->threadpool;
+    g->threadpool = L1->twups;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+  g->nthreadpool = 0;
 }
 
 
@@ -323,6 +402,10 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
   g->twups = NULL;
+  g->threadpool = NULL;
+  g->nthreadpool = 0;
+  g->strhookmt = NULL;
+  g->strhook = NULL;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
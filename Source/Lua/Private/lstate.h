@@ -50,6 +50,19 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
 
 
+/*
+** dead threads kept for reuse by 'lua_newthread' (0 disables the pool),
+** and size their stacks are shrunk to when pooled
+*/
+#if !defined(LUAI_THREADPOOL)
+#define LUAI_THREADPOOL		128
+#endif
+
+#if !defined(LUAI_POOLSTACKSIZE)
+#define LUAI_POOLSTACKSIZE	(2*BASIC_STACK_SIZE)
+#endif
+
+
 /* kinds of Garbage Collection */
 #define KGC_NORMAL	0
 #define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
@@ -141,6 +154,10 @@ typedef struct global_State {
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
   struct lua_State *twups;  /* list of threads with open upvalues */
+  struct lua_State *threadpool;  /* list of dead threads kept for reuse */
+  int nthreadpool;  /* number of threads in 'threadpool' */
+  struct Table *strhookmt;  /* metatable of userdata converted by 'strhook' */
+  lua_CFunction strhook;  /* string of userdata, see 'lua_setstringhook' */
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
@@ -226,6 +243,7 @@ union GCUnion {
 
 LUAI_FUNC void luaE_setdebt (global_State *g, l_mem debt);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
+LUAI_FUNC void luaE_clearthreadpool (lua_State *L);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_freeCI (lua_State *L);
 LUAI_FUNC void luaE_shrinkCI (lua_State *L);
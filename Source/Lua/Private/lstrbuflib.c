@@ -0,0 +1,363 @@
+/*
+** String Buffer Library
+** Growable string builders, to avoid the quadratic cost of building a
+** string with repeated concatenation ('s = s .. x')
+** See Copyright Notice in lua.h
+*/
+
+#define lstrbuflib_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <float.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lapi.h"
+#include "lauxlib.h"
+#include "lctype.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "lualib.h"
+
+
+#define STRBUF_MT	"strbuf"
+
+/* minimum capacity of a buffer */
+#define MINCAP		(LUAI_MAXSHORTLEN * 2)
+
+/* space for a formatted number (see 'MAX_ITEM' in lstrlib.c) */
+#define MAX_ITEM	(120 + l_mathlim(MAX_10_EXP))
+
+/* valid flags in a format specification */
+#define FLAGS		"-+ #0"
+
+/* maximum size of each format specification (such as "%-099.99d") */
+#define MAX_FORMAT	32
+
+
+/*
+** The contents of a buffer live in a block laid out as a long string
+** ('sizelstring(cap)' bytes, text at the 'getstr' offset), so that
+** 'tostring' can hand the block itself to the collector as the result
+** (see 'luaS_adoptlngstr'). After that the buffer is "frozen": its
+** contents are that string, kept in the userdata's user value, and the
+** next change copies them into a new block.
+*/
+typedef struct StrBuf {
+  char *block;  /* block with the contents, or NULL */
+  size_t cap;  /* capacity of 'block' (in characters) */
+  size_t n;  /* number of characters in the buffer */
+  int frozen;  /* contents are the string in the user value */
+} StrBuf;
+
+
+#define text(sb)	((sb)->block + sizeof(UTString))
+
+#define checkbuf(L,i)	((StrBuf *)luaL_checkudata(L, i, STRBUF_MT))
+
+
+static void freeblock (lua_State *L, StrBuf *sb) {
+  if (sb->block != NULL) {
+    luaM_realloc_(L, sb->block, sizelstring(sb->cap), 0);
+    sb->block = NULL;
+    sb->cap = 0;
+  }
+}
+
+
+/* maximum number of characters in a buffer */
+#define MAXBUF		((MAX_SIZE - sizeof(UTString) - 1) / 2)
+
+
+/*
+** Make room for 'sz' more characters in the buffer at index 'i',
+** growing it geometrically. Returns where they must be written.
+*/
+static char *prepbuf (lua_State *L, int i, StrBuf *sb, size_t sz) {
+  if (sz > MAXBUF - sb->n)
+    luaL_error(L, "buffer too large");
+  if (sb->frozen) {  /* contents are a string? copy them to a new block */
+    size_t newcap = (sb->n + sz < MINCAP) ? MINCAP : sb->n + sz;
+    lua_getuservalue(L, i);
+    sb->block = (char *)luaM_realloc_(L, NULL, 0, sizelstring(newcap));
+    sb->cap = newcap;
+    memcpy(text(sb), lua_tostring(L, -1), sb->n * sizeof(char));
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_setuservalue(L, i);  /* release old string */
+    sb->frozen = 0;
+  }
+  else if (sb->cap - sb->n < sz) {  /* not enough space? */
+    size_t newcap = sb->cap * 2;
+    if (newcap < sb->n + sz)  /* not big enough? */
+      newcap = sb->n + sz;
+    if (newcap < MINCAP)
+      newcap = MINCAP;
+    sb->block = (char *)luaM_realloc_(L, sb->block,
+                           sb->block ? sizelstring(sb->cap) : 0,
+                           sizelstring(newcap));
+    sb->cap = newcap;
+  }
+  return text(sb) + sb->n;
+}
+
+
+static void addlstring (lua_State *L, int i, StrBuf *sb, const char *s,
+                        size_t l) {
+  if (l > 0) {
+    char *p = prepbuf(L, i, sb, l);
+    memcpy(p, s, l * sizeof(char));
+    sb->n += l;
+  }
+}
+
+
+/*
+** Append the number at index 'arg' with the same format as 'tostring'
+*/
+static void addnumber (lua_State *L, int i, StrBuf *sb, int arg) {
+  char *buff = prepbuf(L, i, sb, MAX_ITEM);
+  size_t len;
+  if (lua_isinteger(L, arg))
+    len = lua_integer2str(buff, MAX_ITEM, lua_tointeger(L, arg));
+  else {
+    len = lua_number2str(buff, MAX_ITEM, lua_tonumber(L, arg));
+#if !defined(LUA_COMPAT_FLOATSTRING)
+    if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
+      buff[len++] = lua_getlocaledecpoint();
+      buff[len++] = '0';  /* adds '.0' to result */
+    }
+#endif
+  }
+  sb->n += len;
+}
+
+
+static void addvalue (lua_State *L, int i, StrBuf *sb, int arg) {
+  switch (lua_type(L, arg)) {
+    case LUA_TSTRING: {
+      size_t l;
+      const char *s = lua_tolstring(L, arg, &l);
+      addlstring(L, i, sb, s, l);
+      break;
+    }
+    case LUA_TNUMBER: {
+      addnumber(L, i, sb, arg);
+      break;
+    }
+    default: {
+      StrBuf *other = (StrBuf *)luaL_testudata(L, arg, STRBUF_MT);
+      if (other == NULL)
+        luaL_argerror(L, arg, lua_pushfstring(L,
+                      "string, number or strbuf expected, got %s",
+                      luaL_typename(L, arg)));
+      else if (other->frozen) {
+        lua_getuservalue(L, arg);
+        addvalue(L, i, sb, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+      else if (other->n > 0) {
+        prepbuf(L, i, sb, other->n);  /* may move 'other' if it is 'sb' */
+        memcpy(text(sb) + sb->n, text(other), other->n * sizeof(char));
+        sb->n += other->n;
+      }
+      break;
+    }
+  }
+}
+
+
+static int sb_new (lua_State *L) {
+  lua_Integer cap = luaL_optinteger(L, 1, 0);
+  StrBuf *sb = (StrBuf *)lua_newuserdata(L, sizeof(StrBuf));
+  sb->block = NULL;
+  sb->cap = sb->n = 0;
+  sb->frozen = 0;
+  luaL_setmetatable(L, STRBUF_MT);
+  luaL_argcheck(L, cap >= 0, 1, "invalid capacity");
+  if (cap > 0)
+    prepbuf(L, lua_gettop(L), sb, (size_t)cap);
+  return 1;
+}
+
+
+/* sb:append(v1, v2, ...) -> sb */
+static int sb_append (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  int n = lua_gettop(L);
+  int arg;
+  for (arg = 2; arg <= n; arg++)
+    addvalue(L, 1, sb, arg);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** sb:appendnum(x [, fmt]) -> sb
+** 'fmt' is a single 'string.format' conversion for numbers, such as
+** "%.3f" or "%08x", written directly into the buffer.
+*/
+static int sb_appendnum (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  luaL_checknumber(L, 2);
+  if (lua_isnoneornil(L, 3))
+    addnumber(L, 1, sb, 2);
+  else {
+    const char *strfrmt = luaL_checkstring(L, 3);
+    const char *p = strfrmt;
+    char form[MAX_FORMAT];
+    char *buff;
+    int nb;
+    if (*p++ != '%')
+      luaL_argerror(L, 3, "format must start with '%'");
+    strfrmt = p;
+    while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
+    if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
+      luaL_argerror(L, 3, "invalid format (repeated flags)");
+    if (lisdigit(cast_uchar(*p))) p++;  /* skip width */
+    if (lisdigit(cast_uchar(*p))) p++;  /* (2 digits at most) */
+    if (*p == '.') {
+      p++;
+      if (lisdigit(cast_uchar(*p))) p++;  /* skip precision */
+      if (lisdigit(cast_uchar(*p))) p++;  /* (2 digits at most) */
+    }
+    if (*p == '\0' || *(p + 1) != '\0' || strchr("dioxXeEfgG", *p) == NULL)
+      luaL_argerror(L, 3, "invalid format (expected one number conversion)");
+    form[0] = '%';
+    memcpy(form + 1, strfrmt, (p - strfrmt) * sizeof(char));
+    form[1 + (p - strfrmt)] = '\0';
+    buff = prepbuf(L, 1, sb, MAX_ITEM);
+    if (strchr("dioxX", *p) != NULL) {  /* integer conversion? */
+      lua_Integer n = luaL_checkinteger(L, 2);
+      strcat(form, LUA_INTEGER_FRMLEN);
+      strncat(form, p, 1);
+      nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACINT)n);
+    }
+    else {
+      strcat(form, LUA_NUMBER_FRMLEN);
+      strncat(form, p, 1);
+      nb = l_sprintf(buff, MAX_ITEM, form,
+                     (LUAI_UACNUMBER)lua_tonumber(L, 2));
+    }
+    lua_assert(nb >= 0 && nb < MAX_ITEM);
+    sb->n += nb;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* sb:reserve(n) -> sb: make room for 'n' more characters */
+static int sb_reserve (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  lua_Integer sz = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, sz >= 0, 2, "invalid size");
+  if (sz > 0)
+    prepbuf(L, 1, sb, (size_t)sz);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_len (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  lua_pushinteger(L, (lua_Integer)sb->n);
+  return 1;
+}
+
+
+/* sb:clear() -> sb: empty the buffer, keeping its block */
+static int sb_clear (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  if (sb->frozen) {
+    lua_pushnil(L);
+    lua_setuservalue(L, 1);
+    sb->frozen = 0;
+  }
+  sb->n = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** sb:tostring() -> string
+** Long results take over the buffer block (no copy); the buffer keeps
+** them as its contents until it is changed again. Short results are
+** interned as usual and the block is kept.
+*/
+static int sb_tostring (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  if (sb->frozen)
+    lua_getuservalue(L, 1);
+  else if (sb->n <= LUAI_MAXSHORTLEN)
+    lua_pushlstring(L, sb->n > 0 ? text(sb) : "", sb->n);
+  else {
+    TString *ts = luaS_adoptlngstr(L, sb->block, sb->cap, sb->n);
+    sb->block = NULL;
+    sb->cap = 0;
+    lua_lock(L);
+    setsvalue2s(L, L->top, ts);
+    api_incr_top(L);
+    luaC_checkGC(L);
+    lua_unlock(L);
+    lua_pushvalue(L, -1);
+    lua_setuservalue(L, 1);
+    sb->frozen = 1;
+  }
+  return 1;
+}
+
+
+static int sb_gc (lua_State *L) {
+  StrBuf *sb = checkbuf(L, 1);
+  freeblock(L, sb);
+  return 0;
+}
+
+
+static const luaL_Reg sb_funcs[] = {
+  {"new", sb_new},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg sb_meth[] = {
+  {"append", sb_append},
+  {"appendnum", sb_appendnum},
+  {"reserve", sb_reserve},
+  {"len", sb_len},
+  {"clear", sb_clear},
+  {"tostring", sb_tostring},
+  {"__len", sb_len},
+  {"__tostring", sb_tostring},
+  {"__gc", sb_gc},
+  {NULL, NULL}
+};
+
+
+static void createmeta (lua_State *L) {
+  luaL_newmetatable(L, STRBUF_MT);
+  luaL_setfuncs(L, sb_meth, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  lua_pop(L, 1);
+}
+
+
+LUAMOD_API int luaopen_strbuf (lua_State *L) {
+  luaL_newlib(L, sb_funcs);
+  createmeta(L);
+  return 1;
+}
+
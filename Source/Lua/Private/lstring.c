@@ -25,15 +25,6 @@
 #define MEMERRMSG       "not enough memory"
 
 
-/*
-** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
-*/
-#if !defined(LUAI_HASHLIMIT)
-#define LUAI_HASHLIMIT		5
-#endif
-
-
 /*
 ** equality for long strings
 */
@@ -42,19 +33,178 @@ int luaS_eqlngstr (TString *a, TString *b) {
   lua_assert(a->tt == LUA_TLNGSTR && b->tt == LUA_TLNGSTR);
   return (a == b) ||  /* same instance or... */
     ((len == b->u.lnglen) &&  /* equal length and ... */
+     /* ... no cached hashes telling them apart and ... */
+     !(a->extra && b->extra && a->hash != b->hash) &&
      (memcmp(getstr(a), getstr(b), len) == 0));  /* equal contents */
 }
 
 
+/*
+** Hashing works on 64-bit words. 'mum' multiplies two words and folds
+** the high half of the 128-bit product back into the low half; it is
+** the only mixing step of the hash. A product is zero whenever one of
+** its factors is, so data words are XORed with a secret derived from
+** the seed before entering a product; otherwise a block equal to a
+** known constant would wipe out the state accumulated so far.
+*/
+typedef unsigned long long l_hashword;
+
+#if defined(__SIZEOF_INT128__)
+
+static l_hashword mum (l_hashword a, l_hashword b) {
+  unsigned __int128 r = (unsigned __int128)a * b;
+  return cast(l_hashword, r) ^ cast(l_hashword, r >> 64);
+}
+
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+
+#include <intrin.h>
+
+static l_hashword mum (l_hashword a, l_hashword b) {
+  l_hashword hi;
+  l_hashword lo = _umul128(a, b, &hi);
+  return lo ^ hi;
+}
+
+#else
+
+static l_hashword mum (l_hashword a, l_hashword b) {
+  l_hashword ha = a >> 32, hb = b >> 32;
+  l_hashword la = (unsigned int)a, lb = (unsigned int)b;
+  l_hashword rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  l_hashword t = rl + (rm0 << 32);
+  l_hashword lo = t + (rm1 << 32);
+  l_hashword hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+  return lo ^ hi;
+}
+
+#endif
+
+
+/* odd constants with well-spread bits */
+#define HASHK0		0xa0761d6478bd642fULL
+#define HASHK1		0xe7037ed1a0b428dbULL
+#define HASHK2		0x8ebc6af09c88c6e3ULL
+#define HASHK3		0x589965cc75374cc3ULL
+
+
+/* unaligned loads ('memcpy' of a constant size compiles to one move) */
+static l_hashword read64 (const char *p) {
+  l_hashword v; memcpy(&v, p, sizeof(v)); return v;
+}
+
+static l_hashword read32 (const char *p) {
+  unsigned int v; memcpy(&v, p, sizeof(v)); return v;
+}
+
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+
+#include <emmintrin.h>
+
+/*
+** Minimum length for the vectorized loop; below it the scalar loop
+** over 16-byte blocks is faster than setting up the accumulators.
+*/
+#define HASHSIMDMIN	128
+
+#define mul64by32(v,k) \
+  _mm_add_epi64(_mm_mul_epu32(v, k), \
+                _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), k), 32))
+
+/*
+** Hash 32-byte stripes with two SSE2 accumulators of two 64-bit lanes.
+** Each lane adds the 32x32->64 product of the two halves of the keyed
+** data plus the data itself with its halves swapped, so a change in
+** any input bit reaches the high half of the lane. Accumulators are
+** scrambled every 16 stripes to keep them from saturating. Returns
+** the number of bytes consumed (a multiple of 32).
+*/
+static size_t hashsimd (const char *str, size_t l, l_hashword k,
+                        l_hashword *h) {
+  const __m128i k0 = _mm_set_epi64x((long long)(k ^ HASHK1),
+                                    (long long)(*h ^ HASHK2));
+  const __m128i k1 = _mm_set_epi64x((long long)(k ^ HASHK3),
+                                    (long long)(*h ^ HASHK0));
+  const __m128i prime = _mm_set1_epi32((int)0x9E3779B1);
+  __m128i acc0 = k1, acc1 = k0;
+  size_t n = l / 32;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    __m128i d0 = _mm_loadu_si128((const __m128i *)(str + i * 32));
+    __m128i d1 = _mm_loadu_si128((const __m128i *)(str + i * 32 + 16));
+    __m128i x0 = _mm_xor_si128(d0, k0);
+    __m128i x1 = _mm_xor_si128(d1, k1);
+    acc0 = _mm_add_epi64(acc0, _mm_shuffle_epi32(d0, _MM_SHUFFLE(1,0,3,2)));
+    acc1 = _mm_add_epi64(acc1, _mm_shuffle_epi32(d1, _MM_SHUFFLE(1,0,3,2)));
+    acc0 = _mm_add_epi64(acc0,
+      _mm_mul_epu32(x0, _mm_shuffle_epi32(x0, _MM_SHUFFLE(0,3,0,1))));
+    acc1 = _mm_add_epi64(acc1,
+      _mm_mul_epu32(x1, _mm_shuffle_epi32(x1, _MM_SHUFFLE(0,3,0,1))));
+    if ((i & 15) == 15) {  /* scramble */
+      acc0 = _mm_xor_si128(_mm_xor_si128(acc0, _mm_srli_epi64(acc0, 47)), k0);
+      acc1 = _mm_xor_si128(_mm_xor_si128(acc1, _mm_srli_epi64(acc1, 47)), k1);
+      acc0 = mul64by32(acc0, prime);
+      acc1 = mul64by32(acc1, prime);
+    }
+  }
+  {  /* fold the four lanes into the scalar state */
+    l_hashword a[4];
+    _mm_storeu_si128((__m128i *)a, acc0);
+    _mm_storeu_si128((__m128i *)(a + 2), acc1);
+    *h = mum(a[0] ^ k, a[1] ^ *h);
+    *h = mum(a[2] ^ k, a[3] ^ *h);
+  }
+  return n * 32;
+}
+
+#endif
+
+
+/*
+** Seeded hash over the whole string, one word at a time. (The old hash
+** sampled at most 32 characters of a long string, so strings differing
+** only in unsampled positions collided whatever the seed.) Every block
+** is mixed with the running state, which starts from the per-state
+** random seed, so colliding keys cannot be precomputed without it.
+*/
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
-  unsigned int h = seed ^ cast(unsigned int, l);
-  size_t step = (l >> LUAI_HASHLIMIT) + 1;
-  for (; l >= step; l -= step)
-    h ^= ((h<<5) + (h>>2) + cast_byte(str[l - 1]));
-  return h;
+  l_hashword k = mum(seed ^ HASHK2, HASHK3);  /* secret */
+  l_hashword h = mum(seed ^ HASHK0, cast(l_hashword, l) ^ HASHK1);
+  l_hashword a, b;
+#if defined(HASHSIMDMIN)
+  if (l >= HASHSIMDMIN) {
+    size_t done = hashsimd(str, l, k, &h);
+    str += done; l -= done;
+  }
+#endif
+  while (l > 16) {
+    h = mum(read64(str) ^ k, read64(str + 8) ^ h);
+    str += 16; l -= 16;
+  }
+  if (l >= 8) {  /* 8 to 16 bytes: two (possibly overlapping) words */
+    a = read64(str);
+    b = read64(str + l - 8);
+  }
+  else if (l >= 4) {  /* 4 to 7 bytes: two (possibly overlapping) halves */
+    a = read32(str);
+    b = read32(str + l - 4);
+  }
+  else if (l > 0) {  /* 1 to 3 bytes */
+    a = (cast(l_hashword, cast_byte(str[0])) << 16) |
+        (cast(l_hashword, cast_byte(str[l >> 1])) << 8) |
+        cast_byte(str[l - 1]);
+    b = 0;
+  }
+  else
+    a = b = 0;
+  h = mum(a ^ k ^ l, b ^ h);
+  h = mum(h ^ HASHK0, h ^ HASHK2);
+  return cast(unsigned int, h ^ (h >> 32));
 }
 
 
+
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
   if (ts->extra == 0) {  /* no hash? */
@@ -151,6 +301,33 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+/*
+** Turns a block of size 'sizelstring(cap)', allocated with 'luaM_' and
+** holding 'l' characters at its 'getstr' offset, into a long string.
+** The block is shrunk to the exact size of the string (which does not
+** move it with usual allocators) and is owned by the collector from
+** now on, so strings built in place need no final copy.
+*/
+TString *luaS_adoptlngstr (lua_State *L, void *block, size_t cap, size_t l) {
+  global_State *g = G(L);
+  GCObject *o;
+  TString *ts;
+  lua_assert(l > LUAI_MAXSHORTLEN && l <= cap);
+  o = cast(GCObject *, luaM_realloc_(L, block, sizelstring(cap),
+                                     sizelstring(l)));
+  o->marked = luaC_white(g);  /* same as 'luaC_newobj' */
+  o->tt = LUA_TLNGSTR;
+  o->next = g->allgc;
+  g->allgc = o;
+  ts = gco2ts(o);
+  ts->hash = g->seed;
+  ts->extra = 0;
+  ts->u.lnglen = l;
+  getstr(ts)[l] = '\0';  /* ending 0 */
+  return ts;
+}
+
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
   TString **p = &tb->hash[lmod(ts->hash, tb->size)];
@@ -525,28 +525,148 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+/*
+** {======================================================
+** Plain (literal) substring search
+** =======================================================
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define SIMDFIND	/* vectorized search available */
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int l_ctz (unsigned int m) {
+  unsigned long i; _BitScanForward(&i, m); return (int)i;
+}
+#else
+#define l_ctz(m)	__builtin_ctz(m)
+#endif
+static const char *simdfind (const char *s1, size_t l1,
+                             const char *s2, size_t l2);
+#endif
+
+
+/*
+** Search with 'memchr' for the first character of 's2'. That is the
+** fastest way while candidates are rare; when they turn out to be
+** frequent (more than one false candidate every FINDDENSE bytes
+** scanned) and 'dense' is set, switch to the vectorized filter.
+*/
+#define FINDDENSE	64
+
+static const char *scalarfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2, int dense) {
+  const char *init;  /* to search for a '*s2' inside 's1' */
+  const char *start = s1;
+  size_t misses = 0;
+  l2--;  /* 1st char will be checked by 'memchr' */
+  l1 = l1-l2;  /* 's2' cannot be found after that */
+  while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+    init++;   /* 1st char is already checked */
+    if (memcmp(init, s2+1, l2) == 0)
+      return init-1;
+    else {  /* correct 'l1' and 's1' to try again */
+      l1 -= init-s1;
+      s1 = init;
+#if defined(SIMDFIND)
+      if (dense && ++misses * FINDDENSE > (size_t)(s1 - start) && l1 > 32)
+        return simdfind(s1, l1 + l2, s2, l2 + 1);
+#else
+      (void)dense; (void)start; (void)misses;
+#endif
+    }
+  }
+  return NULL;  /* not found */
+}
+
+
+#if defined(SIMDFIND)
+
+/*
+** Vectorized search: compare a block of candidate positions at once
+** against the first and the last characters of 's2' (loading the
+** subject at two offsets) and check only the positions where both
+** match. Requires 'l2 >= 2' and 'l1 >= l2'; every load stays inside
+** 's1' because blocks only cover candidate positions.
+*/
+static const char *simdfind (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+  size_t n = l1 - l2 + 1;  /* number of candidate positions */
+  size_t i = 0;
+  const char *last = s1 + l2 - 1;
+#if defined(__AVX2__)
+  const __m256i vf32 = _mm256_set1_epi8(s2[0]);
+  const __m256i vl32 = _mm256_set1_epi8(s2[l2 - 1]);
+  for (; i + 32 <= n; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(s1 + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(last + i));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(bf, vf32),
+                         _mm256_cmpeq_epi8(bl, vl32)));
+    while (mask) {
+      size_t pos = i + l_ctz(mask);
+      if (memcmp(s1 + pos + 1, s2 + 1, l2 - 2) == 0)
+        return s1 + pos;
+      mask &= mask - 1;  /* clear lowest candidate */
+    }
+  }
+#endif
+  {
+    const __m128i vf = _mm_set1_epi8(s2[0]);
+    const __m128i vl = _mm_set1_epi8(s2[l2 - 1]);
+    for (; i + 16 <= n; i += 16) {
+      __m128i bf = _mm_loadu_si128((const __m128i *)(s1 + i));
+      __m128i bl = _mm_loadu_si128((const __m128i *)(last + i));
+      unsigned int mask = (unsigned int)_mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpeq_epi8(bf, vf), _mm_cmpeq_epi8(bl, vl)));
+      while (mask) {
+        size_t pos = i + l_ctz(mask);
+        if (memcmp(s1 + pos + 1, s2 + 1, l2 - 2) == 0)
+          return s1 + pos;
+        mask &= mask - 1;  /* clear lowest candidate */
+      }
+    }
+  }
+  /* less than a block of candidates left */
+  return scalarfind(s1 + i, l1 - i, s2, l2, 0);
+}
+
+#endif
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
-  else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
-    }
-    return NULL;  /* not found */
-  }
+  else if (l2 == 1)  /* 'memchr' is already vectorized */
+    return (const char *)memchr(s1, *s2, l1);
+  else return scalarfind(s1, l1, s2, l2, 1);
 }
 
 
+/*
+** Length of the literal prefix of pattern 'p': the leading characters
+** that can only match themselves, excluding a last one made optional
+** by a following '*', '?' or '-'. Every match of the pattern (without
+** anchor) starts with that prefix, so a search can jump between its
+** occurrences using 'lmemfind'.
+*/
+static size_t literalprefix (const char *p, size_t lp) {
+  size_t i = 0;
+  while (i < lp && !strchr(SPECIALS ")", p[i]))
+    i++;
+  if (i > 0 && i < lp && strchr("*?-", p[i]))
+    i--;  /* last literal has a suffix */
+  return i;
+}
+
+/* }====================================================== */
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -604,6 +724,492 @@ static void reprepstate (MatchState *ms) {
 }
 
 
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
+
+/*
+** 'find', 'match', 'gmatch' and 'gsub' compile their patterns once
+** into a sequence of instructions and keep them in a cache (their
+** first upvalue) with LRU eviction, keyed by the pattern string.
+** Classes and sets become maps of 256 bits built with 'match_class'
+** and 'matchbracketclass', so they reflect the locale at compilation
+** time. A pattern that does not compile (because it is malformed; the
+** interpreter reports those errors only when it reaches them) is
+** matched by 'match' as before.
+*/
+
+#if !defined(LUA_PATCACHESIZE)
+#define LUA_PATCACHESIZE	64
+#endif
+
+
+/* instruction opcodes */
+#define PI_END		0	/* end of pattern */
+#define PI_CHAR		1	/* single character 'c' */
+#define PI_ANY		2	/* '.' */
+#define PI_SET		3	/* class or set in 'map' */
+#define PI_OPEN		4	/* '(' */
+#define PI_POSITION	5	/* '()' */
+#define PI_CLOSE	6	/* ')' */
+#define PI_BALANCE	7	/* '%b' with delimiters 'c' and 'c2' */
+#define PI_FRONTIER	8	/* '%f' with set in 'map' */
+#define PI_BACKREF	9	/* '%0'-'%9' with digit 'c' */
+#define PI_EOS		10	/* '$' at the end of the pattern */
+
+#define MAPSIZE		((UCHAR_MAX + 1) / CHAR_BIT)
+
+#define inmap(m,c)	((m)[(c) / CHAR_BIT] & (1u << ((c) % CHAR_BIT)))
+
+
+typedef struct PatInst {
+  unsigned char op;
+  unsigned char rep;  /* suffix of single-char items: 0, '*', '+', '-', '?' */
+  unsigned char c, c2;
+  const unsigned char *map;  /* character map for PI_SET/PI_FRONTIER */
+} PatInst;
+
+
+typedef struct Pattern {
+  int slot;  /* position in the cache */
+  size_t lpre;  /* length of literal prefix */
+  const char *prefix;  /* literal prefix (stored after the maps) */
+  PatInst code[1];  /* variable size */
+} Pattern;
+
+
+/* same as 'classend', but returns NULL instead of raising errors */
+static const char *classend_c (const char *p, const char *p_end) {
+  switch (*p++) {
+    case L_ESC: {
+      return (p == p_end) ? NULL : p+1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p == p_end)
+          return NULL;
+        if (*(p++) == L_ESC && p < p_end)
+          p++;  /* skip escapes (e.g. '%]') */
+      } while (*p != ']');
+      return p+1;
+    }
+    default: {
+      return p;
+    }
+  }
+}
+
+
+/*
+** Fill 'map' with the characters matched by class 'p' (a '%' escape
+** or a set ending at 'ep') and return the opcode for it: sets of one
+** character become PI_CHAR (with that character in '*c') and sets of
+** all characters become PI_ANY.
+*/
+static int buildmap (unsigned char *map, const char *p, const char *ep,
+                     unsigned char *c) {
+  int i, n = 0;
+  memset(map, 0, MAPSIZE);
+  for (i = 0; i <= UCHAR_MAX; i++) {
+    if (*p == L_ESC ? match_class(i, uchar(*(p+1)))
+                    : matchbracketclass(i, p, ep-1)) {
+      map[i / CHAR_BIT] |= 1u << (i % CHAR_BIT);
+      *c = (unsigned char)i;
+      n++;
+    }
+  }
+  return (n == 1) ? PI_CHAR : (n == UCHAR_MAX + 1) ? PI_ANY : PI_SET;
+}
+
+
+/*
+** Compile pattern 'p' into 'pt' (when not NULL), mirroring the way
+** 'match' reads it. Counts the instructions and maps needed into
+** 'ninst' and 'nmaps'. Returns 0 if the pattern is malformed.
+*/
+static int pcompile (const char *p, const char *p_end, Pattern *pt,
+                     unsigned char *maps, int *ninst, int *nmaps) {
+  int open = 0;  /* number of open captures */
+  int ncap = 0;  /* total number of captures */
+  *ninst = *nmaps = 0;
+  for (;;) {
+    PatInst dummy;
+    PatInst *pi = (pt != NULL) ? &pt->code[*ninst] : &dummy;
+    unsigned char *map = (maps != NULL) ? maps + *nmaps * MAPSIZE : NULL;
+    (*ninst)++;
+    pi->rep = 0; pi->c = pi->c2 = 0; pi->map = NULL;
+    if (p == p_end) {
+      pi->op = PI_END;
+      return 1;
+    }
+    switch (*p) {
+      case '(': {
+        if (++ncap > LUA_MAXCAPTURES) return 0;
+        if (*(p + 1) == ')') {  /* position capture? */
+          pi->op = PI_POSITION; p += 2;
+        }
+        else {
+          pi->op = PI_OPEN; p++; open++;
+        }
+        continue;
+      }
+      case ')': {
+        if (open-- == 0) return 0;
+        pi->op = PI_CLOSE; p++;
+        continue;
+      }
+      case '$': {
+        if ((p + 1) != p_end)  /* is the '$' the last char in pattern? */
+          goto dflt;  /* no; go to default */
+        pi->op = PI_EOS; p++;
+        continue;
+      }
+      case L_ESC: {
+        switch (*(p + 1)) {
+          case 'b': {
+            if (p + 2 >= p_end - 1) return 0;
+            pi->op = PI_BALANCE;
+            pi->c = uchar(*(p + 2)); pi->c2 = uchar(*(p + 3));
+            p += 4;
+            continue;
+          }
+          case 'f': {
+            const char *ep;
+            p += 2;
+            if (*p != '[' || (ep = classend_c(p, p_end)) == NULL) return 0;
+            if (map != NULL) {
+              unsigned char c;
+              buildmap(map, p, ep, &c);
+              pi->map = map;
+            }
+            pi->op = PI_FRONTIER;
+            (*nmaps)++;
+            p = ep;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            pi->op = PI_BACKREF; pi->c = uchar(*(p + 1));
+            p += 2;
+            continue;
+          }
+          default: goto dflt;
+        }
+      }
+      default: dflt: {
+        const char *ep = classend_c(p, p_end);
+        if (ep == NULL) return 0;
+        if (*p == '.')
+          pi->op = PI_ANY;
+        else if (*p != L_ESC && *p != '[') {
+          pi->op = PI_CHAR; pi->c = uchar(*p);
+        }
+        else {
+          if (map != NULL) {
+            pi->op = (unsigned char)buildmap(map, p, ep, &pi->c);
+            if (pi->op == PI_SET)
+              pi->map = map;
+          }
+          (*nmaps)++;
+        }
+        if (ep < p_end && *ep != '\0' && strchr("*+-?", *ep)) {
+          pi->rep = uchar(*ep);
+          ep++;
+        }
+        p = ep;
+        continue;
+      }
+    }
+  }
+}
+
+
+/*
+** Push a new compiled pattern for 'p' and return it, or return NULL
+** (pushing nothing) if 'p' is malformed.
+*/
+static Pattern *newpattern (lua_State *L, const char *p, size_t lp) {
+  int ninst, nmaps, i;
+  size_t lpre = 0;
+  Pattern *pt;
+  unsigned char *maps;
+  char *prefix;
+  if (!pcompile(p, p + lp, NULL, NULL, &ninst, &nmaps))
+    return NULL;
+  pt = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                   (ninst - 1) * sizeof(PatInst) + nmaps * MAPSIZE + ninst);
+  maps = (unsigned char *)&pt->code[ninst];
+  pcompile(p, p + lp, pt, maps, &ninst, &nmaps);
+  /* literal prefix: leading characters without a suffix; a '+' keeps
+     its character (which must appear once) but ends the prefix */
+  prefix = (char *)(maps + nmaps * MAPSIZE);
+  for (i = 0; pt->code[i].op == PI_CHAR && pt->code[i].rep != '*' &&
+              pt->code[i].rep != '-' && pt->code[i].rep != '?'; i++) {
+    prefix[lpre++] = (char)pt->code[i].c;
+    if (pt->code[i].rep == '+') break;
+  }
+  pt->prefix = prefix;
+  pt->lpre = lpre;
+  pt->slot = -1;
+  return pt;
+}
+
+
+typedef struct PatCache {
+  unsigned int tick;  /* incremented at each use */
+  int n;  /* number of slots in use */
+  unsigned int used[LUA_PATCACHESIZE];  /* tick of last use of each slot */
+} PatCache;
+
+
+/*
+** Get the compiled form of the pattern 'p' (with length 'lp'), which
+** is argument 'arg' possibly without its anchor. Leaves the compiled
+** pattern (or nil) on the top of the stack, so that it cannot be
+** collected while in use even if evicted by a nested call (e.g. from
+** a 'gsub' replacement function). The cache table, the uservalue of
+** the upvalue, maps pattern strings to compiled patterns and slot
+** numbers to pattern strings.
+*/
+static const Pattern *getpattern (lua_State *L, int arg,
+                                  const char *p, size_t lp) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  Pattern *pt;
+  int slot;
+  lua_getuservalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, arg);
+  if (lua_rawget(L, -2) == LUA_TUSERDATA) {  /* hit? */
+    pt = (Pattern *)lua_touserdata(L, -1);
+    pc->used[pt->slot] = ++pc->tick;
+    lua_remove(L, -2);  /* remove cache table */
+    return pt;
+  }
+  lua_pop(L, 1);  /* pop nil */
+  if ((pt = newpattern(L, p, lp)) == NULL) {
+    lua_pop(L, 1);  /* pop cache table */
+    lua_pushnil(L);
+    return NULL;
+  }
+  if (pc->n < LUA_PATCACHESIZE)  /* free slot? */
+    slot = pc->n++;
+  else {  /* evict least recently used pattern */
+    int i;
+    slot = 0;
+    for (i = 1; i < LUA_PATCACHESIZE; i++) {
+      if (pc->used[i] < pc->used[slot])
+        slot = i;
+    }
+    lua_rawgeti(L, -2, slot + 1);  /* key of evicted pattern */
+    lua_pushnil(L);
+    lua_rawset(L, -4);  /* cache[key] = nil */
+  }
+  pt->slot = slot;
+  pc->used[slot] = ++pc->tick;
+  lua_pushvalue(L, arg);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);  /* cache[pattern] = compiled */
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -3, slot + 1);  /* cache[slot] = pattern */
+  lua_remove(L, -2);  /* remove cache table */
+  return pt;
+}
+
+
+static void createpatcache (lua_State *L) {
+  PatCache *pc = (PatCache *)lua_newuserdata(L, sizeof(PatCache));
+  pc->tick = 0;
+  pc->n = 0;
+  lua_createtable(L, LUA_PATCACHESIZE, LUA_PATCACHESIZE);
+  lua_setuservalue(L, -2);
+}
+
+
+static const char *pmatch (MatchState *ms, const char *s, const PatInst *pi);
+
+
+static int psingle (MatchState *ms, const char *s, const PatInst *pi) {
+  if (s >= ms->src_end)
+    return 0;
+  else {
+    int c = uchar(*s);
+    switch (pi->op) {
+      case PI_CHAR: return (pi->c == c);
+      case PI_ANY: return 1;
+      default: return inmap(pi->map, c) != 0;
+    }
+  }
+}
+
+
+static const char *pbalance (MatchState *ms, const char *s,
+                             const PatInst *pi) {
+  if (uchar(*s) != pi->c) return NULL;
+  else {
+    int cont = 1;
+    while (++s < ms->src_end) {
+      if (uchar(*s) == pi->c2) {
+        if (--cont == 0) return s+1;
+      }
+      else if (uchar(*s) == pi->c) cont++;
+    }
+  }
+  return NULL;  /* string ends out of balance */
+}
+
+
+static const char *pmax_expand (MatchState *ms, const char *s,
+                                const PatInst *pi) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  if (pi->op == PI_ANY)
+    i = ms->src_end - s;
+  else {
+    while (psingle(ms, s + i, pi))
+      i++;
+  }
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    const char *res = pmatch(ms, (s+i), pi+1);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *pmin_expand (MatchState *ms, const char *s,
+                                const PatInst *pi) {
+  for (;;) {
+    const char *res = pmatch(ms, s, pi+1);
+    if (res != NULL)
+      return res;
+    else if (psingle(ms, s, pi))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *pstart_capture (MatchState *ms, const char *s,
+                                   const PatInst *pi, int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=pmatch(ms, s, pi)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *pend_capture (MatchState *ms, const char *s,
+                                 const PatInst *pi) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = pmatch(ms, s, pi)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+/* same as 'match', running a compiled pattern */
+static const char *pmatch (MatchState *ms, const char *s, const PatInst *pi) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto's to optimize tail recursion */
+  switch (pi->op) {
+    case PI_END: break;
+    case PI_OPEN: {  /* start capture */
+      s = pstart_capture(ms, s, pi + 1, CAP_UNFINISHED);
+      break;
+    }
+    case PI_POSITION: {  /* start position capture */
+      s = pstart_capture(ms, s, pi + 1, CAP_POSITION);
+      break;
+    }
+    case PI_CLOSE: {  /* end capture */
+      s = pend_capture(ms, s, pi + 1);
+      break;
+    }
+    case PI_EOS: {  /* check end of string */
+      s = (s == ms->src_end) ? s : NULL;
+      break;
+    }
+    case PI_BALANCE: {
+      s = pbalance(ms, s, pi);
+      if (s != NULL) {
+        pi++; goto init;
+      }
+      break;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+      if (!inmap(pi->map, previous) && inmap(pi->map, uchar(*s))) {
+        pi++; goto init;
+      }
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PI_BACKREF: {
+      s = match_capture(ms, s, pi->c);
+      if (s != NULL) {
+        pi++; goto init;
+      }
+      break;
+    }
+    default: {  /* single-char item plus optional suffix */
+      if (!psingle(ms, s, pi)) {
+        if (pi->rep == '*' || pi->rep == '?' || pi->rep == '-') {
+          pi++; goto init;  /* accept empty */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
+      }
+      else {  /* matched once */
+        switch (pi->rep) {  /* handle optional suffix */
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = pmatch(ms, s + 1, pi + 1)) != NULL)
+              s = res;
+            else {
+              pi++; goto init;
+            }
+            break;
+          }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = pmax_expand(ms, s, pi);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = pmin_expand(ms, s, pi);
+            break;
+          default:  /* no suffix */
+            s++; pi++; goto init;
+        }
+      }
+      break;
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/* match with the compiled pattern when there is one */
+#define domatch(ms,s,pt,p) \
+  ((pt) != NULL ? pmatch(ms, s, (pt)->code) : match(ms, s, p))
+
+/* }====================================================== */
+
+
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
   const char *s = luaL_checklstring(L, 1, &ls);
@@ -614,28 +1220,47 @@ static int str_find_aux (lua_State *L, int find) {
     lua_pushnil(L);  /* cannot find anything */
     return 1;
   }
-  /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+  /* explicit request or no special characters? ('match' must still
+     report a stray ')' as an error) */
+  if ((find && lua_toboolean(L, 4)) ||
+      (nospecials(p, lp) && (find || memchr(p, ')', lp) == NULL))) {
     /* do a plain search */
     const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
     if (s2) {
-      lua_pushinteger(L, (s2 - s) + 1);
-      lua_pushinteger(L, (s2 - s) + lp);
-      return 2;
+      if (find) {
+        lua_pushinteger(L, (s2 - s) + 1);
+        lua_pushinteger(L, (s2 - s) + lp);
+        return 2;
+      }
+      lua_settop(L, 2);  /* whole match is the pattern itself */
+      return 1;
     }
   }
   else {
     MatchState ms;
     const char *s1 = s + init - 1;
     int anchor = (*p == '^');
+    const Pattern *pt;
+    const char *pre = p;  /* literal prefix of pattern */
+    size_t lpre = 0;
     if (anchor) {
       p++; lp--;  /* skip anchor character */
     }
+    pt = getpattern(L, 2, p, lp);
+    if (!anchor) {
+      if (pt != NULL) {
+        pre = pt->prefix; lpre = pt->lpre;
+      }
+      else lpre = literalprefix(p, lp);
+    }
     prepstate(&ms, L, s, ls, p, lp);
     do {
       const char *res;
+      if (lpre > 0 &&  /* skip to next occurrence of the literal prefix */
+          (s1 = lmemfind(s1, ms.src_end - s1, pre, lpre)) == NULL)
+        break;
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=domatch(&ms, s1, pt, p)) != NULL) {
         if (find) {
           lua_pushinteger(L, (s1 - s) + 1);  /* start */
           lua_pushinteger(L, res - s);   /* end */
@@ -665,6 +1290,9 @@ static int str_match (lua_State *L) {
 typedef struct GMatchState {
   const char *src;  /* current position */
   const char *p;  /* pattern */
+  const Pattern *pt;  /* compiled pattern (or NULL) */
+  const char *pre;  /* literal prefix of pattern */
+  size_t lpre;  /* length of literal prefix */
   const char *lastmatch;  /* end of last match */
   MatchState ms;  /* match state */
 } GMatchState;
@@ -676,8 +1304,12 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if (gm->lpre > 0 &&  /* skip to next occurrence of the literal prefix */
+        (src = lmemfind(src, gm->ms.src_end - src, gm->pre, gm->lpre)) == NULL)
+      break;
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+    if ((e = domatch(&gm->ms, src, gm->pt, gm->p)) != NULL &&
+        e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
       return push_captures(&gm->ms, src, e);
     }
@@ -695,7 +1327,17 @@ static int gmatch (lua_State *L) {
   gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
   prepstate(&gm->ms, L, s, ls, p, lp);
   gm->src = s; gm->p = p; gm->lastmatch = NULL;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  /* 'gmatch' has no anchor, so a leading '^' compiles differently from
+     the other functions; leave such (odd) patterns uncached */
+  if (*p != '^')
+    gm->pt = getpattern(L, 2, p, lp);  /* also kept on closure */
+  else {
+    gm->pt = NULL;
+    lua_pushnil(L);
+  }
+  gm->pre = (gm->pt != NULL) ? gm->pt->prefix : p;
+  gm->lpre = (gm->pt != NULL) ? gm->pt->lpre : literalprefix(p, lp);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -768,20 +1410,36 @@ static int str_gsub (lua_State *L) {
   lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
   int anchor = (*p == '^');
   lua_Integer n = 0;  /* replacement count */
+  const Pattern *pt;
+  const char *pre = p;  /* literal prefix of pattern */
+  size_t lpre = 0;
   MatchState ms;
   luaL_Buffer b;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
-  luaL_buffinit(L, &b);
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
+  pt = getpattern(L, 2, p, lp);  /* (before the buffer uses the stack) */
+  if (!anchor) {
+    if (pt != NULL) {
+      pre = pt->prefix; lpre = pt->lpre;
+    }
+    else lpre = literalprefix(p, lp);
+  }
+  luaL_buffinit(L, &b);
   prepstate(&ms, L, src, srcl, p, lp);
   while (n < max_s) {
     const char *e;
+    if (lpre > 0) {  /* skip to next occurrence of the literal prefix */
+      const char *next = lmemfind(src, ms.src_end - src, pre, lpre);
+      if (next == NULL) break;  /* no more matches; copy the rest */
+      luaL_addlstring(&b, src, next - src);
+      src = next;
+    }
     reprepstate(&ms);  /* (re)prepare state for new match */
-    if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
+    if ((e = domatch(&ms, src, pt, p)) != NULL && e != lastmatch) {
       n++;
       add_value(&ms, &b, src, e, tr);  /* add replacement to buffer */
       src = lastmatch = e;
@@ -1543,13 +2201,9 @@ static const luaL_Reg strlib[] = {
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
-  {"find", str_find},
   {"format", str_format},
-  {"gmatch", gmatch},
-  {"gsub", str_gsub},
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
@@ -1561,6 +2215,16 @@ static const luaL_Reg strlib[] = {
 };
 
 
+/* functions sharing the cache of compiled patterns as upvalue */
+static const luaL_Reg patlib[] = {
+  {"find", str_find},
+  {"gmatch", gmatch},
+  {"gsub", str_gsub},
+  {"match", str_match},
+  {NULL, NULL}
+};
+
+
 static void createmetatable (lua_State *L) {
   lua_createtable(L, 0, 1);  /* table to be metatable for strings */
   lua_pushliteral(L, "");  /* dummy string */
@@ -1577,7 +2241,12 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_checkversion(L);
+  lua_createtable(L, 0, (sizeof(strlib) + sizeof(patlib)) /
+                        sizeof(strlib[0]) - 2);
+  luaL_setfuncs(L, strlib, 0);
+  createpatcache(L);
+  luaL_setfuncs(L, patlib, 1);
   createmetatable(L);
   return 1;
 }
@@ -10,7 +10,9 @@
 #include "lprefix.h"
 
 
+#include <float.h>
 #include <limits.h>
+#include <locale.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -408,12 +410,312 @@ static void auxsort (lua_State *L, IdxT lo, IdxT up,
 }
 
 
+/*
+** Native sort for arrays of only numbers or only strings, without a
+** comparison function and without a metatable (so that all accesses
+** are raw and no metamethod can observe the order of operations).
+** Keys are extracted into a C array, sorted with an introsort, and
+** written back in one pass: arrays of only integers or only floats
+** are rewritten from the keys; other arrays are permuted in place
+** following the cycles of the permutation. Anything else (mixed types,
+** NaNs, integers that do not fit exactly in a float when mixed with
+** floats) goes through 'auxsort'.
+*/
+
+/* 'l_intfitsf' as in 'lvm.c' */
+#if !defined(l_intfitsf)
+#define NBM		(l_mathlim(MANT_DIG))
+#if ((((LUA_MAXINTEGER >> (NBM / 4)) >> (NBM / 4)) >> (NBM / 4)) \
+	>> (NBM - (3 * (NBM / 4))))  >  0
+#define l_intfitsf(i)  \
+  (-((lua_Integer)1 << NBM) <= (i) && (i) <= ((lua_Integer)1 << NBM))
+#else
+#define l_intfitsf(i)	1
+#endif
+#endif
+
+
+typedef struct SortKey {
+  union {
+    lua_Integer i;
+    lua_Number n;
+    const char *s;
+  } u;
+  size_t len;  /* length of string keys */
+  IdxT pos;  /* original position of the value */
+  int isint;  /* number key is (still) an integer */
+} SortKey;
+
+typedef int (*SortLT) (const SortKey *a, const SortKey *b);
+
+
+static int lt_int (const SortKey *a, const SortKey *b) {
+  return a->u.i < b->u.i;
+}
+
+static int lt_num (const SortKey *a, const SortKey *b) {
+  return a->u.n < b->u.n;
+}
+
+/* string order in the "C" locale: bytes, then length */
+static int lt_strbytes (const SortKey *a, const SortKey *b) {
+  size_t l = (a->len < b->len) ? a->len : b->len;
+  int res = memcmp(a->u.s, b->u.s, l);
+  return res < 0 || (res == 0 && a->len < b->len);
+}
+
+/* string order as in 'l_strcmp' (lvm.c) */
+static int lt_strcoll (const SortKey *a, const SortKey *b) {
+  const char *l = a->u.s;
+  size_t ll = a->len;
+  const char *r = b->u.s;
+  size_t lr = b->len;
+  for (;;) {  /* for each segment */
+    int temp = strcoll(l, r);
+    if (temp != 0)  /* not equal? */
+      return temp < 0;
+    else {  /* strings are equal up to a '\0' */
+      size_t len = strlen(l);  /* index of first '\0' in both strings */
+      if (len == lr)  /* 'rs' is finished? */
+        return 0;
+      else if (len == ll)  /* 'ls' is finished? */
+        return 1;
+      len++;
+      l += len; ll -= len; r += len; lr -= len;
+    }
+  }
+}
+
+
+/* below this size, partitions are sorted by insertion */
+#define ISORTLIMIT	16
+
+
+static void swapkeys (SortKey *a, SortKey *b) {
+  SortKey t = *a; *a = *b; *b = t;
+}
+
+
+static void insertionsort (SortKey *a, size_t n, SortLT lt) {
+  size_t i, j;
+  for (i = 1; i < n; i++) {
+    SortKey t = a[i];
+    for (j = i; j > 0 && lt(&t, &a[j - 1]); j--)
+      a[j] = a[j - 1];
+    a[j] = t;
+  }
+}
+
+
+static void siftdown (SortKey *a, size_t i, size_t n, SortLT lt) {
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && lt(&a[c], &a[c + 1])) c++;
+    if (!lt(&a[i], &a[c])) break;
+    swapkeys(&a[i], &a[c]);
+    i = c;
+  }
+}
+
+
+static void heapsort (SortKey *a, size_t n, SortLT lt) {
+  size_t i;
+  for (i = n / 2; i-- > 0; )
+    siftdown(a, i, n, lt);
+  for (i = n; --i > 0; ) {
+    swapkeys(&a[0], &a[i]);
+    siftdown(a, 0, i, lt);
+  }
+}
+
+
+/*
+** Quicksort with median-of-three pivots (Hoare partition), falling
+** back to heapsort when recursion gets too deep, so the worst case is
+** O(n log n) whatever the input.
+*/
+static void introsort (SortKey *a, size_t n, int depth, SortLT lt) {
+  while (n > ISORTLIMIT) {
+    size_t m = n / 2;
+    size_t i, j;
+    SortKey p;
+    if (depth-- == 0) {
+      heapsort(a, n, lt);
+      return;
+    }
+    if (lt(&a[m], &a[0])) swapkeys(&a[m], &a[0]);
+    if (lt(&a[n - 1], &a[m])) {
+      swapkeys(&a[n - 1], &a[m]);
+      if (lt(&a[m], &a[0])) swapkeys(&a[m], &a[0]);
+    }
+    p = a[m];  /* a[0] <= p <= a[n - 1] work as sentinels */
+    i = 0; j = n - 1;
+    for (;;) {
+      while (lt(&a[++i], &p)) ;
+      while (lt(&p, &a[--j])) ;
+      if (i >= j) break;
+      swapkeys(&a[i], &a[j]);
+    }
+    /* a[0..j] <= p <= a[j+1..n-1]; recurse into the smaller half */
+    if (j + 1 < n - j - 1) {
+      introsort(a, j + 1, depth, lt);
+      a += j + 1; n -= j + 1;
+    }
+    else {
+      introsort(a + j + 1, n - j - 1, depth, lt);
+      n = j + 1;
+    }
+  }
+  insertionsort(a, n, lt);
+}
+
+
+/* kinds of arrays handled natively */
+#define SK_INT		1	/* only integers */
+#define SK_FLT		2	/* only floats */
+#define SK_NUM		3	/* integers and floats */
+#define SK_STR		4	/* only strings */
+
+
+/*
+** Read the keys of table 1 into 'a'. Returns the kind of the array or
+** 0 if it cannot be sorted natively. Strings are not copied: they stay
+** referenced by the table while their keys are in use.
+*/
+static int getkeys (lua_State *L, SortKey *a, IdxT n) {
+  int kind = 0;
+  IdxT i;
+  for (i = 0; i < n; i++) {
+    SortKey *k = &a[i];
+    k->pos = i + 1;
+    switch (lua_rawgeti(L, 1, i + 1)) {
+      case LUA_TNUMBER: {
+        if (lua_isinteger(L, -1)) {
+          k->u.i = lua_tointeger(L, -1);
+          k->isint = 1;
+          kind |= SK_INT;
+        }
+        else {
+          k->u.n = lua_tonumber(L, -1);
+          k->isint = 0;
+          if (k->u.n != k->u.n)  /* NaN? */
+            kind = SK_STR | SK_NUM;  /* (invalid) */
+          kind |= SK_FLT;
+        }
+        break;
+      }
+      case LUA_TSTRING: {
+        k->u.s = lua_tolstring(L, -1, &k->len);
+        kind |= SK_STR;
+        break;
+      }
+      default: kind = SK_STR | SK_NUM;  /* (invalid) */
+    }
+    lua_pop(L, 1);
+    if ((kind & SK_STR) && (kind & SK_NUM))
+      return 0;  /* mixed types or NaN */
+  }
+  if (kind == SK_NUM) {  /* mixed integers and floats: compare as floats */
+    for (i = 0; i < n; i++) {
+      if (a[i].isint) {
+        if (!l_intfitsf(a[i].u.i))
+          return 0;  /* float comparison would not be exact */
+        a[i].u.n = (lua_Number)a[i].u.i;
+      }
+    }
+  }
+  return kind;
+}
+
+
+/*
+** Write back a permuted array: the value at position 'i' must go to
+** the position of key 'i'. Follows each cycle of the permutation
+** holding a single value on the stack, marking keys already placed.
+*/
+static void permute (lua_State *L, SortKey *a, IdxT n) {
+  IdxT i;
+  for (i = 0; i < n; i++) {
+    IdxT j = i;
+    IdxT src;
+    if (a[i].pos == i + 1)  /* already in place? */
+      continue;
+    lua_rawgeti(L, 1, i + 1);  /* save first value of the cycle */
+    while ((src = a[j].pos) != i + 1) {
+      lua_rawgeti(L, 1, src);
+      lua_rawseti(L, 1, j + 1);
+      a[j].pos = j + 1;  /* mark as placed */
+      j = src - 1;
+    }
+    lua_rawseti(L, 1, j + 1);
+    a[j].pos = j + 1;
+  }
+}
+
+
+/*
+** Try to sort table 1 natively. Returns 0 (without changing the table)
+** if it has to be sorted by 'auxsort'.
+*/
+static int nativesort (lua_State *L, IdxT n) {
+  SortKey *a;
+  SortLT lt;
+  IdxT i;
+  int kind, depth = 0;
+  if (lua_type(L, 1) != LUA_TTABLE ||
+      n * sizeof(SortKey) / sizeof(SortKey) != n)  /* too big? */
+    return 0;
+  if (lua_getmetatable(L, 1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  a = (SortKey *)lua_newuserdata(L, n * sizeof(SortKey));
+  kind = getkeys(L, a, n);
+  switch (kind) {
+    case SK_INT: lt = lt_int; break;
+    case SK_FLT: case SK_NUM: lt = lt_num; break;
+    case SK_STR: {
+      const char *loc = setlocale(LC_COLLATE, NULL);
+      lt = (loc == NULL || strcmp(loc, "C") == 0 || strcmp(loc, "POSIX") == 0)
+           ? lt_strbytes : lt_strcoll;
+      break;
+    }
+    default: {
+      lua_pop(L, 1);  /* remove keys */
+      return 0;
+    }
+  }
+  for (i = n; i > 1; i >>= 1)
+    depth += 2;  /* 2 * log2(n) */
+  introsort(a, n, depth, lt);
+  if (kind == SK_INT) {
+    for (i = 0; i < n; i++) {
+      lua_pushinteger(L, a[i].u.i);
+      lua_rawseti(L, 1, i + 1);
+    }
+  }
+  else if (kind == SK_FLT) {
+    for (i = 0; i < n; i++) {
+      lua_pushnumber(L, a[i].u.n);
+      lua_rawseti(L, 1, i + 1);
+    }
+  }
+  else
+    permute(L, a, n);
+  lua_pop(L, 1);  /* remove keys */
+  return 1;
+}
+
+
 static int sort (lua_State *L) {
   lua_Integer n = aux_getn(L, 1, TAB_RW);
   if (n > 1) {  /* non-trivial interval? */
     luaL_argcheck(L, n < INT_MAX, 1, "array too big");
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
+    else if (nativesort(L, (IdxT)n))
+      return 0;
     lua_settop(L, 2);  /* make sure there are two arguments */
     auxsort(L, 1, (IdxT)n, 0);
   }
@@ -157,10 +157,61 @@ static int forlimit (const TValue *obj, lua_Integer *p, lua_Integer step,
 ** if 'slot' is NULL, 't' is not a table; otherwise, 'slot' points to
 ** t[k] entry (which must be nil).
 */
+/*
+** Push the string of 'o' made by the string hook and return 1 if 'o' is a
+** string-like userdata, else return 0 with the stack unchanged. The string
+** stays on the stack while it is used. May reallocate the stack.
+*/
+int luaV_tostringhook (lua_State *L, const TValue *o) {
+  global_State *g = G(L);
+  TValue ov;
+  if (g->strhookmt == NULL || !ttisfulluserdata(o) ||
+      uvalue(o)->metatable != g->strhookmt)
+    return 0;
+  setobj(L, &ov, o);  /* 'o' may be in the stack */
+  luaD_checkstack(L, 2);
+  setfvalue(L->top, g->strhook);
+  setobj2s(L, L->top + 1, &ov);
+  L->top += 2;
+  luaD_callnoyield(L, L->top - 2, 1);
+  if (ttisstring(L->top - 1))
+    return 1;
+  L->top--;
+  return 0;
+}
+
+
+/*
+** Index table 't' with the string of the string-like userdata 'key', return 0
+** if 'key' is not one.
+*/
+static int finishgetstrkey (lua_State *L, const TValue *t, const TValue *key,
+                            StkId val) {
+  ptrdiff_t res = savestack(L, val);
+  TValue tv;
+  const TValue *slot;
+  setobj(L, &tv, t);  /* 't' may be in the stack */
+  if (!luaV_tostringhook(L, key))
+    return 0;
+  val = restorestack(L, res);
+  slot = luaH_get(hvalue(&tv), L->top - 1);
+  if (!ttisnil(slot)) {
+    setobj2s(L, val, slot);
+  }
+  else
+    luaV_finishget(L, &tv, L->top - 1, val, slot);
+  L->top--;  /* remove string */
+  return 1;
+}
+
+
 void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
                       const TValue *slot) {
   int loop;  /* counter to avoid infinite loops */
   const TValue *tm;  /* metamethod */
+  if (slot != NULL && ttisfulluserdata(key) &&
+      finishgetstrkey(L, t, key, val))
+    return;
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     if (slot == NULL) {  /* 't' is not a table? */
       lua_assert(!ttistable(t));
@@ -200,9 +251,31 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
 ** entry.  (The value at 'slot' must be nil, otherwise 'luaV_fastset'
 ** would have done the job.)
 */
+/*
+** Assign 'val' to the string of the string-like userdata 'key' in table
+** 't', return 0 if 'key' is not one.
+*/
+static int finishsetstrkey (lua_State *L, const TValue *t, const TValue *key,
+                            const TValue *val) {
+  TValue tv, vv;
+  const TValue *slot;
+  setobj(L, &tv, t);  /* 't' and 'val' may be in the stack */
+  setobj(L, &vv, val);
+  if (!luaV_tostringhook(L, key))
+    return 0;
+  if (!luaV_fastset(L, &tv, L->top - 1, slot, luaH_get, &vv))
+    luaV_finishset(L, &tv, L->top - 1, &vv, slot);
+  L->top--;  /* remove string */
+  return 1;
+}
+
+
 void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                      StkId val, const TValue *slot) {
   int loop;  /* counter to avoid infinite loops */
+  if (slot != NULL && ttisfulluserdata(key) &&
+      finishsetstrkey(L, t, key, val))
+    return;
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     const TValue *tm;  /* '__newindex' metamethod */
     if (slot != NULL) {  /* is 't' a table? */
@@ -404,11 +477,33 @@ int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
 ** Main operation for equality of Lua values; return 't1 == t2'.
 ** L == NULL means raw equality (no metamethods)
 */
+/*
+** Main operation of equality between a string-like userdata and a string.
+*/
+static int equalstrhook (lua_State *L, const TValue *u, const TValue *s) {
+  TValue sv;
+  int res;
+  setobj(L, &sv, s);  /* 's' may be in the stack */
+  if (!luaV_tostringhook(L, u))
+    return 0;
+  res = luaV_rawequalobj(L->top - 1, &sv);
+  L->top--;  /* remove string */
+  return res;
+}
+
+
 int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2) {
   const TValue *tm;
   if (ttype(t1) != ttype(t2)) {  /* not the same variant? */
-    if (ttnov(t1) != ttnov(t2) || ttnov(t1) != LUA_TNUMBER)
-      return 0;  /* only numbers can be equal with different variants */
+    if (ttnov(t1) != ttnov(t2) || ttnov(t1) != LUA_TNUMBER) {
+      /* only numbers can be equal with different variants, and strings
+         with string-like userdata */
+      if (L != NULL && ttisstring(t1) && ttisfulluserdata(t2))
+        return equalstrhook(L, t2, t1);
+      if (L != NULL && ttisfulluserdata(t1) && ttisstring(t2))
+        return equalstrhook(L, t1, t2);
+      return 0;
+    }
     else {  /* two numbers with different variants */
       lua_Integer i1, i2;  /* compare them as integers */
       return (tointeger(t1, &i1) && tointeger(t2, &i2) && i1 == i2);
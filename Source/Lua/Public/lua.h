@@ -328,6 +328,14 @@ LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
+/*
+** Full userdata with the metatable on the top of the stack (popped, nil to
+** clear) behave as the string 'f' returns when called with them, for '==',
+** table keys and 'lua_tolstring'. 'f' returns nil for userdata that are not
+** strings.
+*/
+LUA_API void      (lua_setstringhook) (lua_State *L, lua_CFunction f);
+
 
 
 /*
@@ -35,6 +35,9 @@ LUAMOD_API int (luaopen_string) (lua_State *L);
 #define LUA_UTF8LIBNAME	"utf8"
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_STRBUFLIBNAME	"strbuf"
+LUAMOD_API int (luaopen_strbuf) (lua_State *L);
+
 #define LUA_BITLIBNAME	"bit32"
 LUAMOD_API int (luaopen_bit32) (lua_State *L);
 
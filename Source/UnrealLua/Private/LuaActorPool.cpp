@@ -0,0 +1,92 @@
+#include "LuaActorPool.h"
+#include "GameFramework/Actor.h"
+#include "Components/ActorComponent.h"
+#include "Engine/World.h"
+
+FLuaActorPool::~FLuaActorPool()
+{
+	clear(nullptr);
+}
+
+AActor* FLuaActorPool::acquire(UWorld* world, UClass* cls, const FTransform& transform)
+{
+	TArray<FPooledActor>* pool = pools_.Find(cls);
+	if (!pool)
+		return nullptr;
+	for (int32 i = pool->Num() - 1; i >= 0; i--)
+	{
+		AActor* actor = (*pool)[i].actor.Get();
+		if (actor && actor->IsPendingKill())
+			actor = nullptr;
+		if (actor && actor->GetWorld() != world)
+			continue;
+
+		FPooledActor entry = MoveTemp((*pool)[i]);
+		pool->RemoveAtSwap(i);
+		pooled_.Remove(entry.key);
+		if (!actor)
+			continue;
+
+		actor->SetActorTransform(transform, false, nullptr, ETeleportType::TeleportPhysics);
+		actor->SetActorHiddenInGame(entry.hidden);
+		actor->SetActorEnableCollision(entry.collisionEnabled);
+		actor->SetActorTickEnabled(entry.tickEnabled);
+		for (auto& c : entry.tickingComponents)
+		{
+			if (UActorComponent* component = c.Get())
+				component->SetComponentTickEnabled(true);
+		}
+		return actor;
+	}
+	return nullptr;
+}
+
+bool FLuaActorPool::release(AActor* actor)
+{
+	if (pooled_.Contains(FObjectKey(actor)))
+		return false;
+	pooled_.Add(FObjectKey(actor));
+
+	FPooledActor entry;
+	entry.actor = actor;
+	entry.key = FObjectKey(actor);
+	entry.hidden = actor->bHidden;
+	entry.collisionEnabled = actor->GetActorEnableCollision();
+	entry.tickEnabled = actor->IsActorTickEnabled();
+	for (UActorComponent* component : actor->GetComponents())
+	{
+		if (component && component->IsComponentTickEnabled())
+		{
+			component->SetComponentTickEnabled(false);
+			entry.tickingComponents.Add(component);
+		}
+	}
+	actor->SetActorTickEnabled(false);
+	actor->SetActorEnableCollision(false);
+	actor->SetActorHiddenInGame(true);
+	pools_.FindOrAdd(actor->GetClass()).Add(MoveTemp(entry));
+	return true;
+}
+
+void FLuaActorPool::clear(UClass* cls)
+{
+	for (auto it = pools_.CreateIterator(); it; ++it)
+	{
+		if (cls && it.Key() != cls)
+			continue;
+		for (FPooledActor& entry : it.Value())
+		{
+			pooled_.Remove(entry.key);
+			AActor* actor = entry.actor.Get();
+			if (actor && !actor->IsPendingKill())
+				actor->Destroy();
+		}
+		it.RemoveCurrent();
+	}
+}
+
+int32 FLuaActorPool::num(UClass* cls) const
+{
+	const TArray<FPooledActor>* pool = pools_.Find(cls);
+	return pool ? pool->Num() : 0;
+}
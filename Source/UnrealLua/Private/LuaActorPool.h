@@ -0,0 +1,44 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "UObject/ObjectKey.h"
+
+class AActor;
+class UActorComponent;
+
+/**
+ * Deactivated actors kept per class for reuse instead of destroy and spawn.
+ * Released actors are hidden, without collision, and their actor and
+ * component ticks are disabled; acquiring one moves it and restores the
+ * visibility, collision and ticks it had when released.
+ * Pooled actors are held weakly, destroyed ones are dropped.
+ */
+class FLuaActorPool
+{
+public:
+	~FLuaActorPool();
+
+	/** Reactivate a pooled actor of cls in world at transform, nullptr if none. */
+	AActor* acquire(UWorld* world, UClass* cls, const FTransform& transform);
+	/** Deactivate actor and pool it, false if it was already pooled. */
+	bool release(AActor* actor);
+	/** Destroy pooled actors of cls, of all classes if nullptr. */
+	void clear(UClass* cls);
+	int32 num(UClass* cls) const;
+
+private:
+	struct FPooledActor
+	{
+		TWeakObjectPtr<AActor> actor;
+		FObjectKey key;
+		/** State of the actor on release. */
+		bool hidden;
+		bool collisionEnabled;
+		bool tickEnabled;
+		/** Components whose tick was enabled on release. */
+		TArray<TWeakObjectPtr<UActorComponent>> tickingComponents;
+	};
+
+	TMap<UClass*, TArray<FPooledActor>> pools_;
+	TSet<FObjectKey> pooled_;
+};
@@ -0,0 +1,108 @@
+#include "LuaAllocProfiler.h"
+
+/**
+ * Type of reallocated blocks, whose osize is not a type. osize of new blocks
+ * is the type tag, whose low bits are the basic type: long and short
+ * strings are both strings, lua and C closures both functions.
+ */
+enum { ResizeType = -1, BasicTypeMask = 0x0F };
+
+static const TCHAR* allocTypeName(int32 type)
+{
+	switch (type)
+	{
+	case ResizeType:		return TEXT("resize");
+	case LUA_TSTRING:		return TEXT("string");
+	case LUA_TTABLE:		return TEXT("table");
+	case LUA_TFUNCTION:		return TEXT("function");
+	case LUA_TUSERDATA:		return TEXT("userdata");
+	case LUA_TTHREAD:		return TEXT("thread");
+	case LUA_NUMTAGS:		return TEXT("proto");
+	default:				return TEXT("memory");
+	}
+}
+
+FLuaAllocProfiler::FLuaAllocProfiler(int32 sampleBytes):
+	sampleBytes_(FMath::Max(sampleBytes, 1)),
+	countdown_(sampleBytes_)
+{
+	pending_.site = INDEX_NONE;
+	pending_.bytes = 0;
+}
+
+void FLuaAllocProfiler::takeSample(lua_State* L, void* ptr, size_t osize, size_t nsize)
+{
+	// A large block may cover several sample periods.
+	int64 periods = 1 + (-countdown_) / sampleBytes_;
+	countdown_ += periods * sampleBytes_;
+
+	// Innermost lua function, no allocation happens here.
+	FSiteKey key = { nullptr, 0, ptr ? (int32)ResizeType : (int32)(osize & BasicTypeMask) };
+	lua_Debug ar;
+	for (int level = 0; lua_getstack(L, level, &ar); level++)
+	{
+		lua_getinfo(L, "Sl", &ar);
+		if (ar.currentline >= 0)
+		{
+			key.source = ar.source;
+			key.line = ar.currentline;
+			break;
+		}
+	}
+
+	int32 site;
+	if (int32* id = siteIds_.Find(key))
+		site = *id;
+	else
+	{
+		FSite s;
+		s.name = key.source ? FString::Printf(TEXT("%s:%d"), UTF8_TO_TCHAR(ar.short_src), ar.currentline) : FString(TEXT("[C]"));
+		s.type = key.type;
+		s.samples = s.totalBytes = s.liveBytes = 0;
+		site = sites_.Add(s);
+		siteIds_.Add(key, site);
+	}
+
+	FSite& s = sites_[site];
+	s.samples++;
+	s.totalBytes += periods * sampleBytes_;
+	// A resized block sampled before now counts for this site only.
+	pending_.site = site;
+	pending_.bytes = periods * sampleBytes_;
+}
+
+void FLuaAllocProfiler::untrack(void* ptr, bool keep)
+{
+	FRecord r;
+	if (tracked_.RemoveAndCopyValue(ptr, r))
+	{
+		sites_[r.site].liveBytes -= r.bytes;
+		if (keep)
+			pending_ = r;
+	}
+}
+
+void FLuaAllocProfiler::trackPending(void* ptr, void* newPtr, size_t nsize)
+{
+	// A failed reallocation leaves the block where it was.
+	void* block = (newPtr || nsize == 0) ? newPtr : ptr;
+	if (block)
+	{
+		tracked_.Add(block, pending_);
+		sites_[pending_.site].liveBytes += pending_.bytes;
+	}
+	pending_.site = INDEX_NONE;
+}
+
+FString FLuaAllocProfiler::dumpCsv() const
+{
+	TArray<const FSite*> sorted;
+	for (const FSite& s : sites_)
+		sorted.Add(&s);
+	sorted.Sort([](const FSite& a, const FSite& b) { return a.liveBytes != b.liveBytes ? a.liveBytes > b.liveBytes : a.totalBytes > b.totalBytes; });
+
+	FString csv = TEXT("Site,Type,Samples,TotalBytes,LiveBytes\n");
+	for (const FSite* s : sorted)
+		csv += FString::Printf(TEXT("%s,%s,%lld,%lld,%lld\n"), *s->name, allocTypeName(s->type), s->samples, s->totalBytes, s->liveBytes);
+	return csv;
+}
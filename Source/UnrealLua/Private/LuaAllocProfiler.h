@@ -0,0 +1,86 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "lua.hpp"
+
+/**
+ * Allocation-site sampler of a lua state.
+ * One allocation every sampleBytes allocated bytes is attributed to the lua
+ * source line running it (the innermost lua function on the stack) and to the
+ * type of object allocated, and stands for sampleBytes of allocations there.
+ * Sampled blocks are followed until freed, giving live bytes per site besides
+ * total bytes, without recording every allocation.
+ * The stack inspected is that of the running thread, coroutines included.
+ */
+class FLuaAllocProfiler
+{
+public:
+	explicit FLuaAllocProfiler(int32 sampleBytes);
+
+	/**
+	 * Called by the allocator around the actual allocation.
+	 * begin may take a sample (before ptr is changed, so the lua stack is still valid).
+	 */
+	void beginAlloc(lua_State* L, void* ptr, size_t osize, size_t nsize)
+	{
+		if (ptr && tracked_.Num() > 0)
+			untrack(ptr, nsize > 0);
+		if (nsize > (ptr ? osize : 0))
+		{
+			countdown_ -= (int64)(nsize - (ptr ? osize : 0));
+			if (countdown_ <= 0)
+				takeSample(L, ptr, osize, nsize);
+		}
+	}
+	void endAlloc(void* ptr, void* newPtr, size_t nsize)
+	{
+		if (pending_.site != INDEX_NONE)
+			trackPending(ptr, newPtr, nsize);
+	}
+
+	/** Sites sorted by live bytes, as CSV. */
+	FString dumpCsv() const;
+
+private:
+	void takeSample(lua_State* L, void* ptr, size_t osize, size_t nsize);
+	void untrack(void* ptr, bool keep);
+	void trackPending(void* ptr, void* newPtr, size_t nsize);
+
+	struct FSiteKey
+	{
+		const void* source;
+		int32 line;
+		int32 type;
+
+		bool operator==(const FSiteKey& o) const { return source == o.source && line == o.line && type == o.type; }
+		friend uint32 GetTypeHash(const FSiteKey& k)
+		{
+			return HashCombine(PointerHash(k.source), (uint32)(k.line * 16 + k.type));
+		}
+	};
+
+	struct FSite
+	{
+		FString name;
+		int32 type;
+		int64 samples;
+		int64 totalBytes;
+		int64 liveBytes;
+	};
+
+	/** A sampled block, or the one being allocated between begin and end. */
+	struct FRecord
+	{
+		int32 site;
+		int64 bytes;
+	};
+
+	int64 sampleBytes_;
+	/** Bytes left before next sample. */
+	int64 countdown_;
+
+	TMap<FSiteKey, int32> siteIds_;
+	TArray<FSite> sites_;
+	TMap<void*, FRecord> tracked_;
+	FRecord pending_;
+};
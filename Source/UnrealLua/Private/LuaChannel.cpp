@@ -0,0 +1,326 @@
+#include "LuaChannel.h"
+#include "LuaSerializer.h"
+#include "Misc/ScopeLock.h"
+
+FCriticalSection FLuaChannel::registryLock_;
+TMap<FString, FLuaChannel*> FLuaChannel::registry_;
+
+FLuaChannel::FLuaChannel(const FString& name, int32 capacity, EMode mode, int32 slotBytes):
+	name_(name),
+	mode_(mode),
+	slotBytes_(slotBytes),
+	mask_(capacity - 1),
+	enqueuePos_(0),
+	dequeuePos_(0),
+	producer_(nullptr),
+	consumer_(nullptr),
+	producerClaims_(0),
+	consumerClaims_(0),
+	refs_(0)
+{
+	slots_.SetNum(capacity);
+	for (int32 i = 0; i < capacity; i++)
+	{
+		slots_[i].sequence = i;
+		slots_[i].valid = false;
+		slots_[i].data.Reserve(slotBytes_);
+	}
+}
+
+FLuaChannel* FLuaChannel::open(const FString& name, int32 capacity, EMode mode, int32 slotBytes)
+{
+	capacity = FMath::RoundUpToPowerOfTwo(FMath::Clamp(capacity, 2, 1 << 20));
+	FScopeLock lock(&registryLock_);
+	FLuaChannel*& channel = registry_.FindOrAdd(name);
+	if (!channel)
+		channel = new FLuaChannel(name, capacity, mode, FMath::Max(slotBytes, 0));
+	else if (channel->mode_ != mode || channel->mask_ + 1 != capacity)
+		return nullptr;
+	channel->refs_++;
+	return channel;
+}
+
+void FLuaChannel::release()
+{
+	FScopeLock lock(&registryLock_);
+	if (--refs_ == 0)
+	{
+		registry_.Remove(name_);
+		delete this;
+	}
+}
+
+FLuaChannel::FSlot* FLuaChannel::beginSend()
+{
+	int64 pos = enqueuePos_;
+	for (;;)
+	{
+		FSlot* slot = &slots_[pos & mask_];
+		int64 seq = slot->sequence;
+		FPlatformMisc::MemoryBarrier();
+		int64 dif = seq - pos;
+		if (dif == 0)
+		{
+			// Slot is free at pos, claim it.
+			if (mode_ == EMode::SPSC)
+			{
+				enqueuePos_ = pos + 1;
+				return slot;
+			}
+			int64 prev = FPlatformAtomics::InterlockedCompareExchange(&enqueuePos_, pos + 1, pos);
+			if (prev == pos)
+				return slot;
+			pos = prev;
+		}
+		else if (dif < 0)
+			return nullptr;
+		else
+			pos = enqueuePos_;
+	}
+}
+
+void FLuaChannel::endSend(FSlot* slot, bool valid)
+{
+	slot->valid = valid;
+	FPlatformMisc::MemoryBarrier();
+	slot->sequence = slot->sequence + 1;
+}
+
+FLuaChannel::FSlot* FLuaChannel::beginReceive()
+{
+	int64 pos = dequeuePos_;
+	FSlot* slot = &slots_[pos & mask_];
+	int64 seq = slot->sequence;
+	FPlatformMisc::MemoryBarrier();
+	if (seq != pos + 1)
+		return nullptr;
+	dequeuePos_ = pos + 1;
+	return slot;
+}
+
+void FLuaChannel::endReceive(FSlot* slot)
+{
+	if (slot->data.Max() > slotBytes_ * 4)
+		slot->data.Empty(slotBytes_);
+	else
+		slot->data.Reset();
+	FPlatformMisc::MemoryBarrier();
+	slot->sequence = slot->sequence + mask_;
+}
+
+bool FLuaChannel::claimProducer(void* owner)
+{
+	if (mode_ == EMode::MPSC)
+		return true;
+	FScopeLock lock(&claimLock_);
+	if (producer_ && producer_ != owner)
+		return false;
+	producer_ = owner;
+	producerClaims_++;
+	return true;
+}
+
+bool FLuaChannel::claimConsumer(void* owner)
+{
+	FScopeLock lock(&claimLock_);
+	if (consumer_ && consumer_ != owner)
+		return false;
+	consumer_ = owner;
+	consumerClaims_++;
+	return true;
+}
+
+void FLuaChannel::releaseProducer(void* owner)
+{
+	if (mode_ == EMode::MPSC)
+		return;
+	FScopeLock lock(&claimLock_);
+	if (producer_ == owner && --producerClaims_ == 0)
+		producer_ = nullptr;
+}
+
+void FLuaChannel::releaseConsumer(void* owner)
+{
+	FScopeLock lock(&claimLock_);
+	if (consumer_ == owner && --consumerClaims_ == 0)
+		consumer_ = nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/************************************************************************/
+/* Lua library.                                                         */
+/************************************************************************/
+
+/** Channel userdata, one per lua state using the channel. */
+struct FLuaChannelHandle
+{
+	FLuaChannel* channel;
+	/** Main thread of the state. */
+	void* owner;
+	bool producer;
+	bool consumer;
+};
+
+static const char* channelMT = "LuaChannelMT";
+
+static FLuaChannelHandle* checkChannel(lua_State* L)
+{
+	FLuaChannelHandle* h = (FLuaChannelHandle*)luaL_checkudata(L, 1, channelMT);
+	if (!h->channel)
+		luaL_error(L, "channel is closed");
+	return h;
+}
+
+static int channelOpen(lua_State* L)
+{
+	static const char* const modes[] = { "spsc", "mpsc", nullptr };
+	const char* name = luaL_checkstring(L, 1);
+	int32 capacity = (int32)luaL_optinteger(L, 2, 1024);
+	FLuaChannel::EMode mode = luaL_checkoption(L, 3, "mpsc", modes) == 0 ? FLuaChannel::EMode::SPSC : FLuaChannel::EMode::MPSC;
+	int32 slotBytes = (int32)luaL_optinteger(L, 4, 256);
+
+	FLuaChannelHandle* h = (FLuaChannelHandle*)lua_newuserdata(L, sizeof(FLuaChannelHandle));
+	h->channel = nullptr;
+	luaL_setmetatable(L, channelMT);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	h->owner = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	h->producer = false;
+	h->consumer = false;
+	h->channel = FLuaChannel::open(UTF8_TO_TCHAR(name), capacity, mode, slotBytes);
+	if (!h->channel)
+		return luaL_error(L, "channel \"%s\" exists with another mode or capacity", name);
+	return 1;
+}
+
+/** Pack the values after the slot at 1 into it. */
+static int channelPack(lua_State* L)
+{
+	FLuaChannel::FSlot* slot = (FLuaChannel::FSlot*)lua_touserdata(L, 1);
+	bool ok;
+	{
+		FString error;
+		ok = FLuaSerializer::pack(L, 2, lua_gettop(L) - 1, slot->data, error);
+		if (!ok)
+			lua_pushstring(L, TCHAR_TO_UTF8(*error));
+	}
+	if (!ok)
+		return lua_error(L);
+	return 0;
+}
+
+/** Push the values of the slot at 1. */
+static int channelUnpack(lua_State* L)
+{
+	FLuaChannel::FSlot* slot = (FLuaChannel::FSlot*)lua_touserdata(L, 1);
+	int n;
+	{
+		FString error;
+		n = FLuaSerializer::unpack(L, slot->data.GetData(), slot->data.Num(), error);
+		if (n < 0)
+			lua_pushstring(L, TCHAR_TO_UTF8(*error));
+	}
+	if (n < 0)
+		return lua_error(L);
+	return n;
+}
+
+static int channelSend(lua_State* L)
+{
+	FLuaChannelHandle* h = checkChannel(L);
+	if (!h->producer && !(h->producer = h->channel->claimProducer(h->owner)))
+		return luaL_error(L, "channel has another producer");
+	FLuaChannel::FSlot* slot = h->channel->beginSend();
+	if (!slot)
+	{
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	// Packing may also fail on memory errors, a claimed slot is published
+	// anyway and the consumer skips invalid ones.
+	int n = lua_gettop(L) - 1;
+	lua_pushcfunction(L, channelPack);
+	lua_insert(L, 2);
+	lua_pushlightuserdata(L, slot);
+	lua_insert(L, 3);
+	int status = lua_pcall(L, n + 1, 0, 0);
+	h->channel->endSend(slot, status == LUA_OK);
+	if (status != LUA_OK)
+		return lua_error(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int channelReceive(lua_State* L)
+{
+	FLuaChannelHandle* h = checkChannel(L);
+	if (!h->consumer && !(h->consumer = h->channel->claimConsumer(h->owner)))
+		return luaL_error(L, "channel has another consumer");
+	for (;;)
+	{
+		FLuaChannel::FSlot* slot = h->channel->beginReceive();
+		if (!slot)
+		{
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (!slot->valid)
+		{
+			h->channel->endReceive(slot);
+			continue;
+		}
+		lua_pushboolean(L, 1);
+		int top = lua_gettop(L);
+		// The slot is released even if unpacking fails.
+		lua_pushcfunction(L, channelUnpack);
+		lua_pushlightuserdata(L, slot);
+		int status = lua_pcall(L, 1, LUA_MULTRET, 0);
+		h->channel->endReceive(slot);
+		if (status != LUA_OK)
+			return lua_error(L);
+		return lua_gettop(L) - top + 1;
+	}
+}
+
+static int channelSize(lua_State* L)
+{
+	lua_pushinteger(L, checkChannel(L)->channel->num());
+	return 1;
+}
+
+static int channelGC(lua_State* L)
+{
+	FLuaChannelHandle* h = (FLuaChannelHandle*)lua_touserdata(L, 1);
+	if (h->channel)
+	{
+		if (h->producer)
+			h->channel->releaseProducer(h->owner);
+		if (h->consumer)
+			h->channel->releaseConsumer(h->owner);
+		h->channel->release();
+		h->channel = nullptr;
+	}
+	return 0;
+}
+
+void FLuaChannel::openLibrary(lua_State* L)
+{
+	static const luaL_Reg methods[] =
+	{
+		{ "send", channelSend },
+		{ "receive", channelReceive },
+		{ "size", channelSize },
+		{ nullptr, nullptr },
+	};
+	luaL_newmetatable(L, channelMT);
+	luaL_newlib(L, methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, channelGC);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, channelOpen);
+	lua_setfield(L, -2, "open");
+	lua_setglobal(L, "channels");
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "lua.hpp"
+
+/**
+ * Named channel of serialized lua values between lua states, which may run
+ * on different threads.
+ * Messages go through a bounded ring of preallocated slots, without locks:
+ * single producer channels publish slots with plain stores, multi producer
+ * ones claim them with a compare-and-swap. There is a single consumer.
+ * Values are packed in place into the claimed slot and unpacked from it, so
+ * a payload is never copied in between, however large; slots grown by a large
+ * payload are shrunk back once it is received.
+ */
+class FLuaChannel
+{
+public:
+	enum class EMode : uint8
+	{
+		SPSC,
+		MPSC,
+	};
+
+	struct FSlot
+	{
+		volatile int64 sequence;
+		bool valid;
+		TArray<uint8> data;
+	};
+
+	/**
+	 * Get channel name, created on first open. Channels are released by their
+	 * last user.
+	 * @return nullptr if the channel exists with another mode or capacity.
+	 */
+	static FLuaChannel* open(const FString& name, int32 capacity, EMode mode, int32 slotBytes);
+	void release();
+
+	/** Claim a slot to write to, nullptr if the channel is full. */
+	FSlot* beginSend();
+	/** Publish a claimed slot, invalid ones are skipped by the consumer. */
+	void endSend(FSlot* slot, bool valid);
+	/** Get the oldest published slot, nullptr if there is none. */
+	FSlot* beginReceive();
+	void endReceive(FSlot* slot);
+
+	/** Messages in the channel, approximately while producers are running. */
+	int32 num() const { return (int32)(enqueuePos_ - dequeuePos_); }
+	EMode mode() const { return mode_; }
+
+	/**
+	 * Claim the producer or consumer side for a lua state, identified by its
+	 * main thread. Multi producer channels accept any producer. A side is
+	 * free again once each claim of its owner is released.
+	 */
+	bool claimProducer(void* owner);
+	bool claimConsumer(void* owner);
+	void releaseProducer(void* owner);
+	void releaseConsumer(void* owner);
+
+	/**
+	 * Open the "channels" lua table in L.
+	 * channels.open(name[, capacity[, mode[, slotBytes]]])	get channel, mode is "mpsc" (default) or "spsc".
+	 * channel:send(...)									false if the channel is full.
+	 * channel:receive()									true and the values of the oldest message,
+	 *														false if there is none.
+	 * channel:size()
+	 */
+	static void openLibrary(lua_State* L);
+
+private:
+	/** The log sink owns an unregistered channel. */
+	friend class FLuaLogSink;
+	FLuaChannel(const FString& name, int32 capacity, EMode mode, int32 slotBytes);
+
+	FString name_;
+	EMode mode_;
+	int32 slotBytes_;
+	int64 mask_;
+	TArray<FSlot> slots_;
+
+	/** Producers and the consumer positions, on their own cache lines. */
+	uint8 pad0_[PLATFORM_CACHE_LINE_SIZE];
+	volatile int64 enqueuePos_;
+	uint8 pad1_[PLATFORM_CACHE_LINE_SIZE - sizeof(int64)];
+	volatile int64 dequeuePos_;
+	uint8 pad2_[PLATFORM_CACHE_LINE_SIZE - sizeof(int64)];
+
+	/** Owners of the sides and their claims, guarded by claimLock_. */
+	void* producer_;
+	void* consumer_;
+	int32 producerClaims_;
+	int32 consumerClaims_;
+	FCriticalSection claimLock_;
+
+	/** Users, guarded by the registry lock. */
+	int32 refs_;
+	static FCriticalSection registryLock_;
+	static TMap<FString, FLuaChannel*> registry_;
+};
@@ -0,0 +1,100 @@
+#include "LuaCompileCommandlet.h"
+#include "LuaHotReload.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "Async/ParallelFor.h"
+#include "lua.hpp"
+
+static int writeBytecode(lua_State* L, const void* p, size_t sz, void* ud)
+{
+	TArray<uint8>* code = (TArray<uint8>*)ud;
+	code->Append((const uint8*)p, (int32)sz);
+	return 0;
+}
+
+int32 ULuaCompileCommandlet::Main(const FString& Params)
+{
+	FString source;
+	if (!FParse::Value(*Params, TEXT("Source="), source))
+		source = FPaths::ProjectDir();
+	source = FPaths::ConvertRelativePathToFull(source);
+	FPaths::NormalizeDirectoryName(source);
+	FString output;
+	if (!FParse::Value(*Params, TEXT("Output="), output))
+		output = FLuaHotReload::bytecodeDir();
+	output = FPaths::ConvertRelativePathToFull(output);
+	FPaths::NormalizeDirectoryName(output);
+	bool strip = FParse::Param(*Params, TEXT("Strip"));
+
+	TArray<FString> found;
+	IFileManager::Get().FindFilesRecursive(found, *source, TEXT("*.lua"), true, false);
+	static const TCHAR* excluded[] = { TEXT("Binaries/"), TEXT("Intermediate/"), TEXT("Saved/"), TEXT("DerivedDataCache/") };
+	TArray<FString> files;
+	for (FString& file : found)
+	{
+		FString relative = file.RightChop(source.Len() + 1);
+		bool skip = file.StartsWith(output + TEXT("/"));
+		for (const TCHAR* dir : excluded)
+			skip |= relative.StartsWith(dir);
+		if (!skip)
+			files.Add(MoveTemp(relative));
+	}
+
+	double start = FPlatformTime::Seconds();
+	TArray<TArray<uint8>> codes;
+	codes.SetNum(files.Num());
+	TArray<FString> errors;
+	FCriticalSection errorsLock;
+	int32 numWorkers = FMath::Clamp(FTaskGraphInterface::Get().GetNumWorkerThreads() + 1, 1, FMath::Max(files.Num(), 1));
+	ParallelFor(numWorkers, [&](int32 worker)
+	{
+		// A throwaway state per worker, compiling every numWorkers-th file.
+		lua_State* L = luaL_newstate();
+		for (int32 i = worker; i < files.Num(); i += numWorkers)
+		{
+			TArray<uint8> text;
+			FString path = source / files[i];
+			FString chunkName = TEXT("@") + files[i];
+			if (!FFileHelper::LoadFileToArray(text, *path))
+			{
+				FScopeLock lock(&errorsLock);
+				errors.Add(FString::Printf(TEXT("Can not read %s"), *path));
+				continue;
+			}
+			if (luaL_loadbuffer(L, (const char*)text.GetData(), text.Num(), TCHAR_TO_UTF8(*chunkName)) != LUA_OK)
+			{
+				FScopeLock lock(&errorsLock);
+				errors.Add(UTF8_TO_TCHAR(lua_tostring(L, -1)));
+			}
+			else
+				lua_dump(L, writeBytecode, &codes[i], strip ? 1 : 0);
+			lua_settop(L, 0);
+		}
+		lua_close(L);
+	});
+
+	if (errors.Num() > 0)
+	{
+		for (const FString& e : errors)
+			ULUA_LOG(Error, TEXT("%s"), *e);
+		ULUA_LOG(Error, TEXT("%d of %d scripts failed to compile, nothing written."), errors.Num(), files.Num());
+		return 1;
+	}
+
+	// Stale bytecode of deleted scripts would still be found.
+	IFileManager::Get().DeleteDirectory(*output, false, true);
+	for (int32 i = 0; i < files.Num(); i++)
+	{
+		FString path = output / FPaths::ChangeExtension(files[i], TEXT("luac"));
+		if (!FFileHelper::SaveArrayToFile(codes[i], *path))
+		{
+			ULUA_LOG(Error, TEXT("Can not write %s"), *path);
+			return 1;
+		}
+	}
+	ULUA_LOG(Display, TEXT("Compiled %d scripts to %s in %.1fms with %d workers."),
+		files.Num(), *output, (FPlatformTime::Seconds() - start) * 1000.0, numWorkers);
+	return 0;
+}
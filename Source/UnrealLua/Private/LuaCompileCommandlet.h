@@ -0,0 +1,30 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "Commandlets/Commandlet.h"
+#include "LuaCompileCommandlet.generated.h"
+
+/**
+ * Compile the lua scripts of the project to bytecode, so packaged games load
+ * modules without parsing:
+ *   UE4Editor-Cmd <project> -run=LuaCompile [-Source=<dir>] [-Output=<dir>] [-Strip]
+ * Cooking does not run it: run it before each BuildCookRun that stages, see
+ * README.md.
+ * Scripts are the .lua files under Source, the project directory by default,
+ * but its Binaries, Intermediate, Saved and DerivedDataCache directories.
+ * Script a/b.lua is written to Output/a/b.luac, Output being
+ * Content/LuaBytecode by default, where FLuaHotReload looks for modules first
+ * out of the editor. DefaultGame.ini stages it with
+ * DirectoriesToAlwaysStageAsNonUFS. -Strip drops debug information.
+ * Files are compiled in parallel, with a lua state per worker. Any syntax
+ * error fails the commandlet, and nothing is written.
+ * Bytecode depends on the size of lua_Integer and size_t, it must be made on
+ * a host of the same word size as the target.
+ */
+UCLASS()
+class ULuaCompileCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+public:
+	virtual int32 Main(const FString& Params) override;
+};
@@ -0,0 +1,119 @@
+#include "LuaCrossingStats.h"
+#include "Misc/CoreDelegates.h"
+#include "Misc/FileHelper.h"
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua UFunction calls"), STAT_LuaCallCount, STATGROUP_UnrealLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua UObject property reads"), STAT_LuaObjectGetCount, STATGROUP_UnrealLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua UObject property writes"), STAT_LuaObjectSetCount, STATGROUP_UnrealLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua UStruct property reads"), STAT_LuaStructGetCount, STATGROUP_UnrealLua);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Lua UStruct property writes"), STAT_LuaStructSetCount, STATGROUP_UnrealLua);
+
+static const TCHAR* crossingNames[] = 
+{
+	TEXT("Call"),
+	TEXT("ObjectGet"),
+	TEXT("ObjectSet"),
+	TEXT("StructGet"),
+	TEXT("StructSet"),
+};
+static_assert(ARRAY_COUNT(crossingNames) == (int32)ELuaCrossing::Num, "Missing crossing names.");
+
+FLuaCrossingStats::FLuaCrossingStats():
+	windowFrames_(0)
+{
+	endFrameHandle_ = FCoreDelegates::OnEndFrame.AddRaw(this, &FLuaCrossingStats::onEndFrame);
+}
+
+FLuaCrossingStats::~FLuaCrossingStats()
+{
+	FCoreDelegates::OnEndFrame.Remove(endFrameHandle_);
+}
+
+FLuaCrossingStats::FEntry& FLuaCrossingStats::addEntry(const FKey& key, UField* field)
+{
+	FEntry& e = entries_.Add(key);
+	UObject* outer = field->GetOuter();
+	e.name = outer ? outer->GetName() + TEXT(".") + field->GetName() : field->GetName();
+	e.kind = key.kind;
+	e.frame.calls = e.frame.returns = e.frame.cycles = 0;
+	e.window.calls = e.window.returns = e.window.cycles = 0;
+#if STATS
+	e.statId = FDynamicStats::CreateStatId<FStatGroup_STATGROUP_UnrealLua>(
+		FString::Printf(TEXT("Lua %s %s"), crossingNames[(int32)key.kind], *e.name));
+#endif
+	return e;
+}
+
+void FLuaCrossingStats::onEndFrame()
+{
+	uint32 calls[(int32)ELuaCrossing::Num] = {};
+	for (auto it = entries_.CreateIterator(); it; ++it)
+	{
+		FEntry& e = it.Value();
+		if (e.frame.calls != 0 || e.frame.returns != 0)
+		{
+#if STATS
+			FThreadStats::AddMessage(e.statId.GetName(), EStatOperation::Set, (int64)e.frame.cycles, true);
+#endif
+			calls[(int32)e.kind] += (uint32)e.frame.calls;
+			e.window.calls += e.frame.calls;
+			e.window.returns += e.frame.returns;
+			e.window.cycles += e.frame.cycles;
+			e.frame.calls = e.frame.returns = e.frame.cycles = 0;
+		}
+		if (!it.Key().field.ResolveObjectPtr())
+		{
+			if (e.window.calls > 0)
+				dropped_.Add(e);
+			it.RemoveCurrent();
+		}
+	}
+	windowFrames_++;
+
+	SET_DWORD_STAT(STAT_LuaCallCount, calls[(int32)ELuaCrossing::Call]);
+	SET_DWORD_STAT(STAT_LuaObjectGetCount, calls[(int32)ELuaCrossing::ObjectGet]);
+	SET_DWORD_STAT(STAT_LuaObjectSetCount, calls[(int32)ELuaCrossing::ObjectSet]);
+	SET_DWORD_STAT(STAT_LuaStructGetCount, calls[(int32)ELuaCrossing::StructGet]);
+	SET_DWORD_STAT(STAT_LuaStructSetCount, calls[(int32)ELuaCrossing::StructSet]);
+}
+
+bool FLuaCrossingStats::dumpCsv(const FString& filename)
+{
+	// Sort by total time, most expensive first.
+	TArray<const FEntry*> sorted;
+	for (auto& it : entries_)
+	{
+		if (it.Value.window.calls > 0)
+			sorted.Add(&it.Value);
+	}
+	for (const FEntry& e : dropped_)
+		sorted.Add(&e);
+	sorted.Sort([](const FEntry& a, const FEntry& b) { return a.window.cycles > b.window.cycles; });
+
+	double msPerCycle = FPlatformTime::GetSecondsPerCycle64() * 1000.0;
+	uint32 frames = FMath::Max(windowFrames_, 1u);
+	FString csv = TEXT("Kind,Field,Frames,Calls,Errors,TotalMs,AvgUs,CallsPerFrame,MsPerFrame\n");
+	for (const FEntry* e : sorted)
+	{
+		// Counts of a crossing running when the stats were enabled or reset
+		// may not match, by one.
+		uint64 returns = FMath::Min(e->window.returns, e->window.calls);
+		double ms = e->window.cycles * msPerCycle;
+		csv += FString::Printf(TEXT("%s,%s,%u,%llu,%llu,%.4f,%.4f,%.2f,%.4f\n"),
+			crossingNames[(int32)e->kind], *e->name, windowFrames_, e->window.calls, e->window.calls - returns,
+			ms, returns ? ms * 1000.0 / returns : 0.0, (double)e->window.calls / frames, ms / frames);
+	}
+
+	// Start a new window.
+	for (auto& it : entries_)
+		it.Value.window.calls = it.Value.window.returns = it.Value.window.cycles = 0;
+	dropped_.Reset();
+	windowFrames_ = 0;
+
+	if (!FFileHelper::SaveStringToFile(csv, *filename))
+	{
+		ULUA_LOG(Error, TEXT("Can not write crossing stats \"%s\"."), *filename);
+		return false;
+	}
+	return true;
+}
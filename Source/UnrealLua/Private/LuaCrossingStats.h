@@ -0,0 +1,105 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "Stats/Stats.h"
+#include "UObject/ObjectKey.h"
+
+DECLARE_STATS_GROUP(TEXT("UnrealLua"), STATGROUP_UnrealLua, STATCAT_Advanced);
+
+/** Kinds of lua to cpp crossings. */
+enum class ELuaCrossing : uint8
+{
+	Call,			// callUFunction
+	ObjectGet,		// uobjMTIndex
+	ObjectSet,		// uobjMTNewIndex
+	StructGet,		// ustructMTIndex
+	StructSet,		// ustructMTNewIndex
+	Num
+};
+
+/**
+ * Call counts and cycles of lua to cpp crossings, per UFunction and per property.
+ * Counters of the current frame are sent to the stats system at the end of
+ * each frame ("stat UnrealLua"), and accumulated into a window that
+ * dumpCsv writes out and resets.
+ * A crossing is counted before anything in it can raise a lua error, and
+ * timed when it returns: crossings left by an error are counted, not timed.
+ * Fields are keyed by object key, entries of destroyed fields are dropped
+ * at the end of the frame, their window is kept for the next dump.
+ */
+class FLuaCrossingStats
+{
+public:
+	FLuaCrossingStats();
+	~FLuaCrossingStats();
+
+	/** Start timing a crossing. */
+	static uint64 begin() { return FPlatformTime::Cycles64(); }
+	/** Count a crossing of field, before it can raise an error. */
+	void count(ELuaCrossing kind, UField* field)
+	{
+		findEntry(kind, field).frame.calls++;
+	}
+	/**
+	 * Time a counted crossing started at startCycles, when it returns.
+	 * Crossings started before the stats were enabled, at 0, are ignored.
+	 */
+	void end(ELuaCrossing kind, UField* field, uint64 startCycles)
+	{
+		if (startCycles == 0)
+			return;
+		FEntry& e = findEntry(kind, field);
+		e.frame.returns++;
+		e.frame.cycles += FPlatformTime::Cycles64() - startCycles;
+	}
+
+	/** Write counters of the current window as CSV, then start a new window. */
+	bool dumpCsv(const FString& filename);
+
+private:
+	struct FCounter
+	{
+		uint64 calls;
+		/** Crossings timed, the others raised an error. */
+		uint64 returns;
+		uint64 cycles;
+	};
+
+	struct FEntry
+	{
+		FString name;
+		ELuaCrossing kind;
+		FCounter frame;
+		FCounter window;
+#if STATS
+		TStatId statId;
+#endif
+	};
+
+	/** Fields freed and their address reused get a new key. */
+	struct FKey
+	{
+		FObjectKey field;
+		ELuaCrossing kind;
+
+		bool operator==(const FKey& o) const { return field == o.field && kind == o.kind; }
+		friend uint32 GetTypeHash(const FKey& k) { return HashCombine(GetTypeHash(k.field), (uint32)k.kind); }
+	};
+
+	FEntry& findEntry(ELuaCrossing kind, UField* field)
+	{
+		FKey key = { FObjectKey(field), kind };
+		if (FEntry* e = entries_.Find(key))
+			return *e;
+		return addEntry(key, field);
+	}
+	FEntry& addEntry(const FKey& key, UField* field);
+
+	void onEndFrame();
+
+	TMap<FKey, FEntry> entries_;
+	/** Entries of destroyed fields, until their window is dumped. */
+	TArray<FEntry> dropped_;
+	uint32 windowFrames_;
+	FDelegateHandle endFrameHandle_;
+};
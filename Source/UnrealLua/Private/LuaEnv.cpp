@@ -1,66 +1,63 @@
 #include "LuaEnv.h"
 #include "LuaDelegate.h"
+#include "LuaProfiler.h"
+#include "LuaCrossingStats.h"
+#include "LuaAllocProfiler.h"
+#include "LuaScheduler.h"
+#include "LuaTickBatch.h"
+#include "LuaJobPool.h"
+#include "LuaSerializer.h"
+#include "LuaChannel.h"
+#include "LuaProxy.h"
+#include "LuaSharedTable.h"
+#include "LuaNativeCall.h"
+#include "LuaActorPool.h"
+#include "LuaOverride.h"
+#include "LuaHotReload.h"
+#include "LuaLogSink.h"
 #include "UnrealType.h"
-
-TMap<lua_State*, FLuaEnv*> FLuaEnv::luaEnvMap_;
-
-struct FUObjectProxy
-{
-	UObject* ptr;
-};
-
-struct FUStructProxy
-{
-	UScriptStruct* type;
-	void* ptr;
-};
-
-static int print(lua_State* L)
-{
-  int n = lua_gettop(L);  /* number of arguments */
-  int i;
-  FString msg;
-  lua_getglobal(L, "tostring");
-  for (i=1; i<=n; i++) {
-    const char *s;
-    size_t l;
-    lua_pushvalue(L, -1);  /* function to be called */
-    lua_pushvalue(L, i);   /* value to print */
-    lua_call(L, 1, 1);
-    s = lua_tolstring(L, -1, &l);  /* get result */
-    if (s == NULL)
-      return luaL_error(L, "'tostring' must return a string to 'print'");
-    if (i>1) 
-		msg += TEXT("\t");
-	msg += UTF8_TO_TCHAR(s);
-    lua_pop(L, 1);  /* pop result */
-  }
-  ULUA_LOG(Log, TEXT("print:%s"), *msg);
-  return 0;
-}
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Engine/DataTable.h"
+#include "Engine/World.h"
+#include "GameFramework/Actor.h"
+#include "Containers/Ticker.h"
 
 FName ULuaDelegate::NAME_Invoke(TEXT("invoke"));
 void ULuaDelegate::ProcessEvent(UFunction* f, void* params)
 {
-	luaEnv->invokeDelegate(this, params);
+	if (luaEnv)
+		luaEnv->invokeDelegate(this, params);
 }
 
 FLuaEnv::FLuaEnv():
 	luaState_(nullptr),
+	mainState_(nullptr),
 	memUsed_(0),
-	uobjTable_(LUA_NOREF)
+	uobjTable_(LUA_NOREF),
+	profiler_(nullptr),
+	crossingStats_(nullptr),
+	allocProfiler_(nullptr),
+	scheduler_(nullptr),
+	jobPool_(nullptr),
+	jobCodeTable_(LUA_NOREF),
+	tickBatch_(nullptr),
+	actorPool_(nullptr),
+	overrides_(nullptr),
+	hotReload_(nullptr),
+	lazyStrings_(false)
 {
 	luaState_ = lua_newstate(LUA_CALLBACK(memAlloc), this);
 	check(luaState_);
-	luaEnvMap_.Add(luaState_, this);
+	mainState_ = luaState_;
 	lua_atpanic(luaState_, LUA_CALLBACK(handlePanic));
 	
 	luaL_openlibs(luaState_);
+	wrapCatchingFunctions(luaState_);
 
 	int top = lua_gettop(luaState_);
 
-	lua_pushcfunction(luaState_, print);
-	lua_setglobal(luaState_, "print");
+	FLuaLogSink::openLibrary(luaState_, "print:");
 
 	// Create UObject table.
 	lua_newtable(luaState_);
@@ -92,14 +89,183 @@ FLuaEnv::FLuaEnv():
 	lua_setfield(luaState_, -2, "__gc");
 	lua_pop(luaState_, 1);
 
+	// Create lazy string metatable, its methods are those of the string
+	// library called with lua strings.
+	luaL_newmetatable(luaState_, "UStringMT");
+	lua_newtable(luaState_);
+	lua_getglobal(luaState_, "string");
+	lua_pushnil(luaState_);
+	while (lua_next(luaState_, -2))
+	{
+		lua_pushvalue(luaState_, -2);
+		lua_insert(luaState_, -2);
+		lua_pushcclosure(luaState_, LUA_CALLBACK(ustringMethod), 1);
+		lua_rawset(luaState_, -5);
+	}
+	lua_pop(luaState_, 1);
+	lua_setfield(luaState_, -2, "__index");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTToString));
+	lua_setfield(luaState_, -2, "__tostring");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTConcat));
+	lua_setfield(luaState_, -2, "__concat");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTLen));
+	lua_setfield(luaState_, -2, "__len");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTEq));
+	lua_setfield(luaState_, -2, "__eq");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTLt));
+	lua_setfield(luaState_, -2, "__lt");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTLe));
+	lua_setfield(luaState_, -2, "__le");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(ustringMTGC));
+	lua_setfield(luaState_, -2, "__gc");
+	// The core converts them for ==, table keys and lua_tolstring.
+	lua_setstringhook(luaState_, ustringHook);
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(stringsLazy));
+	lua_setfield(luaState_, -2, "lazy");
+	lua_setglobal(luaState_, "strings");
+
+	// Create column view metatables.
+	luaL_newmetatable(luaState_, "UColumnViewMT");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(columnViewMTIndex));
+	lua_setfield(luaState_, -2, "__index");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(columnViewMTLen));
+	lua_setfield(luaState_, -2, "__len");
+	lua_pop(luaState_, 1);
+	luaL_newmetatable(luaState_, "UColumnMT");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(columnMTIndex));
+	lua_setfield(luaState_, -2, "__index");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(columnMTNewIndex));
+	lua_setfield(luaState_, -2, "__newindex");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(columnMTLen));
+	lua_setfield(luaState_, -2, "__len");
+	lua_pop(luaState_, 1);
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(columnsOf));
+	lua_setfield(luaState_, -2, "of");
+	lua_setglobal(luaState_, "columns");
+
+	// Create scheduler table.
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(schedulerStart));
+	lua_setfield(luaState_, -2, "start");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(schedulerWait));
+	lua_setfield(luaState_, -2, "wait");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(schedulerWaitFrame));
+	lua_setfield(luaState_, -2, "waitFrame");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(schedulerWaitDelegate));
+	lua_setfield(luaState_, -2, "waitDelegate");
+	lua_setglobal(luaState_, "scheduler");
+	scheduler_ = new FLuaScheduler();
+	tickerHandle_ = FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FLuaEnv::tick));
+
+	// Create jobs table.
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(jobsRun));
+	lua_setfield(luaState_, -2, "run");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(jobsSubmit));
+	lua_setfield(luaState_, -2, "submit");
+	lua_setglobal(luaState_, "jobs");
+	lua_newtable(luaState_);
+	lua_newtable(luaState_); // metatable.
+	lua_pushstring(luaState_, "k");
+	lua_setfield(luaState_, -2, "__mode"); // weak key table.
+	lua_setmetatable(luaState_, -2);
+	jobCodeTable_ = luaL_ref(luaState_, LUA_REGISTRYINDEX);
+
+	FLuaChannel::openLibrary(luaState_);
+	FLuaSerializer::openLibrary(luaState_);
+	FLuaSharedTable::openLibrary(luaState_);
+
+	// Create batched tick table.
+	static const struct { const char* name; ETickingGroup group; } tickGroups[] =
+	{
+		{ "PrePhysics", TG_PrePhysics },
+		{ "StartPhysics", TG_StartPhysics },
+		{ "DuringPhysics", TG_DuringPhysics },
+		{ "EndPhysics", TG_EndPhysics },
+		{ "PostPhysics", TG_PostPhysics },
+		{ "PostUpdateWork", TG_PostUpdateWork },
+		{ "LastDemotable", TG_LastDemotable },
+	};
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(batchTickSetHandler));
+	lua_setfield(luaState_, -2, "setHandler");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(batchTickRegister));
+	lua_setfield(luaState_, -2, "register");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(batchTickUnregister));
+	lua_setfield(luaState_, -2, "unregister");
+	for (auto& it : tickGroups)
+	{
+		lua_pushinteger(luaState_, it.group);
+		lua_setfield(luaState_, -2, it.name);
+	}
+	lua_setglobal(luaState_, "batchTick");
+	tickBatch_ = new FLuaTickBatch(this, luaState_);
+
+	lua_pushcfunction(luaState_, LUA_CALLBACK(findObject));
+	lua_setglobal(luaState_, "findObject");
+
+	// Create actor pool table.
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(actorPoolSpawn));
+	lua_setfield(luaState_, -2, "spawn");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(actorPoolRelease));
+	lua_setfield(luaState_, -2, "release");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(actorPoolClear));
+	lua_setfield(luaState_, -2, "clear");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(actorPoolNum));
+	lua_setfield(luaState_, -2, "num");
+	lua_setglobal(luaState_, "actorPool");
+	actorPool_ = new FLuaActorPool();
+
+	// Create overrides table.
+	lua_newtable(luaState_);
+	lua_pushcfunction(luaState_, LUA_CALLBACK(overridesBind));
+	lua_setfield(luaState_, -2, "bind");
+	lua_pushcfunction(luaState_, LUA_CALLBACK(overridesUnbind));
+	lua_setfield(luaState_, -2, "unbind");
+	lua_setglobal(luaState_, "overrides");
+	overrides_ = new FLuaOverrides(this, luaState_);
+
+	// Modules are found in the project directory first.
+	lua_getglobal(luaState_, "package");
+	FString projectPath = FPaths::ConvertRelativePathToFull(FPaths::ProjectDir());
+	lua_pushfstring(luaState_, "%s?.lua;%s?/init.lua;", TCHAR_TO_UTF8(*projectPath), TCHAR_TO_UTF8(*projectPath));
+	lua_getfield(luaState_, -2, "path");
+	lua_concat(luaState_, 2);
+	lua_setfield(luaState_, -2, "path");
+	lua_pop(luaState_, 1);
+	hotReload_ = new FLuaHotReload(luaState_);
+
 	lua_settop(luaState_, top);
 	ULUA_LOG(Log, TEXT("FLuaEnv created."));
 }
 
 FLuaEnv::~FLuaEnv()
 {
-	lua_close(luaState_);
-	luaEnvMap_.Remove(luaState_);
+	FTicker::GetCoreTicker().RemoveTicker(tickerHandle_);
+	// Delegates may outlive the env, unbind them.
+	for (auto d : delegates_)
+	{
+		UObject* obj = d->bindedToObj.Get();
+		if (auto p = Cast<UMulticastDelegateProperty>(d->bindedToProp))
+		{
+			if (obj)
+				p->GetPropertyValuePtr_InContainer(obj)->Remove(d, ULuaDelegate::NAME_Invoke);
+		}
+		d->luaEnv = nullptr;
+	}
+	delete hotReload_;
+	delete overrides_;
+	delete tickBatch_;
+	delete actorPool_;
+	delete jobPool_;
+	delete profiler_;
+	delete crossingStats_;
+	stopAllocProfiler();
+	lua_close(mainState_);
+	delete scheduler_;
 	ULUA_LOG(Log, TEXT("FLuaEnv destroyed."));
 }
 
@@ -180,16 +346,23 @@ void* FLuaEnv::toUStruct(int idx, UScriptStruct* structType, bool check)
 
 FString	FLuaEnv::toFString(int idx, bool check)
 {
+	if (FUStringProxy* p = (FUStringProxy*)luaL_testudata(luaState_, idx, "UStringMT"))
+		return p->str();
 	return UTF8_TO_TCHAR(check?luaL_checkstring(luaState_, idx):lua_tostring(luaState_, idx));
 }
 
 FText FLuaEnv::toFText(int idx, bool check)
 {
+	// The text of a lazy FText keeps its localization.
+	if (FUStringProxy* p = (FUStringProxy*)luaL_testudata(luaState_, idx, "UStringMT"))
+		return p->isText ? *(FText*)p->ptr : FText::FromString(*(FString*)p->ptr);
 	return FText::FromString(UTF8_TO_TCHAR(check?luaL_checkstring(luaState_, idx):lua_tostring(luaState_, idx)));
 }
 
 FName FLuaEnv::toFName(int idx, bool check)
 {
+	if (FUStringProxy* p = (FUStringProxy*)luaL_testudata(luaState_, idx, "UStringMT"))
+		return *p->str();
 	return UTF8_TO_TCHAR(check?luaL_checkstring(luaState_, idx):lua_tostring(luaState_, idx));
 }
 
@@ -429,6 +602,22 @@ void FLuaEnv::pushFName(FName name)
 	pushFString(name.ToString());
 }
 
+void FLuaEnv::pushLazyFString(const FString& str)
+{
+	FUStringProxy* p = (FUStringProxy*)lua_newuserdata(luaState_, sizeof(FUStringProxy) + sizeof(FString));
+	p->isText = false;
+	p->ptr = new(p + 1) FString(str);
+	luaL_setmetatable(luaState_, "UStringMT");
+}
+
+void FLuaEnv::pushLazyFText(const FText& txt)
+{
+	FUStringProxy* p = (FUStringProxy*)lua_newuserdata(luaState_, sizeof(FUStringProxy) + sizeof(FText));
+	p->isText = true;
+	p->ptr = new(p + 1) FText(txt);
+	luaL_setmetatable(luaState_, "UStringMT");
+}
+
 void FLuaEnv::pushPropertyValue(void* obj, UProperty* prop)
 {
 	if(auto p = Cast<UByteProperty>(prop))
@@ -471,7 +660,12 @@ void FLuaEnv::pushPropertyValue(void* obj, UProperty* prop)
 	else if(auto p = Cast<UNameProperty>(prop))
 		pushFName(p->GetPropertyValue_InContainer(obj));
 	else if(auto p = Cast<UStrProperty>(prop))
-		pushFString(p->GetPropertyValue_InContainer(obj));
+	{
+		if (lazyStrings_)
+			pushLazyFString(p->GetPropertyValue_InContainer(obj));
+		else
+			pushFString(p->GetPropertyValue_InContainer(obj));
+	}
 	else if(auto p = Cast<UArrayProperty>(prop))
 	{
 		FScriptArrayHelper_InContainer cppArr(p, obj);
@@ -491,7 +685,11 @@ void FLuaEnv::pushPropertyValue(void* obj, UProperty* prop)
 		for(int i = 0; i < cppMapSize; i++)
 		{
 			uint8* pairPtr = cppMap.GetPairPtr(i);
-			pushPropertyValue(pairPtr + p->MapLayout.KeyOffset, p->KeyProp);
+			{
+				// Keys are found by value, lazy strings would not be.
+				TGuardValue<bool> eagerKeys(lazyStrings_, false);
+				pushPropertyValue(pairPtr + p->MapLayout.KeyOffset, p->KeyProp);
+			}
 			pushPropertyValue(pairPtr, p->ValueProp);
 			lua_rawset(luaState_, -3);
 		}
@@ -499,6 +697,7 @@ void FLuaEnv::pushPropertyValue(void* obj, UProperty* prop)
 	else if(auto p = Cast<USetProperty>(prop))
 	{
 		FScriptSetHelper_InContainer cppSet(p, obj);
+		TGuardValue<bool> eagerKeys(lazyStrings_, false);
 		int cppSetSize = cppSet.Num();
 		lua_createtable(luaState_, 0, cppSetSize);
 		for(int i = 0; i < cppSetSize; i++)
@@ -522,7 +721,12 @@ void FLuaEnv::pushPropertyValue(void* obj, UProperty* prop)
 		// todo.
 	}
 	else if(auto p = Cast<UTextProperty>(prop))
-		pushFText(p->GetPropertyValue_InContainer(obj));
+	{
+		if (lazyStrings_)
+			pushLazyFText(p->GetPropertyValue_InContainer(obj));
+		else
+			pushFText(p->GetPropertyValue_InContainer(obj));
+	}
 	else if(auto p = Cast<UEnumProperty>(prop))
 	{
 		uint8* propData = p->ContainerPtrToValuePtr<uint8>(obj);
@@ -543,15 +747,254 @@ bool FLuaEnv::loadString(const char* s)
 
 bool FLuaEnv::pcall(int n, int r)
 {
-	if (lua_pcall(luaState_, n, r, 0) != LUA_OK)
+	lua_State* L = luaState_;
+	int status = lua_pcall(L, n, r, 0);
+	setRunningThread(L);
+	if (status != LUA_OK)
 	{
-		ULUA_LOG(Error, TEXT("%s"), UTF8_TO_TCHAR(lua_tostring(luaState_, -1)));
-		lua_pop(luaState_, 1);
+		ULUA_LOG(Error, TEXT("%s"), UTF8_TO_TCHAR(lua_tostring(L, -1)));
+		lua_pop(L, 1);
+		return false;
+	}
+	return true;
+}
+
+bool FLuaEnv::startProfiler(int32 sampleIntervalUs, int32 maxSamples)
+{
+	stopProfiler();
+	delete profiler_;
+	profiler_ = new FLuaProfiler(sampleIntervalUs, maxSamples);
+	if (!profiler_->start(luaState_, _lua_cb_profilerHook))
+	{
+		ULUA_LOG(Error, TEXT("Can not start profiler, a debug hook is set."));
+		return false;
+	}
+	ULUA_LOG(Log, TEXT("Profiler started, sample interval %dus."), sampleIntervalUs);
+	return true;
+}
+
+void FLuaEnv::stopProfiler()
+{
+	if (profiler_ && profiler_->isRunning())
+	{
+		profiler_->stop();
+		ULUA_LOG(Log, TEXT("Profiler stopped, %d samples."), profiler_->numSamples());
+	}
+}
+
+bool FLuaEnv::dumpProfiler(const FString& filename)
+{
+	if (!profiler_)
+		return false;
+	if (!FFileHelper::SaveStringToFile(profiler_->dumpFolded(), *filename))
+	{
+		ULUA_LOG(Error, TEXT("Can not write profile \"%s\"."), *filename);
 		return false;
 	}
 	return true;
 }
 
+void FLuaEnv::enableCrossingStats(bool enable)
+{
+	if (enable && !crossingStats_)
+		crossingStats_ = new FLuaCrossingStats();
+	else if (!enable && crossingStats_)
+	{
+		delete crossingStats_;
+		crossingStats_ = nullptr;
+	}
+}
+
+bool FLuaEnv::dumpCrossingStats(const FString& filename)
+{
+	return crossingStats_ && crossingStats_->dumpCsv(filename);
+}
+
+void FLuaEnv::startAllocProfiler(int32 sampleBytes)
+{
+	stopAllocProfiler();
+	allocProfiler_ = new FLuaAllocProfiler(sampleBytes);
+	ULUA_LOG(Log, TEXT("Allocation profiler started, one sample every %d bytes."), sampleBytes);
+}
+
+void FLuaEnv::stopAllocProfiler()
+{
+	delete allocProfiler_;
+	allocProfiler_ = nullptr;
+}
+
+bool FLuaEnv::dumpAllocProfiler(const FString& filename)
+{
+	if (!allocProfiler_)
+		return false;
+	if (!FFileHelper::SaveStringToFile(allocProfiler_->dumpCsv(), *filename))
+	{
+		ULUA_LOG(Error, TEXT("Can not write allocation profile \"%s\"."), *filename);
+		return false;
+	}
+	return true;
+}
+
+bool FLuaEnv::tick(float deltaSeconds)
+{
+	if (jobPool_)
+		dispatchCompletedJobs();
+
+	lua_State* L = luaState_;
+	hotReload_->tick(L, deltaSeconds);
+	setRunningThread(L);
+
+	TArray<int> due;
+	scheduler_->advance(deltaSeconds, due);
+	for (int threadRef : due)
+		resumeThread(threadRef, 0);
+	return true;
+}
+
+void FLuaEnv::setRunningThread(lua_State* L)
+{
+	luaState_ = L;
+	if (profiler_ && profiler_->isRunning())
+		profiler_->setRunning(L);
+}
+
+void FLuaEnv::resumeThread(int threadRef, int n)
+{
+	lua_State* L = luaState_;
+	// Keep the thread on stack while it runs, nothing else references it.
+	lua_rawgeti(L, LUA_REGISTRYINDEX, threadRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+	lua_insert(L, -(n + 1));
+	lua_State* co = lua_tothread(L, -(n + 1));
+	if (lua_status(co) == LUA_OK && lua_gettop(co) == 0)
+	{
+		ULUA_LOG(Warning, TEXT("Can not resume dead coroutine."));
+		lua_pop(L, n + 1);
+		return;
+	}
+	lua_xmove(L, co, n);
+	setRunningThread(co);
+	int status = lua_resume(co, L, n);
+	setRunningThread(L);
+	if (status == LUA_YIELD)
+	{
+		// Scheduler waits yield the scheduler.
+		if (lua_gettop(co) != 1 || lua_touserdata(co, -1) != scheduler_)
+			ULUA_LOG(Warning, TEXT("Coroutine yielded outside of the scheduler, it will not be resumed."));
+		lua_settop(co, 0);
+	}
+	else if (status == LUA_OK)
+		lua_settop(co, 0);
+	else
+	{
+		luaL_traceback(L, co, lua_tostring(co, -1), 0);
+		ULUA_LOG(Error, TEXT("%s"), UTF8_TO_TCHAR(lua_tostring(L, -1)));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+void FLuaEnv::wrapCatchingFunctions(lua_State* L)
+{
+	static const char* catching[] = { "pcall", "xpcall" };
+	for (const char* name : catching)
+	{
+		lua_getglobal(L, name);
+		lua_pushcclosure(L, callCatching, 1);
+		lua_setglobal(L, name);
+	}
+	lua_getglobal(L, "coroutine");
+	lua_getfield(L, -1, "create");
+	lua_getfield(L, -2, "resume");
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, coroutineResume, 1);
+	lua_setfield(L, -4, "resume");
+	lua_pushcclosure(L, coroutineWrap, 2);
+	lua_setfield(L, -2, "wrap");
+	lua_pop(L, 1);
+}
+
+int FLuaEnv::callCatching(lua_State* L)
+{
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	// Also restored when resumed after a yield through the call.
+	lua_callk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, callCatchingK);
+	return callCatchingK(L, LUA_OK, 0);
+}
+
+int FLuaEnv::callCatchingK(lua_State* L, int status, lua_KContext ctx)
+{
+	getLuaEnv(L)->setRunningThread(L);
+	return lua_gettop(L);
+}
+
+int FLuaEnv::coroutineResume(lua_State* L)
+{
+	//=========================================
+	//=>upvalue 1: coroutine.resume
+	//=========================================
+	if (lua_State* co = lua_tothread(L, 1))
+		getLuaEnv(L)->setRunningThread(co);
+	return callCatching(L);
+}
+
+int FLuaEnv::coroutineWrap(lua_State* L)
+{
+	//=========================================
+	//=>upvalue 1: coroutine.create
+	//=>upvalue 2: coroutine.resume
+	//=========================================
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, 1);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, -2);
+	lua_pushcclosure(L, coroutineWrapCall, 2);
+	return 1;
+}
+
+int FLuaEnv::coroutineWrapCall(lua_State* L)
+{
+	//=========================================
+	//=>upvalue 1: coroutine.resume
+	//=>upvalue 2: coroutine
+	//=========================================
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 2);
+	getLuaEnv(L)->setRunningThread(lua_tothread(L, 2));
+	lua_callk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, coroutineWrapCallK);
+	return coroutineWrapCallK(L, LUA_OK, 0);
+}
+
+int FLuaEnv::coroutineWrapCallK(lua_State* L, int status, lua_KContext ctx)
+{
+	getLuaEnv(L)->setRunningThread(L);
+	// Errors propagate, with the position of the caller as coroutine.wrap does.
+	if (!lua_toboolean(L, 1))
+	{
+		if (lua_type(L, -1) == LUA_TSTRING)
+		{
+			luaL_where(L, 1);
+			lua_insert(L, -2);
+			lua_concat(L, 2);
+		}
+		return lua_error(L);
+	}
+	lua_remove(L, 1);
+	return lua_gettop(L);
+}
+
+int FLuaEnv::refYieldingThread()
+{
+	if (!lua_isyieldable(luaState_))
+		throwError("Can not wait outside of a coroutine.");
+	lua_pushthread(luaState_);
+	return luaL_ref(luaState_, LUA_REGISTRYINDEX);
+}
+
 void FLuaEnv::throwError(const char* fmt, ...)
 {
   va_list argp;
@@ -565,54 +1008,33 @@ struct FFuncParamStruct
 {
 	FFuncParamStruct(UFunction* f, void* b):
 		buffer(b),
-		parmNum(0), 
-		retParm(nullptr),
-		outParmNum(0)
+		plan(FLuaNativeCall::plan(f))
 	{
-		for(TFieldIterator<UProperty> it(f); it && it->HasAnyPropertyFlags(CPF_Parm); ++it)
-		{
-			UProperty* parm = *it;
+		for(UProperty* parm : plan.parms)
 			parm->InitializeValue_InContainer(buffer);
-			if(parm->HasAnyPropertyFlags(CPF_ReturnParm))
-			{
-				// return parameter.
-				retParm = parm;
-			}
-			else
-			{
-				parms[parmNum] = parm;
-				parmNum++;
-				check(parmNum <= ParmMax);
-				if((parm->PropertyFlags & (CPF_ConstParm | CPF_OutParm)) == CPF_OutParm)
-				{
-					// out parameter.
-					outParms[outParmNum] = parm;
-					outParmNum++;
-				}
-			}
-		}
+		if(plan.retParm)
+			plan.retParm->InitializeValue_InContainer(buffer);
 	}
 
 	~FFuncParamStruct()
 	{
-		for(int i = 0; i < parmNum; i++)
-			parms[i]->DestroyValue_InContainer(buffer);
-		if(retParm)
-			retParm->DestroyValue_InContainer(buffer);
+		for(UProperty* parm : plan.parms)
+			parm->DestroyValue_InContainer(buffer);
+		if(plan.retParm)
+			plan.retParm->DestroyValue_InContainer(buffer);
 		ULUA_LOG(Verbose, TEXT("FFuncParamStruct destructed."));
 	}
 
 	void*		buffer;
-	enum {ParmMax = 16};
-	UProperty*	parms[ParmMax];
-	int			parmNum;
-	UProperty*	retParm;
-	UProperty*	outParms[ParmMax];
-	int			outParmNum;
+	const FLuaCallPlan& plan;
 };
 
 int FLuaEnv::callUFunction(UFunction* func)
 {
+	uint64 statsStart = crossingStats_ ? FLuaCrossingStats::begin() : 0;
+	if (crossingStats_)
+		crossingStats_->count(ELuaCrossing::Call, func);
+
 	// Get Self Object.
 	bool isStaticFunc = func->HasAnyFunctionFlags(FUNC_Static);
 	int paramIdx = isStaticFunc?2:3;
@@ -630,48 +1052,301 @@ int FLuaEnv::callUFunction(UFunction* func)
 	FFuncParamStruct params(func, paramBuffer);
 
 	// Get function parameter value from lua stack.
-	for(int i = 0; i < params.parmNum; i++)
+	for(UProperty* parm : params.plan.parms)
 	{
-		toPropertyValue(paramBuffer, false, params.parms[i], paramIdx, true);
+		toPropertyValue(paramBuffer, false, parm, paramIdx, true);
 		paramIdx++;
 	}
 
-	// Call UFunction.
-	obj->ProcessEvent(func, paramBuffer);
+	// Call UFunction, natively when possible.
+	FLuaNativeCall::call(obj, func, paramBuffer);
 
 	int retNum = 0;
 	// Return value to lua stack.
-	if(params.retParm)
+	if(params.plan.retParm)
 	{
-		pushPropertyValue(paramBuffer, params.retParm);
+		pushPropertyValue(paramBuffer, params.plan.retParm);
 		retNum++;
 	}
 
 	// Return out value to lua stack.
-	for(int i = 0; i < params.outParmNum; i++)
+	for(UProperty* parm : params.plan.outParms)
 	{
-		pushPropertyValue(paramBuffer, params.outParms[i]);
+		pushPropertyValue(paramBuffer, parm);
 		retNum++;
 	}
 
+	if (crossingStats_)
+		crossingStats_->end(ELuaCrossing::Call, func, statsStart);
 	return retNum;
 }
 
 int FLuaEnv::callUClass(UClass* cls)
 {
-	// todo.
-	return 0;
+	if (cls->HasAnyClassFlags(CLASS_Abstract))
+		throwError("Can not create abstract class \"%s\"", TCHAR_TO_UTF8(*cls->GetName()));
+	if (cls->IsChildOf<AActor>())
+	{
+		// Spawn actor: Class(worldContext[, transform | location[, rotation]]).
+		UWorld* world = toWorld(2);
+		FTransform transform = toSpawnTransform(3);
+		pushUObject(world->SpawnActor(cls, &transform));
+		return 1;
+	}
+
+	// New object: Class([outer[, name]]).
+	UObject* outer = toUObject(2, nullptr, false);
+	if (!outer)
+		outer = GetTransientPackage();
+	FName name = lua_isnoneornil(luaState_, 3) ? NAME_None : toFName(3, true);
+	// NewObject checks these and asserts.
+	if (!outer->IsA(cls->ClassWithin))
+		throwError("Object of class \"%s\" must be created in a \"%s\", not in \"%s\"",
+			TCHAR_TO_UTF8(*cls->GetName()), TCHAR_TO_UTF8(*cls->ClassWithin->GetName()), TCHAR_TO_UTF8(*outer->GetName()));
+	if (name != NAME_None && StaticFindObjectFast(nullptr, outer, name))
+		throwError("Object \"%s\" already exists in \"%s\"", TCHAR_TO_UTF8(*name.ToString()), TCHAR_TO_UTF8(*outer->GetName()));
+	pushUObject(NewObject<UObject>(outer, cls, name));
+	return 1;
 }
 
 int FLuaEnv::callStruct(UScriptStruct* s)
 {
-	// todo.
+	// New struct: Struct([struct | {field = value, ...}]).
+	structs_.Add(s);
+	FUStructProxy* p = (FUStructProxy*)lua_newuserdata(luaState_, sizeof(FUStructProxy) + s->GetStructureSize());
+	p->type = s;
+	p->ptr = p + 1;
+	s->InitializeStruct(p->ptr);
+	luaL_setmetatable(luaState_, "UStructMT");
+	//=========================================
+	//=>Struct
+	//=>init
+	//=>FUStructProxy
+	//=========================================
+	if (lua_istable(luaState_, 2))
+	{
+		lua_pushnil(luaState_);
+		while (lua_next(luaState_, 2) != 0)
+		{
+			if (lua_type(luaState_, -2) != LUA_TSTRING)
+				throwError("Struct initializer keys must be field names");
+			FName name = toFName(-2, true);
+			UProperty* prop = FindField<UProperty>(s, name);
+			if (!prop)
+				throwError("Invalid field name %s", TCHAR_TO_UTF8(*name.ToString()));
+			toPropertyValue(p->ptr, false, prop, lua_gettop(luaState_), true);
+			lua_pop(luaState_, 1);
+		}
+	}
+	else if (!lua_isnoneornil(luaState_, 2))
+	{
+		s->CopyScriptStruct(p->ptr, toUStruct(2, s, true));
+	}
+	return 1;
+}
+
+UWorld* FLuaEnv::toWorld(int idx)
+{
+	UObject* context = toUObject(idx, nullptr, true);
+	UWorld* world = context ? context->GetWorld() : nullptr;
+	if (!world)
+		throwError("Invalid world context object");
+	return world;
+}
+
+FTransform FLuaEnv::toSpawnTransform(int idx)
+{
+	if (lua_isnoneornil(luaState_, idx))
+		return FTransform::Identity;
+	if (void* t = toUStruct(idx, TBaseStructure<FTransform>::Get(), false))
+		return *(FTransform*)t;
+	FVector location = *(FVector*)toUStruct(idx, TBaseStructure<FVector>::Get(), true);
+	if (lua_isnoneornil(luaState_, idx + 1))
+		return FTransform(location);
+	return FTransform(*(FRotator*)toUStruct(idx + 1, TBaseStructure<FRotator>::Get(), true), location);
+}
+
+int FLuaEnv::findObject()
+{
+	FString name = toFString(1, true);
+	UObject* obj = StaticFindObject(UObject::StaticClass(), ANY_PACKAGE, *name);
+	if (!obj && name.StartsWith(TEXT("/")))
+		obj = StaticLoadObject(UObject::StaticClass(), nullptr, *name);
+	pushUObject(obj);
+	return 1;
+}
+
+int FLuaEnv::actorPoolSpawn()
+{
+	UClass* cls = Cast<UClass>(toUObject(1, UClass::StaticClass(), true));
+	if (!cls || !cls->IsChildOf<AActor>() || cls->HasAnyClassFlags(CLASS_Abstract))
+		throwError("Invalid actor class");
+	UWorld* world = toWorld(2);
+	FTransform transform = toSpawnTransform(3);
+	AActor* actor = actorPool_->acquire(world, cls, transform);
+	bool reused = actor != nullptr;
+	if (!actor)
+		actor = world->SpawnActor(cls, &transform);
+	pushUObject(actor);
+	lua_pushboolean(luaState_, reused);
+	return 2;
+}
+
+int FLuaEnv::actorPoolRelease()
+{
+	AActor* actor = Cast<AActor>(toUObject(1, AActor::StaticClass(), true));
+	if (!actor)
+		throwError("Invalid actor");
+	lua_pushboolean(luaState_, actorPool_->release(actor));
+	return 1;
+}
+
+int FLuaEnv::actorPoolClear()
+{
+	actorPool_->clear(Cast<UClass>(toUObject(1, UClass::StaticClass(), false)));
 	return 0;
 }
 
+int FLuaEnv::actorPoolNum()
+{
+	lua_pushinteger(luaState_, actorPool_->num(Cast<UClass>(toUObject(1, UClass::StaticClass(), true))));
+	return 1;
+}
+
+void FLuaEnv::invokeOverride(int funcRef, FFrame& stack, void* result)
+{
+	UFunction* func = (UFunction*)stack.Node;
+	const FLuaCallPlan& plan = FLuaNativeCall::plan(func);
+	lua_State* L = luaState_;
+	int top = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, funcRef);
+	pushUObject(stack.Object);
+	for (UProperty* parm : plan.parms)
+		pushPropertyValue(stack.Locals, parm);
+	int numResults = (plan.retParm ? 1 : 0) + plan.outParms.Num();
+	if (!pcall(plan.parms.Num() + 1, numResults))
+		return;
+
+	// Results as callUFunction returns them: return value, then out parameters.
+	// They are converted in a buffer of their own, the frame locals of
+	// ProcessEvent being a shallow copy of its parameters.
+	uint8* buffer = (uint8*)FMemory_Alloca(func->ParmsSize);
+	auto setResult = [&](UProperty* parm, int idx, void* dest)
+	{
+		parm->InitializeValue_InContainer(buffer);
+		toPropertyValue(buffer, false, parm, idx, false);
+		parm->CopyCompleteValue(dest, parm->ContainerPtrToValuePtr<void>(buffer));
+		parm->DestroyValue_InContainer(buffer);
+	};
+	int idx = top + 1;
+	if (plan.retParm)
+	{
+		if (result)
+			setResult(plan.retParm, idx, result);
+		idx++;
+	}
+	for (UProperty* parm : plan.outParms)
+	{
+		void* dest = nullptr;
+		for (FOutParmRec* out = stack.OutParms; out && !dest; out = out->NextOutParm)
+		{
+			if (out->Property == parm)
+				dest = out->PropAddr;
+		}
+		setResult(parm, idx, dest ? dest : parm->ContainerPtrToValuePtr<void>(stack.Locals));
+		idx++;
+	}
+	lua_settop(L, top);
+}
+
+int FLuaEnv::overridesBind()
+{
+	UClass* cls = Cast<UClass>(toUObject(1, UClass::StaticClass(), true));
+	if (!cls)
+		throwError("Invalid class");
+	luaL_checktype(luaState_, 2, LUA_TTABLE);
+	lua_pushnil(luaState_);
+	while (lua_next(luaState_, 2) != 0)
+	{
+		if (lua_type(luaState_, -2) == LUA_TSTRING && lua_isfunction(luaState_, -1))
+		{
+			FName name = toFName(-2, true);
+			if (!overrides_->add(luaState_, cls, name, lua_gettop(luaState_)))
+				throwError("Can not override \"%s\" of \"%s\", not a blueprint event or overridden by another env",
+					TCHAR_TO_UTF8(*name.ToString()), TCHAR_TO_UTF8(*cls->GetName()));
+		}
+		lua_pop(luaState_, 1);
+	}
+	return 0;
+}
+
+int FLuaEnv::overridesUnbind()
+{
+	UClass* cls = Cast<UClass>(toUObject(1, UClass::StaticClass(), true));
+	if (cls)
+		overrides_->remove(cls);
+	return 0;
+}
+
+ULuaDelegate* FLuaEnv::bindDelegate(UObject* obj, UMulticastDelegateProperty* prop, int luaObjRef)
+{
+	ULuaDelegate* d = NewObject<ULuaDelegate>();
+	d->bindedToObj = obj;
+	d->bindedToProp = prop;
+	d->luaEnv = this;
+	d->luaObjRef = luaObjRef;
+	FScriptDelegate sd;
+	sd.BindUFunction(d, ULuaDelegate::NAME_Invoke);
+	prop->GetPropertyValuePtr_InContainer(obj)->AddUnique(sd);
+	delegates_.Add(d);
+	return d;
+}
+
 void FLuaEnv::invokeDelegate(ULuaDelegate* d, void* params)
 {
-	// todo.
+	if (d->luaObjRef == LUA_NOREF)
+		return;
+	lua_State* L = luaState_;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, d->luaObjRef);
+	bool isThread = lua_isthread(L, -1);
+	if (isThread)
+	{
+		// Waiting coroutines are resumed once.
+		lua_pop(L, 1);
+		UObject* obj = d->bindedToObj.Get();
+		if (auto p = Cast<UMulticastDelegateProperty>(d->bindedToProp))
+		{
+			if (obj)
+				p->GetPropertyValuePtr_InContainer(obj)->Remove(d, ULuaDelegate::NAME_Invoke);
+		}
+	}
+
+	// Push delegate parameters.
+	int n = 0;
+	UFunction* sig = nullptr;
+	if (auto p = Cast<UMulticastDelegateProperty>(d->bindedToProp))
+		sig = p->SignatureFunction;
+	else if (auto p = Cast<UDelegateProperty>(d->bindedToProp))
+		sig = p->SignatureFunction;
+	if (sig)
+	{
+		for (TFieldIterator<UProperty> it(sig); it && it->HasAnyPropertyFlags(CPF_Parm); ++it)
+		{
+			if (it->HasAnyPropertyFlags(CPF_ReturnParm))
+				continue;
+			pushPropertyValue(params, *it);
+			n++;
+		}
+	}
+
+	if (isThread)
+	{
+		int threadRef = d->luaObjRef;
+		d->luaObjRef = LUA_NOREF;
+		resumeThread(threadRef, n);
+	}
+	else
+		pcall(n, 0);
 }
 
 bool FLuaEnv::isDelegateUnused(ULuaDelegate* d)
@@ -710,7 +1385,14 @@ void FLuaEnv::clearUnusedDelegate(ULuaDelegate* d)
 
 void* FLuaEnv::memAlloc(void* ptr, size_t osize, size_t nsize)
 {
-	memUsed_ = memUsed_ - osize + nsize;
+	memUsed_ = memUsed_ - (ptr ? osize : 0) + nsize;
+	if (allocProfiler_ && mainState_)
+	{
+		allocProfiler_->beginAlloc(luaState_, ptr, osize, nsize);
+		void* newPtr = nsize == 0 ? (FMemory::Free(ptr), nullptr) : FMemory::Realloc(ptr, nsize);
+		allocProfiler_->endAlloc(ptr, newPtr, nsize);
+		return newPtr;
+	}
 	if(nsize == 0)
 	{
 		FMemory::Free(ptr);
@@ -720,6 +1402,18 @@ void* FLuaEnv::memAlloc(void* ptr, size_t osize, size_t nsize)
 		return FMemory::Realloc(ptr, nsize);
 }
 
+void FLuaEnv::_lua_cb_profilerHook(lua_State* L, lua_Debug* ar)
+{
+	// The allocator data is shared by all threads of the state.
+	void* ud = nullptr;
+	lua_getallocf(L, &ud);
+	FLuaProfiler* profiler = ((FLuaEnv*)ud)->profiler_;
+	if (profiler)
+		profiler->onHook(L);
+	else
+		lua_sethook(L, nullptr, 0, 0);
+}
+
 int FLuaEnv::handlePanic()
 {
 	ULUA_LOG(Error, TEXT("PANIC:%s"), UTF8_TO_TCHAR(lua_tostring(luaState_, -1)));
@@ -728,11 +1422,14 @@ int FLuaEnv::handlePanic()
 
 int FLuaEnv::uobjMTIndex()
 {
+	uint64 statsStart = crossingStats_ ? FLuaCrossingStats::begin() : 0;
 	FUObjectProxy* p = (FUObjectProxy*)lua_touserdata(luaState_, 1);
 	UObject* obj = p->ptr;
 	FName name = toFName(2, true);
 	// todo: optimize.
 	UField* field = FindField<UField>(obj->GetClass(), name);
+	if (crossingStats_ && field)
+		crossingStats_->count(ELuaCrossing::ObjectGet, field);
 	if (auto prop = Cast<UProperty>(field))
 	{
 		// Return property value.
@@ -747,16 +1444,21 @@ int FLuaEnv::uobjMTIndex()
 	{
 		throwError("Invalid field name %s", TCHAR_TO_UTF8(*name.ToString()));
 	}
+	if (crossingStats_)
+		crossingStats_->end(ELuaCrossing::ObjectGet, field, statsStart);
 	return 1;
 }
 
 int FLuaEnv::uobjMTNewIndex()
 {
+	uint64 statsStart = crossingStats_ ? FLuaCrossingStats::begin() : 0;
 	FUObjectProxy* p = (FUObjectProxy*)lua_touserdata(luaState_, 1);
 	UObject* obj = p->ptr;
 	FName name = toFName(2, true);
 	// todo: optimize.
 	UProperty* prop = FindField<UProperty>(obj->GetClass(), name);
+	if (crossingStats_ && prop)
+		crossingStats_->count(ELuaCrossing::ObjectSet, prop);
 	if (prop)
 	{
 		toPropertyValue(obj, true, prop, 3, true);
@@ -765,6 +1467,8 @@ int FLuaEnv::uobjMTNewIndex()
 	{
 		throwError("Invalid field name \"%s\"", TCHAR_TO_UTF8(*name.ToString()));
 	}
+	if (crossingStats_)
+		crossingStats_->end(ELuaCrossing::ObjectSet, prop, statsStart);
 	return 0;
 }
 
@@ -804,10 +1508,13 @@ int FLuaEnv::uobjMTToString()
 
 int FLuaEnv::ustructMTIndex()
 {
+	uint64 statsStart = crossingStats_ ? FLuaCrossingStats::begin() : 0;
 	FUStructProxy* p = (FUStructProxy*)lua_touserdata(luaState_, 1);
 	FName name = toFName(2, true);
 	// todo: optimize.
 	UProperty* prop = FindField<UProperty>(p->type, name);
+	if (crossingStats_ && prop)
+		crossingStats_->count(ELuaCrossing::StructGet, prop);
 	if (prop)
 	{
 		// Return property value.
@@ -817,15 +1524,20 @@ int FLuaEnv::ustructMTIndex()
 	{
 		throwError("Invalid field name %s", TCHAR_TO_UTF8(*name.ToString()));
 	}
+	if (crossingStats_)
+		crossingStats_->end(ELuaCrossing::StructGet, prop, statsStart);
 	return 1;
 }
 
 int FLuaEnv::ustructMTNewIndex()
 {
+	uint64 statsStart = crossingStats_ ? FLuaCrossingStats::begin() : 0;
 	FUStructProxy* p = (FUStructProxy*)lua_touserdata(luaState_, 1);
 	FName name = toFName(2, true);
 	// todo: optimize.
 	UProperty* prop = FindField<UProperty>(p->type, name);
+	if (crossingStats_ && prop)
+		crossingStats_->count(ELuaCrossing::StructSet, prop);
 	if (prop)
 	{
 		// Return property value.
@@ -835,6 +1547,8 @@ int FLuaEnv::ustructMTNewIndex()
 	{
 		throwError("Invalid field name %s", TCHAR_TO_UTF8(*name.ToString()));
 	}
+	if (crossingStats_)
+		crossingStats_->end(ELuaCrossing::StructSet, prop, statsStart);
 	return 0;
 }
 
@@ -845,3 +1559,530 @@ int FLuaEnv::ustructMTGC()
 	ULUA_LOG(Verbose, TEXT("Struct \"%s\" destroyed."), (*(p->type->GetName())));
 	return 0;
 }
+
+/** Push the lua string of lazy string p at idx, converted once. */
+static void pushLazyString(lua_State* L, FUStringProxy* p, int idx)
+{
+	// The user value keeps the converted string alive.
+	if (lua_getuservalue(L, idx) != LUA_TSTRING)
+	{
+		lua_pop(L, 1);
+		FTCHARToUTF8 utf8(*p->str());
+		lua_pushlstring(L, utf8.Get(), utf8.Length());
+		lua_pushvalue(L, -1);
+		lua_setuservalue(L, idx < 0 ? idx - 2 : idx);
+	}
+}
+
+const char* FLuaEnv::toLuaString(int idx, size_t* len)
+{
+	FUStringProxy* p = (FUStringProxy*)luaL_testudata(luaState_, idx, "UStringMT");
+	if (!p)
+		return lua_type(luaState_, idx) == LUA_TSTRING ? lua_tolstring(luaState_, idx, len) : nullptr;
+	pushLazyString(luaState_, p, idx);
+	const char* s = lua_tolstring(luaState_, -1, len);
+	lua_pop(luaState_, 1);
+	return s;
+}
+
+int FLuaEnv::ustringHook(lua_State* L)
+{
+	// Only called with lazy strings.
+	pushLazyString(L, (FUStringProxy*)lua_touserdata(L, 1), 1);
+	return 1;
+}
+
+int FLuaEnv::stringsLazy()
+{
+	lua_pushboolean(luaState_, lazyStrings_);
+	if (!lua_isnone(luaState_, 1))
+		lazyStrings_ = !!lua_toboolean(luaState_, 1);
+	return 1;
+}
+
+int FLuaEnv::ustringMethod()
+{
+	//=========================================
+	//=>arguments, lazy strings replaced by lua strings
+	//=========================================
+	lua_State* L = luaState_;
+	int n = lua_gettop(L);
+	for (int i = 1; i <= n; i++)
+	{
+		if (luaL_testudata(L, i, "UStringMT"))
+		{
+			size_t len;
+			const char* s = toLuaString(i, &len);
+			lua_pushlstring(L, s, len);
+			lua_replace(L, i);
+		}
+	}
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, n, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+int FLuaEnv::ustringMTToString()
+{
+	size_t len;
+	const char* s = toLuaString(1, &len);
+	lua_pushlstring(luaState_, s, len);
+	return 1;
+}
+
+int FLuaEnv::ustringMTConcat()
+{
+	// Numbers are converted as lua does.
+	for (int i = 1; i <= 2; i++)
+	{
+		size_t len;
+		const char* s = lua_isnumber(luaState_, i) ? lua_tolstring(luaState_, i, &len) : toLuaString(i, &len);
+		if (!s)
+			throwError("attempt to concatenate a %s value", luaL_typename(luaState_, i));
+		lua_pushlstring(luaState_, s, len);
+	}
+	lua_concat(luaState_, 2);
+	return 1;
+}
+
+int FLuaEnv::ustringMTLen()
+{
+	size_t len;
+	toLuaString(1, &len);
+	lua_pushinteger(luaState_, (lua_Integer)len);
+	return 1;
+}
+
+int FLuaEnv::ustringMTEq()
+{
+	// Called for any two userdata, one being a lazy string. The core compares
+	// lazy strings with lua strings.
+	FUStringProxy* a = (FUStringProxy*)luaL_testudata(luaState_, 1, "UStringMT");
+	FUStringProxy* b = (FUStringProxy*)luaL_testudata(luaState_, 2, "UStringMT");
+	lua_pushboolean(luaState_, a && b && a->str().Equals(b->str(), ESearchCase::CaseSensitive));
+	return 1;
+}
+
+int FLuaEnv::ustringCompare(int op)
+{
+	for (int i = 1; i <= 2; i++)
+	{
+		size_t len;
+		const char* s = toLuaString(i, &len);
+		if (!s)
+			throwError("attempt to compare a lazy string with %s", luaL_typename(luaState_, i));
+		lua_pushlstring(luaState_, s, len);
+	}
+	lua_pushboolean(luaState_, lua_compare(luaState_, -2, -1, op));
+	return 1;
+}
+
+int FLuaEnv::ustringMTLt()
+{
+	return ustringCompare(LUA_OPLT);
+}
+
+int FLuaEnv::ustringMTLe()
+{
+	return ustringCompare(LUA_OPLE);
+}
+
+int FLuaEnv::ustringMTGC()
+{
+	FUStringProxy* p = (FUStringProxy*)lua_touserdata(luaState_, 1);
+	if (p->isText)
+		((FText*)p->ptr)->~FText();
+	else
+		((FString*)p->ptr)->~FString();
+	return 0;
+}
+
+int FLuaEnv::columnsOf()
+{
+	UObject* obj = toUObject(1, nullptr, true);
+	if (!obj)
+		throwError("Invalid UObject");
+	UArrayProperty* arrayProp = nullptr;
+	UScriptStruct* type = nullptr;
+	UDataTable* dataTable = nullptr;
+	int32 numRows = 0;
+	if (lua_isnoneornil(luaState_, 2))
+	{
+		dataTable = Cast<UDataTable>(obj);
+		if (!dataTable || !dataTable->RowStruct)
+			throwError("Columns of \"%s\" need an array property name", TCHAR_TO_UTF8(*obj->GetName()));
+		type = dataTable->RowStruct;
+		numRows = dataTable->RowMap.Num();
+	}
+	else
+	{
+		FName name = toFName(2, true);
+		arrayProp = FindField<UArrayProperty>(obj->GetClass(), name);
+		UStructProperty* inner = arrayProp ? Cast<UStructProperty>(arrayProp->Inner) : nullptr;
+		if (!inner)
+			throwError("\"%s\" is not an array of structs", TCHAR_TO_UTF8(*name.ToString()));
+		type = inner->Struct;
+	}
+	structs_.Add(type);
+
+	FUColumnViewProxy* v = (FUColumnViewProxy*)lua_newuserdata(luaState_, sizeof(FUColumnViewProxy) + numRows * sizeof(FName));
+	v->owner = (FUObjectProxy*)lua_touserdata(luaState_, 1);
+	v->arrayProp = arrayProp;
+	v->type = type;
+	v->numRows = numRows;
+	v->rowNames = (FName*)(v + 1);
+	if (dataTable)
+	{
+		int32 i = 0;
+		for (auto& it : dataTable->RowMap)
+			new(&v->rowNames[i++]) FName(it.Key);
+	}
+	luaL_setmetatable(luaState_, "UColumnViewMT");
+	lua_newtable(luaState_);
+	lua_pushvalue(luaState_, 1);
+	lua_rawseti(luaState_, -2, 0);
+	lua_setuservalue(luaState_, -2);
+	return 1;
+}
+
+int32 FLuaEnv::columnRowNum(FUColumnViewProxy* v)
+{
+	UObject* owner = v->owner->ptr;
+	if (!owner)
+		throwError("Columns of a destroyed object");
+	if (v->arrayProp)
+		return FScriptArrayHelper_InContainer(v->arrayProp, owner).Num();
+	return v->numRows;
+}
+
+uint8* FLuaEnv::columnRow(FUColumnViewProxy* v, int idx)
+{
+	lua_Integer i = luaL_checkinteger(luaState_, idx);
+	UObject* owner = v->owner->ptr;
+	if (!owner)
+		throwError("Columns of a destroyed object");
+	if (v->arrayProp)
+	{
+		FScriptArrayHelper_InContainer arr(v->arrayProp, owner);
+		return i >= 1 && i <= arr.Num() ? arr.GetRawPtr((int32)i - 1) : nullptr;
+	}
+	// Row pointers are not kept, rows are freed when the table changes.
+	UDataTable* dataTable = (UDataTable*)owner;
+	if (dataTable->RowStruct != v->type)
+		throwError("Columns of a data table whose row struct changed");
+	return i >= 1 && i <= v->numRows ? dataTable->RowMap.FindRef(v->rowNames[i - 1]) : nullptr;
+}
+
+static EColumnKind columnKind(UProperty* prop)
+{
+	if (prop->ArrayDim != 1)
+		return EColumnKind::Other;
+	if (prop->IsA<UInt8Property>())
+		return EColumnKind::Int8;
+	if (prop->IsA<UInt16Property>())
+		return EColumnKind::Int16;
+	if (prop->IsA<UIntProperty>())
+		return EColumnKind::Int32;
+	if (prop->IsA<UInt64Property>())
+		return EColumnKind::Int64;
+	if (prop->IsA<UByteProperty>())
+		return EColumnKind::UInt8;
+	if (prop->IsA<UUInt16Property>())
+		return EColumnKind::UInt16;
+	if (prop->IsA<UUInt32Property>())
+		return EColumnKind::UInt32;
+	if (prop->IsA<UUInt64Property>())
+		return EColumnKind::UInt64;
+	if (prop->IsA<UFloatProperty>())
+		return EColumnKind::Float;
+	if (prop->IsA<UDoubleProperty>())
+		return EColumnKind::Double;
+	return EColumnKind::Other;
+}
+
+int FLuaEnv::columnViewMTIndex()
+{
+	FUColumnViewProxy* v = (FUColumnViewProxy*)lua_touserdata(luaState_, 1);
+	if (lua_type(luaState_, 2) == LUA_TNUMBER)
+	{
+		// Copy of a row.
+		uint8* row = columnRow(v, 2);
+		if (!row)
+			return 0;
+		pushUStruct(row, v->type);
+		return 1;
+	}
+
+	// Find column in the user value first.
+	lua_getuservalue(luaState_, 1);
+	lua_pushvalue(luaState_, 2);
+	if (lua_rawget(luaState_, -2) != LUA_TNIL)
+		return 1;
+	lua_pop(luaState_, 1);
+	FName name = toFName(2, true);
+	UProperty* prop = FindField<UProperty>(v->type, name);
+	if (!prop)
+		throwError("Invalid field name %s", TCHAR_TO_UTF8(*name.ToString()));
+	FUColumnProxy* c = (FUColumnProxy*)lua_newuserdata(luaState_, sizeof(FUColumnProxy));
+	c->view = v;
+	c->field = prop;
+	c->offset = prop->GetOffset_ForInternal();
+	c->kind = columnKind(prop);
+	luaL_setmetatable(luaState_, "UColumnMT");
+	lua_pushvalue(luaState_, 1);
+	lua_setuservalue(luaState_, -2);
+	//=========================================
+	//=>columns
+	//=>FUColumnProxy
+	//=========================================
+	lua_pushvalue(luaState_, 2);
+	lua_pushvalue(luaState_, -2);
+	lua_rawset(luaState_, -4);
+	return 1;
+}
+
+int FLuaEnv::columnViewMTLen()
+{
+	lua_pushinteger(luaState_, columnRowNum((FUColumnViewProxy*)lua_touserdata(luaState_, 1)));
+	return 1;
+}
+
+int FLuaEnv::columnMTIndex()
+{
+	FUColumnProxy* c = (FUColumnProxy*)lua_touserdata(luaState_, 1);
+	uint8* row = columnRow(c->view, 2);
+	if (!row)
+		return 0;
+	uint8* data = row + c->offset;
+	switch (c->kind)
+	{
+	case EColumnKind::Int8:		lua_pushinteger(luaState_, *(int8*)data); break;
+	case EColumnKind::Int16:	lua_pushinteger(luaState_, *(int16*)data); break;
+	case EColumnKind::Int32:	lua_pushinteger(luaState_, *(int32*)data); break;
+	case EColumnKind::Int64:	lua_pushinteger(luaState_, *(int64*)data); break;
+	case EColumnKind::UInt8:	lua_pushinteger(luaState_, *(uint8*)data); break;
+	case EColumnKind::UInt16:	lua_pushinteger(luaState_, *(uint16*)data); break;
+	case EColumnKind::UInt32:	lua_pushinteger(luaState_, *(uint32*)data); break;
+	case EColumnKind::UInt64:	lua_pushinteger(luaState_, *(uint64*)data); break;
+	case EColumnKind::Float:	lua_pushnumber(luaState_, *(float*)data); break;
+	case EColumnKind::Double:	lua_pushnumber(luaState_, *(double*)data); break;
+	default:					pushPropertyValue(row, c->field); break;
+	}
+	return 1;
+}
+
+int FLuaEnv::columnMTNewIndex()
+{
+	FUColumnProxy* c = (FUColumnProxy*)lua_touserdata(luaState_, 1);
+	uint8* row = columnRow(c->view, 2);
+	if (!row)
+		throwError("Row index out of range");
+	toPropertyValue(row, false, c->field, 3, true);
+	return 0;
+}
+
+int FLuaEnv::columnMTLen()
+{
+	lua_pushinteger(luaState_, columnRowNum(((FUColumnProxy*)lua_touserdata(luaState_, 1))->view));
+	return 1;
+}
+
+int FLuaEnv::schedulerStart()
+{
+	luaL_checktype(luaState_, 1, LUA_TFUNCTION);
+	int n = lua_gettop(luaState_);
+	lua_State* co = lua_newthread(luaState_);
+	lua_insert(luaState_, 1);
+	//=========================================
+	//=>coroutine
+	//=>function
+	//=>args...
+	//=========================================
+	lua_pushvalue(luaState_, 2);
+	lua_xmove(luaState_, co, 1);
+	lua_remove(luaState_, 2);
+	lua_pushvalue(luaState_, 1);
+	int threadRef = luaL_ref(luaState_, LUA_REGISTRYINDEX);
+	resumeThread(threadRef, n - 1);
+	return 1;
+}
+
+int FLuaEnv::schedulerWait()
+{
+	lua_Number seconds = luaL_checknumber(luaState_, 1);
+	scheduler_->addTimer(refYieldingThread(), seconds);
+	lua_pushlightuserdata(luaState_, scheduler_);
+	return lua_yield(luaState_, 1);
+}
+
+int FLuaEnv::schedulerWaitFrame()
+{
+	scheduler_->addNextFrame(refYieldingThread());
+	lua_pushlightuserdata(luaState_, scheduler_);
+	return lua_yield(luaState_, 1);
+}
+
+int FLuaEnv::schedulerWaitDelegate()
+{
+	UObject* obj = toUObject(1, nullptr, true);
+	if (!obj)
+		throwError("Invalid UObject");
+	FName name = toFName(2, true);
+	UMulticastDelegateProperty* prop = FindField<UMulticastDelegateProperty>(obj->GetClass(), name);
+	if (!prop)
+		throwError("Invalid multicast delegate name \"%s\"", TCHAR_TO_UTF8(*name.ToString()));
+	bindDelegate(obj, prop, refYieldingThread());
+	lua_pushlightuserdata(luaState_, scheduler_);
+	return lua_yield(luaState_, 1);
+}
+
+ETickingGroup FLuaEnv::toTickGroup(int idx)
+{
+	lua_Integer group = luaL_optinteger(luaState_, idx, TG_PrePhysics);
+	if (!FLuaTickBatch::isValidGroup(group))
+		throwError("Invalid tick group %d", (int)group);
+	return (ETickingGroup)group;
+}
+
+int FLuaEnv::batchTickSetHandler()
+{
+	ETickingGroup group = toTickGroup(1);
+	if (!lua_isnil(luaState_, 2))
+		luaL_checktype(luaState_, 2, LUA_TFUNCTION);
+	tickBatch_->setHandler(luaState_, group, 2);
+	return 0;
+}
+
+int FLuaEnv::batchTickRegister()
+{
+	UObject* obj = toUObject(1, nullptr, true);
+	if (!obj)
+		throwError("Invalid UObject");
+	if (!tickBatch_->add(luaState_, toTickGroup(2), obj, 1))
+		throwError("UObject \"%s\" has no world to tick in", TCHAR_TO_UTF8(*obj->GetName()));
+	return 0;
+}
+
+int FLuaEnv::batchTickUnregister()
+{
+	luaL_checkudata(luaState_, 1, "UObjectMT");
+	lua_pushboolean(luaState_, tickBatch_->remove(luaState_, toTickGroup(2), 1));
+	return 1;
+}
+
+static int writeJobCode(lua_State* L, const void* p, size_t sz, void* ud)
+{
+	TArray<uint8>* code = (TArray<uint8>*)ud;
+	FMemory::Memcpy(code->GetData() + code->AddUninitialized((int32)sz), p, sz);
+	return 0;
+}
+
+FLuaJob* FLuaEnv::newJob(int idx, int nargs)
+{
+	idx = lua_absindex(luaState_, idx);
+	luaL_checktype(luaState_, idx, LUA_TFUNCTION);
+	if (lua_iscfunction(luaState_, idx))
+		throwError("Job function can not be a C function");
+	for (int i = 1; const char* name = lua_getupvalue(luaState_, idx, i); i++)
+	{
+		lua_pop(luaState_, 1);
+		if (FCStringAnsi::Strcmp(name, "_ENV") != 0)
+			throwError("Job function can not use upvalue \"%s\", pass it as argument", name);
+	}
+
+	FLuaJob* job = new FLuaJob();
+	job->ok = false;
+	job->callbackRef = LUA_NOREF;
+	FString error;
+	if (!FLuaSerializer::pack(luaState_, idx + 1, nargs, job->data, error))
+	{
+		delete job;
+		throwError("Invalid job argument, %s", TCHAR_TO_UTF8(*error));
+	}
+
+	// Functions are dumped once.
+	lua_rawgeti(luaState_, LUA_REGISTRYINDEX, jobCodeTable_);
+	lua_pushvalue(luaState_, idx);
+	if (lua_rawget(luaState_, -2) == LUA_TSTRING)
+	{
+		size_t len;
+		const char* code = lua_tolstring(luaState_, -1, &len);
+		job->code.Append((const uint8*)code, (int32)len);
+	}
+	else
+	{
+		// lua_dump dumps the function on top, in place of the nil.
+		lua_pop(luaState_, 1);
+		lua_pushvalue(luaState_, idx);
+		if (lua_dump(luaState_, writeJobCode, &job->code, 0) != 0 || job->code.Num() == 0)
+		{
+			lua_pop(luaState_, 2);
+			delete job;
+			throwError("Can not dump job function");
+		}
+		lua_pushvalue(luaState_, idx);
+		lua_pushlstring(luaState_, (const char*)job->code.GetData(), job->code.Num());
+		lua_rawset(luaState_, -4);
+	}
+	lua_pop(luaState_, 2);
+	return job;
+}
+
+void FLuaEnv::dispatchCompletedJobs()
+{
+	TArray<FLuaJob*> jobs;
+	jobPool_->collectCompleted(jobs);
+	for (FLuaJob* job : jobs)
+	{
+		lua_rawgeti(luaState_, LUA_REGISTRYINDEX, job->callbackRef);
+		bool isThread = lua_isthread(luaState_, -1);
+		if (isThread)
+			lua_pop(luaState_, 1);
+		lua_pushboolean(luaState_, job->ok);
+		FString error;
+		int n = FLuaSerializer::unpack(luaState_, job->data.GetData(), job->data.Num(), error);
+		if (n < 0)
+		{
+			lua_pop(luaState_, 1);
+			lua_pushboolean(luaState_, 0);
+			pushFString(error);
+			n = 1;
+		}
+		if (isThread)
+			resumeThread(job->callbackRef, n + 1);
+		else
+		{
+			luaL_unref(luaState_, LUA_REGISTRYINDEX, job->callbackRef);
+			pcall(n + 1, 0);
+		}
+		delete job;
+	}
+}
+
+int FLuaEnv::jobsRun()
+{
+	if (!lua_isyieldable(luaState_))
+		throwError("Can not wait outside of a coroutine.");
+	FLuaJob* job = newJob(1, lua_gettop(luaState_) - 1);
+	job->callbackRef = refYieldingThread();
+	if (!jobPool_)
+		jobPool_ = new FLuaJobPool();
+	jobPool_->submit(job);
+	lua_pushlightuserdata(luaState_, scheduler_);
+	return lua_yield(luaState_, 1);
+}
+
+int FLuaEnv::jobsSubmit()
+{
+	luaL_checktype(luaState_, 2, LUA_TFUNCTION);
+	// Move callback after the arguments.
+	lua_pushvalue(luaState_, 2);
+	lua_remove(luaState_, 2);
+	FLuaJob* job = newJob(1, lua_gettop(luaState_) - 2);
+	job->callbackRef = luaL_ref(luaState_, LUA_REGISTRYINDEX);
+	if (!jobPool_)
+		jobPool_ = new FLuaJobPool();
+	jobPool_->submit(job);
+	return 0;
+}
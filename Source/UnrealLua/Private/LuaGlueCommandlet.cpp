@@ -0,0 +1,112 @@
+#include "LuaGlueCommandlet.h"
+#include "LuaNativeCall.h"
+#include "UnrealType.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+int32 ULuaGlueCommandlet::Main(const FString& Params)
+{
+#if WITH_EDITOR
+	FString output;
+	if (!FParse::Value(*Params, TEXT("Output="), output))
+		output = FPaths::GameSourceDir() / TEXT("UnrealLua/Private/LuaGlue.gen.cpp");
+
+	FString includes;
+	FString code;
+	FString registrations;
+	int32 numFuncs = 0;
+	for (const FString& path : Classes)
+	{
+		UClass* cls = LoadObject<UClass>(nullptr, *path);
+		if (!cls || !cls->HasAnyClassFlags(CLASS_Native) || cls->HasAnyClassFlags(CLASS_Interface))
+		{
+			ULUA_LOG(Warning, TEXT("Skip %s, not a native class"), *path);
+			continue;
+		}
+		const FString& include = cls->GetMetaData(TEXT("IncludePath"));
+		if (include.IsEmpty())
+		{
+			ULUA_LOG(Warning, TEXT("Skip %s, no include path"), *path);
+			continue;
+		}
+		includes += FString::Printf(TEXT("#include \"%s\"\n"), *include);
+		for (TFieldIterator<UFunction> it(cls, EFieldIteratorFlags::ExcludeSuper); it; ++it)
+		{
+			if (writeFunction(cls, *it, code, registrations))
+				numFuncs++;
+		}
+	}
+
+	FString file = TEXT("// Generated by LuaGlueCommandlet, do not edit.\n\n#include \"LuaNativeCall.h\"\n");
+	file += includes;
+	file += code;
+	if (!registrations.IsEmpty())
+		file += TEXT("\nstatic FLuaGlueRegistration glueRegistrations[] =\n{\n") + registrations + TEXT("};\n");
+	if (!FFileHelper::SaveStringToFile(file, *output))
+	{
+		ULUA_LOG(Error, TEXT("Can not write %s"), *output);
+		return 1;
+	}
+	ULUA_LOG(Display, TEXT("Wrote glue of %d functions to %s"), numFuncs, *output);
+	return 0;
+#else
+	ULUA_LOG(Error, TEXT("LuaGlue needs the editor"));
+	return 1;
+#endif
+}
+
+#if WITH_EDITOR
+bool ULuaGlueCommandlet::writeFunction(UClass* cls, UFunction* func, FString& code, FString& registrations)
+{
+	if (!FLuaNativeCall::isDirect(func) || !func->HasAnyFunctionFlags(FUNC_Public))
+		return false;
+	// Custom thunks have no C++ function of the signature, editor only
+	// functions no body in game builds.
+	if (func->HasMetaData(TEXT("CustomThunk")) || func->HasAnyFunctionFlags(FUNC_EditorOnly))
+		return false;
+
+	FString name = FString::Printf(TEXT("%s_%s"), *cls->GetName(), *func->GetName());
+	FString parms;
+	FString args;
+	UProperty* retParm = nullptr;
+	for (TFieldIterator<UProperty> it(func); it && it->HasAnyPropertyFlags(CPF_Parm); ++it)
+	{
+		UProperty* parm = *it;
+		if (parm->IsA<UDelegateProperty>() || parm->IsA<UMulticastDelegateProperty>())
+			return false;
+		// Members are laid out as the parameter buffer, as UHT does for events.
+		FString extended;
+		FString type = parm->GetCPPType(&extended);
+		parms += FString::Printf(TEXT("\t%s%s %s;\n"), *type, *extended, *parm->GetName());
+		if (parm->HasAnyPropertyFlags(CPF_ReturnParm))
+		{
+			retParm = parm;
+			continue;
+		}
+		if (!args.IsEmpty())
+			args += TEXT(", ");
+		args += TEXT("p.") + parm->GetName();
+	}
+
+	FString classCPP = cls->GetPrefixCPP() + cls->GetName();
+	FString callee = func->HasAnyFunctionFlags(FUNC_Static)
+		? FString::Printf(TEXT("%s::%s"), *classCPP, *func->GetName())
+		: FString::Printf(TEXT("((%s*)obj)->%s"), *classCPP, *func->GetName());
+	FString call = FString::Printf(TEXT("%s(%s)"), *callee, *args);
+	if (retParm)
+		call = FString::Printf(TEXT("p.%s = %s"), *retParm->GetName(), *call);
+
+	if (parms.IsEmpty())
+	{
+		code += FString::Printf(TEXT("\nstatic void glue_%s(UObject* obj, void* parms)\n{\n\t%s;\n}\n"), *name, *call);
+	}
+	else
+	{
+		code += FString::Printf(TEXT("\nstruct FParms_%s\n{\n%s};\n"), *name, *parms);
+		code += FString::Printf(TEXT("static void glue_%s(UObject* obj, void* parms)\n{\n\tFParms_%s& p = *(FParms_%s*)parms;\n\t%s;\n}\n"),
+			*name, *name, *name, *call);
+	}
+	registrations += FString::Printf(TEXT("\t{ TEXT(\"%s\"), %uu, &glue_%s },\n"), *func->GetPathName(), FLuaNativeCall::signatureHash(func), *name);
+	return true;
+}
+#endif // WITH_EDITOR
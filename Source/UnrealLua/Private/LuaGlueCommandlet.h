@@ -0,0 +1,30 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "Commandlets/Commandlet.h"
+#include "LuaGlueCommandlet.generated.h"
+
+/**
+ * Generate C++ glue calling the native UFunctions of the Classes whitelist
+ * directly, registered to FLuaNativeCall:
+ *   UE4Editor-Cmd <project> -run=LuaGlue [-Output=<file>]
+ * The output defaults to Source/UnrealLua/Private/LuaGlue.gen.cpp. Functions
+ * ProcessEvent must run, non public, CustomThunk and editor only functions,
+ * and functions with delegate parameters are skipped. Glue is ignored once
+ * the parameters of its function change, see FLuaNativeCall::signatureHash.
+ */
+UCLASS(config = Game)
+class ULuaGlueCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+public:
+	/** Path names of the classes, as /Script/Engine.Actor. */
+	UPROPERTY(config)
+	TArray<FString> Classes;
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	/** Append glue of func to code and its registration to registrations, false if skipped. */
+	bool writeFunction(UClass* cls, UFunction* func, FString& code, FString& registrations);
+};
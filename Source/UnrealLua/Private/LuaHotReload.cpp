@@ -0,0 +1,424 @@
+#include "LuaHotReload.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+static bool isLuaFunction(lua_State* L, int idx)
+{
+	return lua_type(L, idx) == LUA_TFUNCTION && !lua_iscfunction(L, idx);
+}
+
+FLuaHotReload::FLuaHotReload(lua_State* L):
+	interval_(0.0f),
+	elapsed_(0.0f)
+{
+	int top = lua_gettop(L);
+
+	// Insert searcher after the preload one.
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchers");
+	for (int i = (int)lua_rawlen(L, -1); i >= 2; i--)
+	{
+		lua_rawgeti(L, -1, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushlightuserdata(L, this);
+	lua_pushcclosure(L, searcher, 1);
+	lua_rawseti(L, -2, 2);
+
+	lua_newtable(L);
+	lua_pushlightuserdata(L, this);
+	lua_pushcclosure(L, luaReload, 1);
+	lua_setfield(L, -2, "reload");
+	lua_pushlightuserdata(L, this);
+	lua_pushcclosure(L, luaWatch, 1);
+	lua_setfield(L, -2, "watch");
+	lua_setglobal(L, "hotReload");
+
+	lua_settop(L, top);
+}
+
+FString FLuaHotReload::bytecodeDir()
+{
+	return FPaths::ProjectContentDir() / TEXT("LuaBytecode");
+}
+
+bool FLuaHotReload::loadFile(lua_State* L, const FString& path)
+{
+	TArray<uint8> code;
+	if (!FFileHelper::LoadFileToArray(code, *path))
+	{
+		lua_pushfstring(L, "can not read %s", TCHAR_TO_UTF8(*path));
+		return false;
+	}
+	FString chunkName = TEXT("@") + path;
+	return luaL_loadbuffer(L, (const char*)code.GetData(), code.Num(), TCHAR_TO_UTF8(*chunkName)) == LUA_OK;
+}
+
+int FLuaHotReload::searcher(lua_State* L)
+{
+	FLuaHotReload* self = (FLuaHotReload*)lua_touserdata(L, lua_upvalueindex(1));
+	const char* name = luaL_checkstring(L, 1);
+#if !WITH_EDITOR
+	// Compiled module, sources being edited in the editor.
+	FString compiled = bytecodeDir() / FString(UTF8_TO_TCHAR(name)).Replace(TEXT("."), TEXT("/"));
+	for (const TCHAR* suffix : { TEXT(".luac"), TEXT("/init.luac") })
+	{
+		FString path = compiled + suffix;
+		if (IFileManager::Get().FileSize(*path) < 0)
+			continue;
+		if (!loadFile(L, path))
+			return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, TCHAR_TO_UTF8(*path), lua_tostring(L, -1));
+		lua_pushstring(L, TCHAR_TO_UTF8(*path));
+		self->modules_.Add(UTF8_TO_TCHAR(name), { path, IFileManager::Get().GetTimeStamp(*path) });
+		return 2;
+	}
+#endif
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchpath");
+	lua_pushstring(L, name);
+	lua_getfield(L, -3, "path");
+	lua_call(L, 2, 2);
+	//=========================================
+	//=>package
+	//=>path or nil
+	//=>nil or error
+	//=========================================
+	if (lua_isnil(L, -2))
+		return 1;
+	FString path = UTF8_TO_TCHAR(lua_tostring(L, -2));
+	if (!loadFile(L, path))
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, TCHAR_TO_UTF8(*path), lua_tostring(L, -1));
+	lua_pushstring(L, TCHAR_TO_UTF8(*path));
+	self->modules_.Add(UTF8_TO_TCHAR(name), { path, IFileManager::Get().GetTimeStamp(*path) });
+	return 2;
+}
+
+int FLuaHotReload::luaReload(lua_State* L)
+{
+	FLuaHotReload* self = (FLuaHotReload*)lua_touserdata(L, lua_upvalueindex(1));
+	if (lua_isnoneornil(L, 1))
+		lua_pushinteger(L, self->reloadChanged(L));
+	else
+		lua_pushinteger(L, self->reload(L, UTF8_TO_TCHAR(luaL_checkstring(L, 1))) ? 1 : 0);
+	return 1;
+}
+
+int FLuaHotReload::luaWatch(lua_State* L)
+{
+	FLuaHotReload* self = (FLuaHotReload*)lua_touserdata(L, lua_upvalueindex(1));
+	self->interval_ = (float)luaL_checknumber(L, 1);
+	self->elapsed_ = 0.0f;
+	return 0;
+}
+
+void FLuaHotReload::tick(lua_State* L, float deltaSeconds)
+{
+	if (interval_ <= 0.0f)
+		return;
+	elapsed_ += deltaSeconds;
+	if (elapsed_ < interval_)
+		return;
+	elapsed_ = 0.0f;
+	reloadChanged(L);
+}
+
+int32 FLuaHotReload::reloadChanged(lua_State* L)
+{
+	// Reloads may require new modules.
+	TArray<FString> changed;
+	for (auto& it : modules_)
+	{
+		if (IFileManager::Get().GetTimeStamp(*it.Value.path) != it.Value.timeStamp)
+			changed.Add(it.Key);
+	}
+	if (changed.Num() == 0)
+		return 0;
+
+	// Functions of all modules are replaced in a single walk.
+	double start = FPlatformTime::Seconds();
+	int32 n = 0;
+	lua_newtable(L);
+	int map = lua_gettop(L);
+	for (const FString& name : changed)
+	{
+		if (patchModule(L, name, map))
+			n++;
+	}
+	if (n > 0)
+		replaceFunctions(L, map);
+	lua_pop(L, 1);
+	ULUA_LOG(Log, TEXT("Reloaded %d of %d changed modules in %.1fms."), n, changed.Num(), (FPlatformTime::Seconds() - start) * 1000.0);
+	return n;
+}
+
+bool FLuaHotReload::reload(lua_State* L, const FString& name)
+{
+	lua_newtable(L);
+	int map = lua_gettop(L);
+	bool ok = patchModule(L, name, map);
+	if (ok)
+		replaceFunctions(L, map);
+	lua_pop(L, 1);
+	return ok;
+}
+
+bool FLuaHotReload::patchModule(lua_State* L, const FString& name, int map)
+{
+	FModule* m = modules_.Find(name);
+	if (!m)
+		return false;
+	// A broken file is not retried before its next change.
+	m->timeStamp = IFileManager::Get().GetTimeStamp(*m->path);
+	FString path = m->path;
+
+	int top = lua_gettop(L);
+	lua_checkstack(L, 16);
+	if (!loadFile(L, path))
+	{
+		ULUA_LOG(Error, TEXT("Can not reload %s: %s"), *name, UTF8_TO_TCHAR(lua_tostring(L, -1)));
+		lua_settop(L, top);
+		return false;
+	}
+	lua_pushstring(L, TCHAR_TO_UTF8(*name));
+	lua_pushstring(L, TCHAR_TO_UTF8(*path));
+	if (lua_pcall(L, 2, 1, 0) != LUA_OK)
+	{
+		ULUA_LOG(Error, TEXT("Can not reload %s: %s"), *name, UTF8_TO_TCHAR(lua_tostring(L, -1)));
+		lua_settop(L, top);
+		return false;
+	}
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_getfield(L, -1, TCHAR_TO_UTF8(*name));
+	lua_newtable(L);
+	//=========================================
+	//=>new module
+	//=>package
+	//=>loaded
+	//=>old module
+	//=>visited tables
+	//=========================================
+	int n = top + 1, o = top + 4, visited = top + 5;
+	if (lua_istable(L, o) && lua_istable(L, n))
+		patchTable(L, o, n, map, visited);
+	else if (isLuaFunction(L, o) && isLuaFunction(L, n))
+		patchFunction(L, o, n, map);
+	else if (!lua_isnil(L, n))
+	{
+		lua_pushvalue(L, n);
+		lua_setfield(L, top + 3, TCHAR_TO_UTF8(*name));
+	}
+	lua_settop(L, top);
+	return true;
+}
+
+void FLuaHotReload::patchFunction(lua_State* L, int o, int n, int map)
+{
+	if (lua_rawequal(L, o, n))
+		return;
+	lua_pushvalue(L, o);
+	if (lua_rawget(L, map) != LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, o);
+	lua_pushvalue(L, n);
+	lua_rawset(L, map);
+
+	lua_checkstack(L, 8);
+	for (int i = 1; const char* name = lua_getupvalue(L, n, i); i++)
+	{
+		int nv = lua_gettop(L);
+		const char* oldName;
+		int j = 1;
+		while ((oldName = lua_getupvalue(L, o, j)) != nullptr && FCStringAnsi::Strcmp(oldName, name) != 0)
+		{
+			lua_pop(L, 1);
+			j++;
+		}
+		if (oldName)
+		{
+			int ov = nv + 1;
+			if (lua_isfunction(L, nv) || lua_isfunction(L, ov))
+			{
+				// Local functions are the new ones.
+				if (isLuaFunction(L, nv) && isLuaFunction(L, ov))
+					patchFunction(L, ov, nv, map);
+			}
+			else
+			{
+				// Local data keeps its value, tables get the new fields.
+				if (lua_istable(L, nv) && lua_istable(L, ov))
+				{
+					lua_newtable(L);
+					patchTable(L, ov, nv, map, lua_gettop(L));
+				}
+				lua_upvaluejoin(L, n, i, o, j);
+			}
+		}
+		lua_settop(L, nv - 1);
+	}
+}
+
+void FLuaHotReload::patchTable(lua_State* L, int o, int n, int map, int visited)
+{
+	if (lua_rawequal(L, o, n))
+		return;
+	lua_pushvalue(L, n);
+	if (lua_rawget(L, visited) != LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, n);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, visited);
+
+	lua_checkstack(L, 8);
+	lua_pushnil(L);
+	while (lua_next(L, n) != 0)
+	{
+		int k = lua_gettop(L) - 1;
+		int nv = k + 1;
+		lua_pushvalue(L, k);
+		lua_rawget(L, o);
+		int ov = nv + 1;
+		if (isLuaFunction(L, nv) && isLuaFunction(L, ov))
+			patchFunction(L, ov, nv, map);
+		else if (lua_istable(L, nv) && lua_istable(L, ov))
+			patchTable(L, ov, nv, map, visited);
+		else if (lua_isnil(L, ov))
+		{
+			lua_pushvalue(L, k);
+			lua_pushvalue(L, nv);
+			lua_rawset(L, o);
+		}
+		lua_settop(L, k);
+	}
+}
+
+void FLuaHotReload::replaceFunctions(lua_State* L, int map)
+{
+	lua_checkstack(L, 8);
+	lua_newtable(L);
+	int visited = lua_gettop(L);
+	lua_newtable(L);
+	int pending = lua_gettop(L);
+	int numPending = 0;
+	lua_newtable(L);
+	int keys = lua_gettop(L);
+	auto add = [&](int idx)
+	{
+		int type = lua_type(L, idx);
+		if (type != LUA_TTABLE && type != LUA_TFUNCTION && type != LUA_TUSERDATA)
+			return;
+		lua_pushvalue(L, idx);
+		if (lua_rawget(L, visited) == LUA_TNIL)
+		{
+			lua_pushvalue(L, idx);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, visited);
+			lua_pushvalue(L, idx);
+			lua_rawseti(L, pending, ++numPending);
+		}
+		lua_pop(L, 1);
+	};
+	// Push the new function of the function at idx, or nothing.
+	auto findNew = [&](int idx) -> bool
+	{
+		if (lua_type(L, idx) != LUA_TFUNCTION)
+			return false;
+		lua_pushvalue(L, idx);
+		if (lua_rawget(L, map) != LUA_TNIL)
+			return true;
+		lua_pop(L, 1);
+		return false;
+	};
+
+	lua_pushvalue(L, LUA_REGISTRYINDEX);
+	add(lua_gettop(L));
+	lua_pop(L, 1);
+	while (numPending > 0)
+	{
+		lua_rawgeti(L, pending, numPending);
+		lua_pushnil(L);
+		lua_rawseti(L, pending, numPending--);
+		int x = lua_gettop(L);
+		switch (lua_type(L, x))
+		{
+		case LUA_TTABLE:
+		{
+			// Assigning existing fields during traversal is allowed, adding
+			// keys is not: old function keys are collected and re-keyed after.
+			int numKeys = 0;
+			lua_pushnil(L);
+			while (lua_next(L, x) != 0)
+			{
+				if (findNew(x + 2))
+				{
+					lua_pushvalue(L, x + 1);
+					lua_insert(L, -2);
+					lua_rawset(L, x);
+				}
+				if (findNew(x + 1))
+				{
+					lua_pop(L, 1);
+					lua_pushvalue(L, x + 1);
+					lua_rawseti(L, keys, ++numKeys);
+				}
+				add(x + 1);
+				add(x + 2);
+				lua_pop(L, 1);
+			}
+			for (int i = 1; i <= numKeys; i++)
+			{
+				lua_rawgeti(L, keys, i);
+				findNew(x + 1);
+				lua_pushvalue(L, x + 2);
+				bool exists = lua_rawget(L, x) != LUA_TNIL;
+				lua_pop(L, 1);
+				if (!exists)
+				{
+					lua_pushvalue(L, x + 1);
+					lua_rawget(L, x);
+					lua_rawset(L, x);
+				}
+				else
+					lua_pop(L, 1);
+				lua_pushnil(L);
+				lua_rawset(L, x);
+				lua_pushnil(L);
+				lua_rawseti(L, keys, i);
+			}
+			break;
+		}
+		case LUA_TFUNCTION:
+			for (int i = 1; lua_getupvalue(L, x, i) != nullptr; i++)
+			{
+				if (findNew(x + 1))
+				{
+					lua_setupvalue(L, x, i);
+				}
+				add(x + 1);
+				lua_pop(L, 1);
+			}
+			break;
+		case LUA_TUSERDATA:
+			lua_getuservalue(L, x);
+			add(x + 1);
+			lua_pop(L, 1);
+			break;
+		}
+		if (lua_getmetatable(L, x))
+		{
+			add(x + 1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 3);
+}
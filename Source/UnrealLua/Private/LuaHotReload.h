@@ -0,0 +1,73 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "lua.hpp"
+
+/**
+ * Reload of changed lua modules in place, keeping the state of the env.
+ * Modules are loaded by a searcher placed before the file searcher of
+ * package.searchers, which records their file and its time stamp. Out of
+ * the editor, it loads compiled modules first.
+ * Reloading runs the module chunk again, then patches the loaded module:
+ *  - functions of the old module get the upvalues of the new ones, joined to
+ *    the old upvalues of the same name that are not functions, so module
+ *    locals keep their values;
+ *  - tables are patched field by field, new fields are added, data fields
+ *    keep their values;
+ *  - then every reference to an old function reachable from the registry, as
+ *    table key or value and upvalue, is replaced by the new function. An
+ *    entry keyed by an old function is dropped if the new one is already a
+ *    key of the table.
+ * package.loaded keeps the old module table. Top level side effects of the
+ * chunk run again, and functions on the stack of coroutines are not patched.
+ */
+class FLuaHotReload
+{
+public:
+	/**
+	 * Install the searcher and open the "hotReload" lua table in L.
+	 * hotReload.reload([name])	reload module name, or all changed modules,
+	 *							returning how many were reloaded.
+	 * hotReload.watch(seconds)	look for changed modules every seconds, 0 stops.
+	 */
+	FLuaHotReload(lua_State* L);
+
+	/**
+	 * Directory of modules compiled by ULuaCompileCommandlet, searched before
+	 * package.path out of the editor.
+	 */
+	static FString bytecodeDir();
+
+	/** Reload changed modules when watching. */
+	void tick(lua_State* L, float deltaSeconds);
+
+	/** Reload modules whose file changed, return how many were reloaded. */
+	int32 reloadChanged(lua_State* L);
+	bool reload(lua_State* L, const FString& name);
+
+private:
+	struct FModule
+	{
+		FString path;
+		FDateTime timeStamp;
+	};
+
+	/** Run module name again and patch the loaded one, adding replaced functions to map. */
+	bool patchModule(lua_State* L, const FString& name, int map);
+	/** Push the chunk of file path, or an error message. */
+	static bool loadFile(lua_State* L, const FString& path);
+
+	/** Map function o to n, n taking the upvalues of o. */
+	static void patchFunction(lua_State* L, int o, int n, int map);
+	static void patchTable(lua_State* L, int o, int n, int map, int visited);
+	/** Replace functions of map by their value everywhere reachable from the registry. */
+	static void replaceFunctions(lua_State* L, int map);
+
+	static int searcher(lua_State* L);
+	static int luaReload(lua_State* L);
+	static int luaWatch(lua_State* L);
+
+	TMap<FString, FModule> modules_;
+	float interval_;
+	float elapsed_;
+};
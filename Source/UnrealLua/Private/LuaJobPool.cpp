@@ -0,0 +1,190 @@
+#include "LuaJobPool.h"
+#include "LuaSerializer.h"
+#include "LuaChannel.h"
+#include "LuaSharedTable.h"
+#include "LuaLogSink.h"
+#include "Misc/ScopeLock.h"
+
+/** Registry key of the weak valued table caching loaded job functions by bytecode. */
+static char functionCacheKey;
+/** Registry key of the metatable of job globals, reading the state globals. */
+static char envMetatableKey;
+
+static void* workerAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	if (nsize == 0)
+	{
+		FMemory::Free(ptr);
+		return nullptr;
+	}
+	return FMemory::Realloc(ptr, nsize);
+}
+
+static int workerMsgHandler(lua_State* L)
+{
+	const char* msg = lua_tostring(L, 1);
+	luaL_traceback(L, L, msg ? msg : "(error object is not a string)", 1);
+	return 1;
+}
+
+FLuaJobPool::FLuaJobPool()
+{
+}
+
+FLuaJobPool::~FLuaJobPool()
+{
+	FTaskGraphInterface::Get().WaitUntilTasksComplete(tasks_);
+	TArray<FLuaJob*> jobs;
+	collectCompleted(jobs);
+	for (FLuaJob* job : jobs)
+		delete job;
+	for (lua_State* L : freeStates_)
+		lua_close(L);
+}
+
+void FLuaJobPool::submit(FLuaJob* job)
+{
+	running_.Increment();
+	tasks_.Add(FFunctionGraphTask::CreateAndDispatchWhenReady([this, job]()
+	{
+		run(job);
+	}, TStatId(), nullptr, ENamedThreads::AnyThread));
+}
+
+void FLuaJobPool::collectCompleted(TArray<FLuaJob*>& outJobs)
+{
+	tasks_.RemoveAllSwap([](const FGraphEventRef& task) { return task->IsComplete(); });
+	FLuaJob* job;
+	while (completed_.Dequeue(job))
+		outJobs.Add(job);
+}
+
+void FLuaJobPool::run(FLuaJob* job)
+{
+	lua_State* L = acquireState();
+	FString error;
+	int top = lua_gettop(L);
+	job->ok = call(L, job, error);
+	if (!job->ok)
+	{
+		// The error message is sent as a serialized string.
+		lua_settop(L, top);
+		lua_pushstring(L, TCHAR_TO_UTF8(*error));
+		job->data.Reset();
+		FLuaSerializer::pack(L, -1, 1, job->data, error);
+	}
+	lua_settop(L, top);
+	releaseState(L);
+	completed_.Enqueue(job);
+	running_.Decrement();
+}
+
+bool FLuaJobPool::call(lua_State* L, FLuaJob* job, FString& error)
+{
+	lua_pushcfunction(L, workerMsgHandler);
+	int msgh = lua_gettop(L);
+
+	// Get the function loaded from code.
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &functionCacheKey);
+	lua_pushlstring(L, (const char*)job->code.GetData(), job->code.Num());
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, -3) != LUA_TFUNCTION)
+	{
+		lua_pop(L, 1);
+		if (luaL_loadbufferx(L, (const char*)job->code.GetData(), job->code.Num(), "=job", "b") != LUA_OK)
+		{
+			error = UTF8_TO_TCHAR(lua_tostring(L, -1));
+			return false;
+		}
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -5);
+	}
+	//=========================================
+	//=>msgh
+	//=>cache
+	//=>code
+	//=>function
+	//=========================================
+	lua_replace(L, msgh + 1);
+	lua_pop(L, 1);
+
+	// Fresh globals as _ENV, the only upvalue a job function may have.
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "_G");
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &envMetatableKey);
+	lua_setmetatable(L, -2);
+	if (!lua_setupvalue(L, msgh + 1, 1))
+		lua_pop(L, 1);
+
+	int nargs = FLuaSerializer::unpack(L, job->data.GetData(), job->data.Num(), error);
+	if (nargs < 0)
+		return false;
+	if (lua_pcall(L, nargs, LUA_MULTRET, msgh) != LUA_OK)
+	{
+		error = UTF8_TO_TCHAR(lua_tostring(L, -1));
+		return false;
+	}
+	job->data.Reset();
+	return FLuaSerializer::pack(L, msgh + 1, lua_gettop(L) - msgh, job->data, error);
+}
+
+lua_State* FLuaJobPool::acquireState()
+{
+	{
+		FScopeLock lock(&statesLock_);
+		if (freeStates_.Num() > 0)
+			return freeStates_.Pop(false);
+	}
+	return newWorkerState();
+}
+
+void FLuaJobPool::releaseState(lua_State* L)
+{
+	FScopeLock lock(&statesLock_);
+	freeStates_.Add(L);
+}
+
+lua_State* FLuaJobPool::newWorkerState()
+{
+	static const luaL_Reg libs[] =
+	{
+		{ "_G", luaopen_base },
+		{ LUA_COLIBNAME, luaopen_coroutine },
+		{ LUA_TABLIBNAME, luaopen_table },
+		{ LUA_STRLIBNAME, luaopen_string },
+		{ LUA_MATHLIBNAME, luaopen_math },
+		{ LUA_UTF8LIBNAME, luaopen_utf8 },
+		{ LUA_STRBUFLIBNAME, luaopen_strbuf },
+	};
+	lua_State* L = lua_newstate(workerAlloc, nullptr);
+	check(L);
+	for (const luaL_Reg& lib : libs)
+	{
+		luaL_requiref(L, lib.name, lib.func, 1);
+		lua_pop(L, 1);
+	}
+	// No file access.
+	lua_pushnil(L);
+	lua_setglobal(L, "dofile");
+	lua_pushnil(L);
+	lua_setglobal(L, "loadfile");
+	FLuaLogSink::openLibrary(L, "print(job):");
+	FLuaChannel::openLibrary(L);
+	FLuaSerializer::openLibrary(L);
+	FLuaSharedTable::openLibrary(L);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &functionCacheKey);
+
+	lua_newtable(L);
+	lua_pushglobaltable(L);
+	lua_setfield(L, -2, "__index");
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &envMetatableKey);
+	return L;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "Containers/Queue.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "lua.hpp"
+
+/** A lua function call run by a worker. */
+struct FLuaJob
+{
+	/** Bytecode of the function. */
+	TArray<uint8> code;
+	/** Serialized arguments, replaced by serialized results or error message. */
+	TArray<uint8> data;
+	bool ok;
+	/** Thread or function to call with the results, in the owning env registry. */
+	int callbackRef;
+};
+
+/**
+ * Lua states running jobs on the task graph workers.
+ * Worker states only have the pure lua libraries, channels, msgpack and
+ * shared tables, and values are passed in and out serialized, so jobs can
+ * not reach UObjects or the owning env.
+ * A state is created for each job running concurrently, hence at most one
+ * per worker thread, and reused by later jobs. Each job runs with its own
+ * globals table, reading missing names from the globals of the state: the
+ * globals it sets are dropped after it, while library tables are shared.
+ * Functions loaded by a state are cached by bytecode until collected.
+ */
+class FLuaJobPool
+{
+public:
+	FLuaJobPool();
+	/** Wait for running jobs. */
+	~FLuaJobPool();
+
+	/** Run job on a worker, the pool owns it until it is collected. */
+	void submit(FLuaJob* job);
+	/** Take jobs completed since the last call, the caller owns them. */
+	void collectCompleted(TArray<FLuaJob*>& outJobs);
+
+	int32 numRunning() const { return running_.GetValue(); }
+
+private:
+	void run(FLuaJob* job);
+	bool call(lua_State* L, FLuaJob* job, FString& error);
+
+	lua_State* acquireState();
+	void releaseState(lua_State* L);
+	static lua_State* newWorkerState();
+
+	FCriticalSection statesLock_;
+	TArray<lua_State*> freeStates_;
+
+	TQueue<FLuaJob*, EQueueMode::Mpsc> completed_;
+	FGraphEventArray tasks_;
+	FThreadSafeCounter running_;
+};
@@ -0,0 +1,442 @@
+#include "LuaLogSink.h"
+#include "LuaChannel.h"
+#include "Async/Async.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/ScopeLock.h"
+
+FCriticalSection FLuaLogSink::lock_;
+FLuaLogSink* FLuaLogSink::instance_ = nullptr;
+
+/** Slot layout: header, then the line in UTF-8 and a zero byte. */
+struct FLuaLogHeader
+{
+	FName category;
+	ELogVerbosity::Type verbosity;
+};
+
+bool FLuaLogSink::FCategory::allow()
+{
+	int32 limit = rateLimit.GetValue();
+	if (limit <= 0)
+		return true;
+	int64 second = (int64)FPlatformTime::Seconds();
+	if (window.GetValue() != second)
+	{
+		// Threads racing here may both reset, letting a few more lines through.
+		window.Set(second);
+		count.Reset();
+	}
+	if (count.Increment() <= limit)
+		return true;
+	dropped.Increment();
+	return false;
+}
+
+bool FLuaLogSink::FCategory::isSuppressed(ELogVerbosity::Type verbosity) const
+{
+	FLogCategoryBase* made = category;
+	return made ? made->IsSuppressed(verbosity) : verbosity > ELogVerbosity::Log;
+}
+
+FLuaLogSink::FLuaLogSink():
+	thread_(nullptr),
+	reportedFull_(0),
+	default_(nullptr),
+	refs_(0)
+{
+	ring_ = new FLuaChannel(TEXT("LuaLogSink"), Capacity, FLuaChannel::EMode::MPSC, SlotBytes);
+	wake_ = FPlatformProcess::GetSynchEventFromPool(false);
+	waiting_ = false;
+	default_ = new FCategory();
+	default_->name = UnrealLua.GetCategoryName();
+	default_->category = &UnrealLua;
+	default_->owned = false;
+	default_->reported = 0;
+	categories_.Add(default_->name, default_);
+	stopping_ = false;
+	thread_ = FRunnableThread::Create(this, TEXT("LuaLogSink"), 0, TPri_BelowNormal);
+}
+
+FLuaLogSink::~FLuaLogSink()
+{
+	// The thread writes the remaining lines before exiting.
+	thread_->Kill(true);
+	delete thread_;
+	FPlatformProcess::ReturnSynchEventToPool(wake_);
+	delete ring_;
+	TArray<FLogCategoryBase*> owned;
+	for (auto& it : categories_)
+	{
+		FLogCategoryBase* category = it.Value->category;
+		if (it.Value->owned && category)
+			owned.Add(category);
+		delete it.Value;
+	}
+	// Unregistered from log suppression on the game thread too.
+	if (IsInGameThread())
+	{
+		for (FLogCategoryBase* category : owned)
+			delete category;
+	}
+	else if (owned.Num() > 0)
+	{
+		AsyncTask(ENamedThreads::GameThread, [owned]()
+		{
+			for (FLogCategoryBase* category : owned)
+				delete category;
+		});
+	}
+}
+
+void FLuaLogSink::Stop()
+{
+	stopping_ = true;
+	wake_->Trigger();
+}
+
+FLuaLogSink* FLuaLogSink::acquire()
+{
+	FScopeLock lock(&lock_);
+	if (!instance_)
+		instance_ = new FLuaLogSink();
+	instance_->refs_++;
+	return instance_;
+}
+
+void FLuaLogSink::release()
+{
+	{
+		FScopeLock lock(&lock_);
+		if (--refs_ > 0)
+			return;
+		instance_ = nullptr;
+	}
+	// Outside of the lock, the thread takes it until it exits.
+	delete this;
+}
+
+FLuaLogSink::FCategory* FLuaLogSink::findCategory(const FString& name)
+{
+	FScopeLock lock(&lock_);
+	FCategory*& c = categories_.FindOrAdd(*name);
+	if (!c)
+	{
+		c = new FCategory();
+		c->name = *name;
+		c->category = nullptr;
+		c->owned = true;
+		c->reported = 0;
+		if (IsInGameThread())
+			c->category = new FLogCategoryBase(*name, ELogVerbosity::Log, ELogVerbosity::All);
+		else
+			AsyncTask(ENamedThreads::GameThread, [category = c->name]() { makeCategory(category); });
+	}
+	return c;
+}
+
+void FLuaLogSink::makeCategory(FName name)
+{
+	// The sink may be gone, or made again, since the task was queued.
+	FScopeLock lock(&lock_);
+	FCategory** c = instance_ ? instance_->categories_.Find(name) : nullptr;
+	if (c && !(*c)->category)
+	{
+		FLogCategoryBase* category = new FLogCategoryBase(*name.ToString(), ELogVerbosity::Log, ELogVerbosity::All);
+		FPlatformMisc::MemoryBarrier();
+		(*c)->category = category;
+	}
+}
+
+void FLuaLogSink::send(FCategory* c, ELogVerbosity::Type verbosity, const char* prefix, size_t prefixLen, lua_State* L, int first, int last)
+{
+	// Convert everything before claiming a slot, __tostring may raise errors.
+	luaL_checkstack(L, last - first + 1, "too many values to log");
+	int top = lua_gettop(L);
+	size_t size = sizeof(FLuaLogHeader) + prefixLen + 1;
+	for (int i = first; i <= last; i++)
+	{
+		size_t len;
+		luaL_tolstring(L, i, &len);
+		size += len + 1;
+	}
+
+	FLuaChannel::FSlot* slot = ring_->beginSend();
+	if (!slot)
+	{
+		droppedFull_.Increment();
+		lua_settop(L, top);
+		return;
+	}
+	FLuaLogHeader header = { c->name, verbosity };
+	slot->data.Reset((int32)size);
+	slot->data.Append((const uint8*)&header, sizeof(header));
+	slot->data.Append((const uint8*)prefix, (int32)prefixLen);
+	for (int i = top + 1; i <= lua_gettop(L); i++)
+	{
+		size_t len;
+		const char* s = lua_tolstring(L, i, &len);
+		if (i > top + 1)
+			slot->data.Add('\t');
+		slot->data.Append((const uint8*)s, (int32)len);
+	}
+	slot->data.Add(0);
+	ring_->endSend(slot, true);
+	FPlatformMisc::MemoryBarrier();
+	if (waiting_)
+		wake_->Trigger();
+	lua_settop(L, top);
+}
+
+bool FLuaLogSink::drain()
+{
+	bool any = false;
+	while (FLuaChannel::FSlot* slot = ring_->beginReceive())
+	{
+		if (slot->valid)
+		{
+			FLuaLogHeader header;
+			FMemory::Memcpy(&header, slot->data.GetData(), sizeof(header));
+			const ANSICHAR* line = (const ANSICHAR*)slot->data.GetData() + sizeof(header);
+			GLog->Serialize(UTF8_TO_TCHAR(line), header.verbosity, header.category);
+			written_.Increment();
+		}
+		ring_->endReceive(slot);
+		any = true;
+	}
+	return any;
+}
+
+void FLuaLogSink::reportDrops()
+{
+	TArray<FString> reports;
+	int64 full = droppedFull_.GetValue();
+	if (full != reportedFull_)
+	{
+		reports.Add(FString::Printf(TEXT("Lua log buffer full, %lld lines dropped."), full - reportedFull_));
+		reportedFull_ = full;
+	}
+	{
+		FScopeLock lock(&lock_);
+		for (auto& it : categories_)
+		{
+			int64 dropped = it.Value->dropped.GetValue();
+			if (dropped != it.Value->reported)
+			{
+				reports.Add(FString::Printf(TEXT("Lua log rate limit of %s, %lld lines dropped."), *it.Key.ToString(), dropped - it.Value->reported));
+				it.Value->reported = dropped;
+			}
+		}
+	}
+	for (const FString& report : reports)
+		GLog->Serialize(*report, ELogVerbosity::Warning, UnrealLua.GetCategoryName());
+}
+
+uint32 FLuaLogSink::Run()
+{
+	double lastReport = FPlatformTime::Seconds();
+	while (!stopping_)
+	{
+		if (!drain())
+		{
+			// Senders trigger wake_ once they see waiting_, lines sent before
+			// are found by the check below.
+			waiting_ = true;
+			FPlatformMisc::MemoryBarrier();
+			if (!drain())
+				wake_->Wait(1000);
+			waiting_ = false;
+		}
+		double now = FPlatformTime::Seconds();
+		if (now - lastReport >= 1.0)
+		{
+			reportDrops();
+			lastReport = now;
+		}
+	}
+	drain();
+	reportDrops();
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/************************************************************************/
+/* Lua library.                                                         */
+/************************************************************************/
+
+/** Registry key of the table of category tables by name. */
+static char categoriesKey;
+
+int FLuaLogSink::luaPrint(lua_State* L)
+{
+	//=========================================
+	//=>upvalue 1: sink
+	//=>upvalue 2: prefix
+	//=========================================
+	FLuaLogSink* sink = (FLuaLogSink*)lua_touserdata(L, lua_upvalueindex(1));
+	if (sink->default_->isSuppressed(ELogVerbosity::Log) || !sink->default_->allow())
+		return 0;
+	// Values go through the global tostring, as for the print of lua.
+	int n = lua_gettop(L);
+	lua_getglobal(L, "tostring");
+	for (int i = 1; i <= n; i++)
+	{
+		lua_pushvalue(L, -1);
+		lua_pushvalue(L, i);
+		lua_call(L, 1, 1);
+		if (!lua_isstring(L, -1))
+			return luaL_error(L, "'tostring' must return a string to 'print'");
+		lua_replace(L, i);
+	}
+	lua_pop(L, 1);
+	size_t prefixLen;
+	const char* prefix = lua_tolstring(L, lua_upvalueindex(2), &prefixLen);
+	sink->send(sink->default_, ELogVerbosity::Log, prefix, prefixLen, L, 1, n);
+	return 0;
+}
+
+int FLuaLogSink::luaLog(lua_State* L)
+{
+	//=========================================
+	//=>upvalue 1: sink
+	//=>upvalue 2: category
+	//=>upvalue 3: verbosity
+	//=>upvalue 4: string.format or nil
+	//=========================================
+	FLuaLogSink* sink = (FLuaLogSink*)lua_touserdata(L, lua_upvalueindex(1));
+	FCategory* c = (FCategory*)lua_touserdata(L, lua_upvalueindex(2));
+	ELogVerbosity::Type verbosity = (ELogVerbosity::Type)lua_tointeger(L, lua_upvalueindex(3));
+	if (c->isSuppressed(verbosity) || !c->allow())
+		return 0;
+	int n = lua_gettop(L);
+	if (n > 1 && lua_isfunction(L, lua_upvalueindex(4)))
+	{
+		lua_pushvalue(L, lua_upvalueindex(4));
+		lua_insert(L, 1);
+		lua_call(L, n, 1);
+		n = 1;
+	}
+	sink->send(c, verbosity, "", 0, L, 1, n);
+	return 0;
+}
+
+void FLuaLogSink::pushCategory(lua_State* L, FLuaLogSink* sink, FCategory* c)
+{
+	static const struct { const char* name; ELogVerbosity::Type verbosity; } functions[] =
+	{
+		{ "error", ELogVerbosity::Error },
+		{ "warning", ELogVerbosity::Warning },
+		{ "display", ELogVerbosity::Display },
+		{ "info", ELogVerbosity::Log },
+		{ "verbose", ELogVerbosity::Verbose },
+		{ "veryVerbose", ELogVerbosity::VeryVerbose },
+	};
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &categoriesKey);
+	FString name = c->name.ToString();
+	if (lua_getfield(L, -1, TCHAR_TO_UTF8(*name)) == LUA_TTABLE)
+	{
+		lua_remove(L, -2);
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_getglobal(L, "string");
+	int format = lua_gettop(L) + 1;
+	if (lua_istable(L, -1))
+		lua_getfield(L, -1, "format");
+	else
+		lua_pushnil(L);
+	lua_newtable(L);
+	for (auto& it : functions)
+	{
+		lua_pushlightuserdata(L, sink);
+		lua_pushlightuserdata(L, c);
+		lua_pushinteger(L, it.verbosity);
+		lua_pushvalue(L, format);
+		lua_pushcclosure(L, luaLog, 4);
+		lua_setfield(L, -2, it.name);
+	}
+	lua_pushlightuserdata(L, c);
+	lua_pushcclosure(L, luaSetRateLimit, 1);
+	lua_setfield(L, -2, "setRateLimit");
+	lua_pushlightuserdata(L, sink);
+	lua_pushcclosure(L, luaCategory, 1);
+	lua_setfield(L, -2, "category");
+	lua_pushlightuserdata(L, sink);
+	lua_pushcclosure(L, luaStats, 1);
+	lua_setfield(L, -2, "stats");
+	//=========================================
+	//=>categories
+	//=>string
+	//=>string.format or nil
+	//=>category table
+	//=========================================
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -5, TCHAR_TO_UTF8(*name));
+	lua_replace(L, -4);
+	lua_pop(L, 2);
+}
+
+int FLuaLogSink::luaCategory(lua_State* L)
+{
+	FLuaLogSink* sink = (FLuaLogSink*)lua_touserdata(L, lua_upvalueindex(1));
+	pushCategory(L, sink, sink->findCategory(UTF8_TO_TCHAR(luaL_checkstring(L, 1))));
+	return 1;
+}
+
+int FLuaLogSink::luaSetRateLimit(lua_State* L)
+{
+	FCategory* c = (FCategory*)lua_touserdata(L, lua_upvalueindex(1));
+	c->rateLimit.Set((int32)FMath::Max<lua_Integer>(luaL_checkinteger(L, 1), 0));
+	return 0;
+}
+
+int FLuaLogSink::luaStats(lua_State* L)
+{
+	FLuaLogSink* sink = (FLuaLogSink*)lua_touserdata(L, lua_upvalueindex(1));
+	int64 droppedRate = 0;
+	{
+		FScopeLock lock(&lock_);
+		for (auto& it : sink->categories_)
+			droppedRate += it.Value->dropped.GetValue();
+	}
+	lua_pushinteger(L, sink->written_.GetValue());
+	lua_pushinteger(L, sink->droppedFull_.GetValue());
+	lua_pushinteger(L, droppedRate);
+	return 3;
+}
+
+int FLuaLogSink::luaRelease(lua_State* L)
+{
+	FLuaLogSink** sink = (FLuaLogSink**)lua_touserdata(L, 1);
+	if (*sink)
+	{
+		(*sink)->release();
+		*sink = nullptr;
+	}
+	return 0;
+}
+
+void FLuaLogSink::openLibrary(lua_State* L, const char* printPrefix)
+{
+	FLuaLogSink* sink = acquire();
+
+	// Released when L is closed.
+	FLuaLogSink** ref = (FLuaLogSink**)lua_newuserdata(L, sizeof(FLuaLogSink*));
+	*ref = sink;
+	lua_newtable(L);
+	lua_pushcfunction(L, luaRelease);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, sink);
+
+	lua_pushlightuserdata(L, sink);
+	lua_pushstring(L, printPrefix);
+	lua_pushcclosure(L, luaPrint, 2);
+	lua_setglobal(L, "print");
+
+	lua_newtable(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &categoriesKey);
+	pushCategory(L, sink, sink->default_);
+	lua_setglobal(L, "log");
+}
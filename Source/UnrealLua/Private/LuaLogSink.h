@@ -0,0 +1,117 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "HAL/Event.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "lua.hpp"
+
+class FLuaChannel;
+
+/**
+ * Log output of lua states, shared by all of them.
+ * print and the "log" table format lines straight into the slots of a
+ * multi producer FLuaChannel, without locks, and wake a background thread
+ * that passes them to GLog, so scripts never take the lock of GLog. GLog
+ * buffers lines of other threads, the game thread still writes them to the
+ * log devices when it flushes them, after the native logs of the frame.
+ * The verbosity of the category and its rate limit are checked before
+ * anything is converted. Lines over the rate limit, or sent while the buffer
+ * is full, are dropped and counted; the thread reports drops once a second.
+ * Log categories register with log suppression, so they are only made on
+ * the game thread: a category first asked for by a job worker logs with
+ * the default verbosity until the game thread made it.
+ */
+class FLuaLogSink : public FRunnable
+{
+public:
+	/**
+	 * Set print and open the "log" lua table in L, the sink lives as long as
+	 * a state using it.
+	 * print(...)						info line of category UnrealLua, values separated by tabs.
+	 * log.error(fmt, ...)				error line, formatted by string.format with more
+	 *									than one argument. Same for warning, display,
+	 *									info, verbose and veryVerbose.
+	 * log.category(name)				table of these functions for log category name,
+	 *									whose verbosity is set by [Core.Log] or the Log
+	 *									console command.
+	 * log.setRateLimit(linesPerSecond)	of the category of the table, 0 for no limit.
+	 * log.stats()						lines written, dropped with the buffer full, and
+	 *									dropped by rate limits.
+	 * @param printPrefix written before the values of print.
+	 */
+	static void openLibrary(lua_State* L, const char* printPrefix);
+
+	/** Slots of the buffer, and bytes reserved per slot. */
+	enum { Capacity = 4096, SlotBytes = 256 };
+
+	/** FRunnable Interface */
+	virtual uint32 Run() override;
+	virtual void Stop() override;
+
+private:
+	struct FCategory
+	{
+		FName name;
+		/** nullptr until made on the game thread. */
+		FLogCategoryBase* volatile category;
+		/** Created for lua, deleted with the sink. */
+		bool owned;
+		FThreadSafeCounter rateLimit;
+		/** Second of the lines counted. */
+		FThreadSafeCounter64 window;
+		FThreadSafeCounter count;
+		FThreadSafeCounter64 dropped;
+		int64 reported;
+
+		/** Count a line, false if over the rate limit. */
+		bool allow();
+		bool isSuppressed(ELogVerbosity::Type verbosity) const;
+	};
+
+	FLuaLogSink();
+	virtual ~FLuaLogSink();
+
+	static FLuaLogSink* acquire();
+	void release();
+
+	FCategory* findCategory(const FString& name);
+	/** Make the log category of name on the game thread, if still missing. */
+	static void makeCategory(FName name);
+	/** Send values first..last of L converted to strings, after prefix. */
+	void send(FCategory* c, ELogVerbosity::Type verbosity, const char* prefix, size_t prefixLen, lua_State* L, int first, int last);
+	/** Write the lines sent so far, false if there was none. */
+	bool drain();
+	void reportDrops();
+
+	/** Push the log table of c, made once per state. */
+	static void pushCategory(lua_State* L, FLuaLogSink* sink, FCategory* c);
+	static int luaPrint(lua_State* L);
+	static int luaLog(lua_State* L);
+	static int luaCategory(lua_State* L);
+	static int luaSetRateLimit(lua_State* L);
+	static int luaStats(lua_State* L);
+	static int luaRelease(lua_State* L);
+
+	FLuaChannel* ring_;
+	FRunnableThread* thread_;
+	FThreadSafeBool stopping_;
+	/** Triggered on send while the thread waits for lines. */
+	FEvent* wake_;
+	FThreadSafeBool waiting_;
+
+	FThreadSafeCounter64 written_;
+	FThreadSafeCounter64 droppedFull_;
+	int64 reportedFull_;
+
+	/** Categories by name, guarded by lock_. */
+	TMap<FName, FCategory*> categories_;
+	FCategory* default_;
+
+	/** Users, guarded by lock_. */
+	int32 refs_;
+	static FCriticalSection lock_;
+	static FLuaLogSink* instance_;
+};
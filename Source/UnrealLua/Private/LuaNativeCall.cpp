@@ -0,0 +1,138 @@
+#include "LuaNativeCall.h"
+#include "UObject/Script.h"
+#include "Misc/Crc.h"
+
+/** Flags of the native functions ProcessEvent may not run locally, or not run natively. */
+static const EFunctionFlags processEventFlags = EFunctionFlags(FUNC_Net | FUNC_BlueprintAuthorityOnly | FUNC_BlueprintCosmetic | FUNC_Event);
+
+struct FLuaGlueEntry
+{
+	const TCHAR* path;
+	uint32 signature;
+	FLuaGlueFunc glue;
+};
+
+/** Glue registered by static initializers, resolved on the first call. */
+static TArray<FLuaGlueEntry>& pendingGlues()
+{
+	static TArray<FLuaGlueEntry> glues;
+	return glues;
+}
+
+static TMap<UFunction*, FLuaGlueFunc>& resolvedGlues()
+{
+	static TMap<UFunction*, FLuaGlueFunc> glues;
+	return glues;
+}
+
+void FLuaNativeCall::addGlue(const TCHAR* path, uint32 signature, FLuaGlueFunc glue)
+{
+	pendingGlues().Add({ path, signature, glue });
+}
+
+uint32 FLuaNativeCall::signatureHash(UFunction* func)
+{
+	// Flags changing how the glue passes a parameter, the same in all builds.
+	static const EPropertyFlags parmFlags = CPF_Parm | CPF_OutParm | CPF_ReturnParm | CPF_ReferenceParm | CPF_ConstParm;
+	uint32 hash = FCrc::MemCrc32(&func->ParmsSize, sizeof(func->ParmsSize));
+	for (TFieldIterator<UProperty> it(func); it && it->HasAnyPropertyFlags(CPF_Parm); ++it)
+	{
+		FString extended;
+		FString type = it->GetCPPType(&extended) + extended;
+		uint64 flags = it->PropertyFlags & parmFlags;
+		hash = FCrc::StrCrc32(*it->GetName(), hash);
+		hash = FCrc::StrCrc32(*type, hash);
+		hash = FCrc::MemCrc32(&flags, sizeof(flags), hash);
+	}
+	return hash;
+}
+
+FLuaGlueFunc FLuaNativeCall::findGlue(UFunction* func)
+{
+	TArray<FLuaGlueEntry>& pending = pendingGlues();
+	TMap<UFunction*, FLuaGlueFunc>& resolved = resolvedGlues();
+	if (pending.Num() > 0)
+	{
+		for (const FLuaGlueEntry& e : pending)
+		{
+			UFunction* f = FindObject<UFunction>(nullptr, e.path);
+			if (!f)
+				ULUA_LOG(Warning, TEXT("Glue of missing function %s"), e.path);
+			else if (signatureHash(f) != e.signature)
+				ULUA_LOG(Warning, TEXT("Stale glue of %s, regenerate it"), e.path);
+			else
+				resolved.Add(f, e.glue);
+		}
+		pending.Empty();
+	}
+	return resolved.Num() > 0 ? resolved.FindRef(func) : nullptr;
+}
+
+const FLuaCallPlan& FLuaNativeCall::plan(UFunction* func)
+{
+	static TMap<UFunction*, TUniquePtr<FLuaCallPlan>> plans;
+	TUniquePtr<FLuaCallPlan>& p = plans.FindOrAdd(func);
+	if (p.IsValid() && p->func.Get() == func)
+		return *p;
+
+	p = MakeUnique<FLuaCallPlan>();
+	p->func = func;
+	p->retParm = nullptr;
+	for (TFieldIterator<UProperty> it(func); it && it->HasAnyPropertyFlags(CPF_Parm); ++it)
+	{
+		UProperty* parm = *it;
+		if (parm->HasAnyPropertyFlags(CPF_ReturnParm))
+		{
+			p->retParm = parm;
+			continue;
+		}
+		p->parms.Add(parm);
+		if ((parm->PropertyFlags & (CPF_ConstParm | CPF_OutParm)) == CPF_OutParm)
+			p->outParms.Add(parm);
+	}
+	return *p;
+}
+
+bool FLuaNativeCall::isDirect(UFunction* func)
+{
+	return func->HasAnyFunctionFlags(FUNC_Native) && !func->HasAnyFunctionFlags(processEventFlags);
+}
+
+void FLuaNativeCall::call(UObject* obj, UFunction* func, void* parms)
+{
+	if (!isDirect(func))
+	{
+		obj->ProcessEvent(func, parms);
+		return;
+	}
+	if (FLuaGlueFunc glue = findGlue(func))
+		glue(obj, parms);
+	else
+		invokeThunk(obj, func, parms);
+}
+
+void FLuaNativeCall::invokeThunk(UObject* obj, UFunction* func, void* parms)
+{
+	// Thunks read parameters from the frame locals, with no bytecode.
+	FFrame stack(obj, func, parms, nullptr, func->Children);
+
+	// Out parameters are found by the thunks in the frame out records.
+	if (func->HasAnyFunctionFlags(FUNC_HasOutParms))
+	{
+		FOutParmRec** lastOut = &stack.OutParms;
+		for (UProperty* prop = (UProperty*)func->Children; prop && prop->HasAnyPropertyFlags(CPF_Parm); prop = (UProperty*)prop->Next)
+		{
+			if (!prop->HasAnyPropertyFlags(CPF_OutParm))
+				continue;
+			FOutParmRec* out = (FOutParmRec*)FMemory_Alloca(sizeof(FOutParmRec));
+			out->Property = prop;
+			out->PropAddr = prop->ContainerPtrToValuePtr<uint8>(parms);
+			out->NextOutParm = nullptr;
+			*lastOut = out;
+			lastOut = &out->NextOutParm;
+		}
+	}
+
+	uint8* returnValue = func->ReturnValueOffset != MAX_uint16 ? (uint8*)parms + func->ReturnValueOffset : nullptr;
+	func->Invoke(obj, stack, returnValue);
+}
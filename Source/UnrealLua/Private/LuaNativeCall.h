@@ -0,0 +1,58 @@
+#pragma once
+
+#include "UnrealLua.h"
+
+/** Parameters of a UFunction as lua passes them, built once per function. */
+struct FLuaCallPlan
+{
+	/** Function the plan was built for, to detect reused addresses. */
+	TWeakObjectPtr<UFunction> func;
+	/** Parameters but the return value, in order. */
+	TArray<UProperty*> parms;
+	UProperty* retParm;
+	/** Non const out parameters, returned after the return value. */
+	TArray<UProperty*> outParms;
+};
+
+/** Generated glue calling a native function with its parameter buffer. */
+typedef void (*FLuaGlueFunc)(UObject* obj, void* parms);
+
+/**
+ * Calls of UFunctions from lua.
+ * Native functions are called through their exec thunk with a frame over
+ * the parameter buffer, skipping ProcessEvent, or through generated glue when
+ * there is some, see ULuaGlueCommandlet. Script functions and the native ones
+ * ProcessEvent may route elsewhere (net, authority only and cosmetic
+ * functions, events) still go through ProcessEvent.
+ */
+class FLuaNativeCall
+{
+public:
+	/** Call func on obj with parms, its initialized parameter buffer. */
+	static void call(UObject* obj, UFunction* func, void* parms);
+	/** Whether func is called without ProcessEvent. */
+	static bool isDirect(UFunction* func);
+	/** Cached parameter plan of func. */
+	static const FLuaCallPlan& plan(UFunction* func);
+
+	/**
+	 * Register glue of the function at path, whose signature had the hash
+	 * signature when the glue was generated. Stale glue is ignored.
+	 */
+	static void addGlue(const TCHAR* path, uint32 signature, FLuaGlueFunc glue);
+	/** Hash of the names, C++ types and flags of the parameters of func. */
+	static uint32 signatureHash(UFunction* func);
+
+private:
+	static FLuaGlueFunc findGlue(UFunction* func);
+	static void invokeThunk(UObject* obj, UFunction* func, void* parms);
+};
+
+/** Static registration of generated glue. */
+struct FLuaGlueRegistration
+{
+	FLuaGlueRegistration(const TCHAR* path, uint32 signature, FLuaGlueFunc glue)
+	{
+		FLuaNativeCall::addGlue(path, signature, glue);
+	}
+};
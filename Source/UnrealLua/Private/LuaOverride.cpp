@@ -0,0 +1,153 @@
+#include "LuaOverride.h"
+#include "LuaEnv.h"
+#include "UObject/Script.h"
+
+/** Opcode of the thunk, the last one the VM allows. */
+static const int32 luaOverrideOpcode = EX_Max - 1;
+
+TMap<UFunction*, FLuaOverrides::FOverride*> FLuaOverrides::functions_;
+int32 FLuaOverrides::callDepth_ = 0;
+TArray<FLuaOverrides::FOverride*> FLuaOverrides::pending_;
+
+void ULuaOverride::execCallLua(FFrame& Stack, RESULT_DECL)
+{
+	FLuaOverrides::call(Stack, RESULT_PARAM);
+}
+
+FLuaOverrides::FLuaOverrides(FLuaEnv* luaEnv, lua_State* L):
+	luaEnv_(luaEnv),
+	luaState_(L)
+{
+	static bool registered = false;
+	if (!registered)
+	{
+		GRegisterNative(luaOverrideOpcode, (Native)&ULuaOverride::execCallLua);
+		registered = true;
+	}
+}
+
+FLuaOverrides::~FLuaOverrides()
+{
+	while (overrides_.Num() > 0)
+		restore(overrides_.Last());
+	// Overrides still pending outlive the env, without their lua function.
+	for (FOverride* o : pending_)
+	{
+		if (o->owner == this)
+		{
+			luaL_unref(luaState_, LUA_REGISTRYINDEX, o->ref);
+			o->owner = nullptr;
+		}
+	}
+}
+
+bool FLuaOverrides::add(lua_State* L, UClass* cls, FName name, int idx)
+{
+	UFunction* func = cls->FindFunctionByName(name);
+	if (!func || !func->HasAllFunctionFlags(EFunctionFlags(FUNC_Event | FUNC_BlueprintEvent)) || func->HasAnyFunctionFlags(FUNC_Net))
+		return false;
+	if (FOverride* o = functions_.FindRef(func))
+	{
+		if (o->owner != this)
+			return false;
+		if (o->cls == cls)
+		{
+			// Only the lua function changes, a pending restore is cancelled.
+			if (pending_.Remove(o) > 0)
+				overrides_.Add(o);
+			luaL_unref(L, LUA_REGISTRYINDEX, o->ref);
+			lua_pushvalue(L, idx);
+			o->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			return true;
+		}
+	}
+
+	FOverride* o = new FOverride();
+	o->owner = this;
+	o->cls = cls;
+	o->duplicated = func->GetOwnerClass() != cls;
+	if (o->duplicated)
+	{
+		// Inherited event, override it in cls only, as blueprints do.
+		UFunction* super = func;
+		func = DuplicateObject<UFunction>(super, cls, name);
+		func->SetSuperStruct(super);
+		func->StaticLink(true);
+		func->AddToRoot();
+		cls->AddFunctionToFunctionMap(func, name);
+	}
+	o->func = func;
+	o->flags = func->FunctionFlags;
+	o->nativeFunc = func->GetNativeFunc();
+	o->script = func->Script;
+	lua_pushvalue(L, idx);
+	o->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	// ProcessInternal steps over EX_Return and evaluates the thunk into the
+	// return value.
+	func->FunctionFlags = EFunctionFlags(func->FunctionFlags & ~FUNC_Native);
+	func->SetNativeFunc((Native)&UObject::ProcessInternal);
+	func->Script.Empty(2);
+	func->Script.Add(EX_Return);
+	func->Script.Add(luaOverrideOpcode);
+
+	functions_.Add(func, o);
+	overrides_.Add(o);
+	return true;
+}
+
+void FLuaOverrides::remove(UClass* cls)
+{
+	for (int32 i = overrides_.Num() - 1; i >= 0; i--)
+	{
+		if (overrides_[i]->cls == cls)
+			restore(overrides_[i]);
+	}
+}
+
+void FLuaOverrides::restore(FOverride* o)
+{
+	overrides_.Remove(o);
+	if (callDepth_ > 0)
+	{
+		// The frames of running events still read the script of func.
+		pending_.Add(o);
+		return;
+	}
+	restoreNow(o);
+}
+
+void FLuaOverrides::restoreNow(FOverride* o)
+{
+	functions_.Remove(o->func);
+	if (o->owner)
+		luaL_unref(o->owner->luaState_, LUA_REGISTRYINDEX, o->ref);
+	if (o->duplicated)
+	{
+		o->cls->RemoveFunctionFromFunctionMap(o->func);
+		o->func->RemoveFromRoot();
+	}
+	else
+	{
+		o->func->FunctionFlags = o->flags;
+		o->func->SetNativeFunc(o->nativeFunc);
+		o->func->Script = o->script;
+	}
+	delete o;
+}
+
+void FLuaOverrides::call(FFrame& stack, void* result)
+{
+	// Frames of script functions are made for them, the node is the event.
+	FOverride* o = functions_.FindRef((UFunction*)stack.Node);
+	if (!o || !o->owner)
+		return;
+	// Errors of the lua function are caught, the depth is always restored.
+	callDepth_++;
+	o->owner->luaEnv_->invokeOverride(o->ref, stack, result);
+	if (--callDepth_ == 0)
+	{
+		while (pending_.Num() > 0)
+			restoreNow(pending_.Pop());
+	}
+}
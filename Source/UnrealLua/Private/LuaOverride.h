@@ -0,0 +1,79 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "lua.hpp"
+#include "LuaOverride.generated.h"
+
+class FLuaEnv;
+
+/** Holder of the bytecode thunk of overridden events, never instantiated. */
+UCLASS()
+class UNREALLUA_API ULuaOverride : public UObject
+{
+	GENERATED_BODY()
+public:
+	/** Run by the script of overridden events, this is the object of the call. */
+	DECLARE_FUNCTION(execCallLua);
+};
+
+/**
+ * Lua functions overriding blueprint events (BlueprintImplementableEvent and
+ * BlueprintNativeEvent) of classes.
+ * The event UFunction of the class, duplicated from its super class when
+ * inherited, becomes a script function whose bytecode is a single native
+ * opcode calling the lua function through a registry ref, with the cached
+ * call plan of the function. Events called by ProcessEvent and by blueprint
+ * graphs both reach lua without running a blueprint graph.
+ * Overrides apply to all instances of the class and of its subclasses not
+ * overriding the event again. Functions are restored on removal, once no
+ * overridden event runs since their frames read the script of the function:
+ * until then, removed overrides still call lua, or do nothing once their env
+ * is destroyed.
+ */
+class FLuaOverrides
+{
+public:
+	FLuaOverrides(FLuaEnv* luaEnv, lua_State* L);
+	~FLuaOverrides();
+
+	/**
+	 * Override event name of cls by the function at idx in L.
+	 * @return false if cls has no such event, or another env overrides it.
+	 */
+	bool add(lua_State* L, UClass* cls, FName name, int idx);
+	/** Remove all overrides of cls. */
+	void remove(UClass* cls);
+
+	/** Call the override of the function of stack. */
+	static void call(FFrame& stack, void* result);
+
+private:
+	struct FOverride
+	{
+		FLuaOverrides* owner;
+		UClass* cls;
+		UFunction* func;
+		/** Lua function. */
+		int ref;
+		/** func was made for the override. */
+		bool duplicated;
+		EFunctionFlags flags;
+		Native nativeFunc;
+		TArray<uint8> script;
+	};
+
+	/** Restore the function of o, deferred while events run. */
+	void restore(FOverride* o);
+	static void restoreNow(FOverride* o);
+
+	FLuaEnv* luaEnv_;
+	lua_State* luaState_;
+	TArray<FOverride*> overrides_;
+
+	/** Overrides of all envs by function. */
+	static TMap<UFunction*, FOverride*> functions_;
+	/** Overridden events running. */
+	static int32 callDepth_;
+	/** Overrides removed while events ran, without owner once its env is destroyed. */
+	static TArray<FOverride*> pending_;
+};
@@ -0,0 +1,133 @@
+#include "LuaProfiler.h"
+#include "HAL/RunnableThread.h"
+
+FLuaProfiler::FLuaProfiler(int32 sampleIntervalUs, int32 maxSamples):
+	maxSamples_(FMath::Max(maxSamples, 1)),
+	head_(0),
+	interval_(FMath::Max(sampleIntervalUs, 1) * 1e-6f),
+	running_(nullptr),
+	hook_(nullptr),
+	thread_(nullptr)
+{
+	samples_.SetNumZeroed(maxSamples_ * SlotSize);
+}
+
+FLuaProfiler::~FLuaProfiler()
+{
+	stop();
+}
+
+bool FLuaProfiler::start(lua_State* L, lua_Hook hook)
+{
+	check(!thread_);
+	lua_Hook current = lua_gethook(L);
+	if (current && current != hook)
+		return false;
+	running_ = L;
+	samplePending_ = false;
+	hook_ = hook;
+	stopping_ = false;
+	thread_ = FRunnableThread::Create(this, TEXT("LuaProfiler"), 0, TPri_AboveNormal);
+	return true;
+}
+
+void FLuaProfiler::stop()
+{
+	if (thread_)
+	{
+		thread_->Kill(true);
+		delete thread_;
+		thread_ = nullptr;
+		// Remove a hook set after the last sample, hooks left on other
+		// threads remove themselves.
+		samplePending_ = false;
+		if (lua_gethook(running_) == hook_)
+			lua_sethook(running_, nullptr, 0, 0);
+	}
+}
+
+uint32 FLuaProfiler::Run()
+{
+	while (!stopping_)
+	{
+		FPlatformProcess::Sleep(interval_);
+		// One-shot hook, run at the next instruction of the running thread.
+		// A thread hooked by a script is not sampled.
+		FScopeLock lock(&runningLock_);
+		lua_Hook current = lua_gethook(running_);
+		if (current && current != hook_)
+			continue;
+		samplePending_ = true;
+		lua_sethook(running_, hook_, LUA_MASKCOUNT, 1);
+	}
+	return 0;
+}
+
+void FLuaProfiler::takeSample(lua_State* L)
+{
+	uint32* slot = &samples_[(int32)(head_ % maxSamples_) * SlotSize];
+	head_++;
+
+	lua_Debug ar;
+	uint32 depth = 0;
+	int level = 0;
+	for (; depth < MaxDepth && lua_getstack(L, level, &ar); level++)
+	{
+		lua_getinfo(L, "Sn", &ar);
+		slot[1 + depth] = getFrameId(ar);
+		depth++;
+	}
+	if (depth == MaxDepth && lua_getstack(L, level, &ar))
+		depth |= Truncated;
+	slot[0] = depth;
+}
+
+uint32 FLuaProfiler::getFrameId(const lua_Debug& ar)
+{
+	// Sources and names are interned lua strings, their addresses identify them.
+	FFrameKey key = { ar.source, ar.name, ar.linedefined };
+	if (uint32* id = frameIds_.Find(key))
+		return *id;
+
+	FString name;
+	if (*ar.what == 'm')
+		name = FString::Printf(TEXT("main@%s"), UTF8_TO_TCHAR(ar.short_src));
+	else if (*ar.what == 'C')
+		name = FString::Printf(TEXT("%s@[C]"), ar.name ? UTF8_TO_TCHAR(ar.name) : TEXT("?"));
+	else
+		name = FString::Printf(TEXT("%s@%s:%d"), ar.name ? UTF8_TO_TCHAR(ar.name) : TEXT("?"), UTF8_TO_TCHAR(ar.short_src), ar.linedefined);
+	// ';' separates frames and ' ' the count in folded stacks.
+	name.ReplaceInline(TEXT(";"), TEXT(":"));
+	name.ReplaceInline(TEXT(" "), TEXT("_"));
+
+	uint32 id = (uint32)frameNames_.Add(name);
+	frameIds_.Add(key, id);
+	return id;
+}
+
+FString FLuaProfiler::dumpFolded() const
+{
+	TMap<FString, int32> stacks;
+	uint64 first = head_ > (uint64)maxSamples_ ? head_ - maxSamples_ : 0;
+	for (uint64 i = first; i < head_; i++)
+	{
+		const uint32* slot = &samples_[(int32)(i % maxSamples_) * SlotSize];
+		uint32 depth = slot[0] & ~Truncated;
+		FString stack;
+		if (slot[0] & Truncated)
+			stack = TEXT("[truncated]");
+		for (uint32 d = depth; d > 0; d--)
+		{
+			if (!stack.IsEmpty())
+				stack += TEXT(";");
+			stack += frameNames_[slot[d]];
+		}
+		if (depth > 0)
+			stacks.FindOrAdd(stack)++;
+	}
+
+	FString out;
+	for (auto& it : stacks)
+		out += FString::Printf(TEXT("%s %d\n"), *it.Key, it.Value);
+	return out;
+}
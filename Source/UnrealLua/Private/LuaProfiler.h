@@ -0,0 +1,113 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "Misc/ScopeLock.h"
+#include "lua.hpp"
+
+/**
+ * Sampling profiler of a lua state.
+ * A timer thread sets a one-shot count hook on the running thread once per
+ * sample interval (lua_sethook may be called asynchronously), the hook
+ * records the current lua call stack into a ring buffer allocated up front
+ * and removes itself. Between samples the vm runs without any hook, so the
+ * overhead is the cost of the samples alone.
+ * Samples are dumped in folded-stack format ("root;caller;callee count"),
+ * which flame graph tools read directly.
+ * The running thread is reported by FLuaEnv when it resumes a coroutine and
+ * when the resume returns, so coroutines are sampled in their own frames.
+ * A hook may fire on another thread than the one it was set on, or be
+ * inherited by coroutines created while it is pending: only the first hook
+ * to fire after a tick takes the sample, the others remove themselves.
+ * Hooks set by scripts (debug.sethook, as debuggers and coverage tools do)
+ * are left alone: the profiler does not start while one is set, and skips
+ * the samples of a thread that has one.
+ */
+class FLuaProfiler : public FRunnable
+{
+public:
+	/**
+	 * Constructor.
+	 * @param sampleIntervalUs time between two samples, in microseconds.
+	 * @param maxSamples capacity of the ring buffer, older samples are overwritten.
+	 */
+	FLuaProfiler(int32 sampleIntervalUs, int32 maxSamples);
+	virtual ~FLuaProfiler();
+
+	/**
+	 * Start or stop the timer thread setting hook, L running.
+	 * @return false if L has another hook.
+	 */
+	bool start(lua_State* L, lua_Hook hook);
+	void stop();
+	bool isRunning() const { return thread_ != nullptr; }
+
+	/** Called by the game thread when L starts or goes back to running. */
+	void setRunning(lua_State* L)
+	{
+		FScopeLock lock(&runningLock_);
+		running_ = L;
+	}
+
+	/** Called from the hook. */
+	void onHook(lua_State* L)
+	{
+		lua_sethook(L, nullptr, 0, 0);
+		if (samplePending_.AtomicSet(false))
+			takeSample(L);
+	}
+
+	/** Number of samples in the buffer. */
+	int32 numSamples() const { return (int32)FMath::Min<uint64>(head_, maxSamples_); }
+
+	/** Build the folded stacks of all samples in the buffer. */
+	FString dumpFolded() const;
+
+	/** Deeper stacks keep their innermost frames only. */
+	enum { MaxDepth = 64 };
+
+	/** FRunnable Interface */
+	virtual uint32 Run() override;
+	virtual void Stop() override { stopping_ = true; }
+
+private:
+	void takeSample(lua_State* L);
+	uint32 getFrameId(const lua_Debug& ar);
+
+	struct FFrameKey
+	{
+		const void* source;
+		const void* name;
+		int32 line;
+
+		bool operator==(const FFrameKey& o) const { return source == o.source && name == o.name && line == o.line; }
+		friend uint32 GetTypeHash(const FFrameKey& k)
+		{
+			return HashCombine(HashCombine(PointerHash(k.source), PointerHash(k.name)), (uint32)k.line);
+		}
+	};
+
+	/** Sample slots: depth (high bit set if truncated), then frame ids from the innermost. */
+	enum { SlotSize = MaxDepth + 1 };
+	enum : uint32 { Truncated = 0x80000000u };
+	TArray<uint32> samples_;
+	int32 maxSamples_;
+	/** Total samples taken, the next slot is head_ % maxSamples_. */
+	uint64 head_;
+
+	float interval_;
+	/**
+	 * Thread running lua. Every switch is reported through setRunning, so it
+	 * is valid; runningLock_ keeps a switch from happening while it is hooked.
+	 */
+	lua_State* running_;
+	FCriticalSection runningLock_;
+	FThreadSafeBool samplePending_;
+	lua_Hook hook_;
+	FRunnableThread* thread_;
+	FThreadSafeBool stopping_;
+
+	TMap<FFrameKey, uint32> frameIds_;
+	TArray<FString> frameNames_;
+};
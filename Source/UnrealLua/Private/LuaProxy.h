@@ -0,0 +1,73 @@
+#pragma once
+
+#include "UnrealLua.h"
+
+/** Userdata of a UObject in lua, with metatable "UObjectMT". */
+struct FUObjectProxy
+{
+	UObject* ptr;
+};
+
+/** Userdata of a UStruct copy in lua, followed by the struct, with metatable "UStructMT". */
+struct FUStructProxy
+{
+	UScriptStruct* type;
+	void* ptr;
+};
+
+/**
+ * Userdata of a FString or FText copy in lua, followed by the value, with
+ * metatable "UStringMT". Its user value is the lua string once converted.
+ */
+struct FUStringProxy
+{
+	bool isText;
+	void* ptr;
+
+	const FString& str() const { return isText ? ((const FText*)ptr)->ToString() : *(const FString*)ptr; }
+};
+
+/**
+ * Userdata of a view over the rows of an array of structs property or a
+ * data table, with metatable "UColumnViewMT". Names of data table rows are
+ * listed after the struct when the view is made, and looked up on each
+ * access since the row map may change; removed rows read as nil.
+ * Its user value holds its columns by name, and the owner proxy at 0.
+ */
+struct FUColumnViewProxy
+{
+	FUObjectProxy* owner;
+	/** Array of owner, nullptr for the rows of a data table. */
+	UArrayProperty* arrayProp;
+	UScriptStruct* type;
+	int32 numRows;
+	FName* rowNames;
+};
+
+/** How a column reads its field, Other going through the property. */
+enum class EColumnKind : uint8
+{
+	Int8,
+	Int16,
+	Int32,
+	Int64,
+	UInt8,
+	UInt16,
+	UInt32,
+	UInt64,
+	Float,
+	Double,
+	Other,
+};
+
+/**
+ * Userdata of a field of all rows of a view, with metatable "UColumnMT".
+ * Its user value is the view.
+ */
+struct FUColumnProxy
+{
+	FUColumnViewProxy* view;
+	UProperty* field;
+	int32 offset;
+	EColumnKind kind;
+};
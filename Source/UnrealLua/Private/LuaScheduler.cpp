@@ -0,0 +1,40 @@
+#include "LuaScheduler.h"
+
+FLuaScheduler::FLuaScheduler():
+	now_(0),
+	seq_(0)
+{
+}
+
+void FLuaScheduler::addTimer(int threadRef, double seconds)
+{
+	FTimer t = { now_ + FMath::Max(seconds, 0.0), seq_++, threadRef };
+	timers_.HeapPush(t);
+}
+
+void FLuaScheduler::addNextFrame(int threadRef)
+{
+	nextFrame_.Add(threadRef);
+}
+
+void FLuaScheduler::advance(double deltaSeconds, TArray<int>& outDue)
+{
+	now_ += deltaSeconds;
+	outDue.Append(nextFrame_);
+	nextFrame_.Reset();
+	while (timers_.Num() > 0 && timers_.HeapTop().due <= now_)
+	{
+		FTimer t;
+		timers_.HeapPop(t, false);
+		outDue.Add(t.threadRef);
+	}
+}
+
+void FLuaScheduler::clear(TArray<int>& outAll)
+{
+	outAll.Append(nextFrame_);
+	for (const FTimer& t : timers_)
+		outAll.Add(t.threadRef);
+	nextFrame_.Empty();
+	timers_.Empty();
+}
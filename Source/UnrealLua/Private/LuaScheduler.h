@@ -0,0 +1,50 @@
+#pragma once
+
+#include "UnrealLua.h"
+
+/**
+ * Coroutines waiting for a time or for the next frame.
+ * Only registry references of the waiting threads are kept here, resuming
+ * them is left to the env.
+ * Timers are kept in a min-heap on due time, so a frame costs a look at the
+ * earliest timer however many coroutines are sleeping.
+ */
+class FLuaScheduler
+{
+public:
+	FLuaScheduler();
+
+	/** Resume thread ref after seconds. */
+	void addTimer(int threadRef, double seconds);
+	/** Resume thread ref next frame. */
+	void addNextFrame(int threadRef);
+
+	/**
+	 * Advance time and collect refs due this frame, next frame ones first,
+	 * then timers in due order. Refs added while resuming these wait for a
+	 * later frame.
+	 */
+	void advance(double deltaSeconds, TArray<int>& outDue);
+
+	/** Collect all waiting refs and forget them. */
+	void clear(TArray<int>& outAll);
+
+	int32 numWaiting() const { return timers_.Num() + nextFrame_.Num(); }
+	double now() const { return now_; }
+
+private:
+	struct FTimer
+	{
+		double due;
+		/** Keeps timers with the same due time in order. */
+		uint64 seq;
+		int threadRef;
+
+		bool operator<(const FTimer& o) const { return due < o.due || (due == o.due && seq < o.seq); }
+	};
+
+	TArray<FTimer> timers_;
+	TArray<int> nextFrame_;
+	double now_;
+	uint64 seq_;
+};
@@ -0,0 +1,798 @@
+#include "LuaSerializer.h"
+#include "LuaEnv.h"
+#include "LuaProxy.h"
+#include "Misc/OutputDeviceNull.h"
+
+namespace
+{
+	// MessagePack type bytes.
+	enum : uint8
+	{
+		MP_FixMap	= 0x80,
+		MP_FixArray	= 0x90,
+		MP_FixStr	= 0xa0,
+		MP_Nil		= 0xc0,
+		MP_False	= 0xc2,
+		MP_True		= 0xc3,
+		MP_Bin8		= 0xc4,
+		MP_Bin16	= 0xc5,
+		MP_Bin32	= 0xc6,
+		MP_Ext8		= 0xc7,
+		MP_Ext16	= 0xc8,
+		MP_Ext32	= 0xc9,
+		MP_Float32	= 0xca,
+		MP_Float64	= 0xcb,
+		MP_UInt8	= 0xcc,
+		MP_UInt16	= 0xcd,
+		MP_UInt32	= 0xce,
+		MP_UInt64	= 0xcf,
+		MP_Int8		= 0xd0,
+		MP_Int16	= 0xd1,
+		MP_Int32	= 0xd2,
+		MP_Int64	= 0xd3,
+		MP_FixExt1	= 0xd4,
+		MP_FixExt2	= 0xd5,
+		MP_FixExt4	= 0xd6,
+		MP_FixExt8	= 0xd7,
+		MP_FixExt16	= 0xd8,
+		MP_Str8		= 0xd9,
+		MP_Str16	= 0xda,
+		MP_Str32	= 0xdb,
+		MP_Array16	= 0xdc,
+		MP_Array32	= 0xdd,
+		MP_Map16	= 0xde,
+		MP_Map32	= 0xdf,
+	};
+
+	inline uint8* storeBE(uint8* p, uint64 v, int32 bytes)
+	{
+		for (int32 i = bytes - 1; i >= 0; i--)
+		{
+			p[i] = (uint8)v;
+			v >>= 8;
+		}
+		return p + bytes;
+	}
+}
+
+struct FLuaSerializer::FWriter
+{
+	lua_State* L;
+	TArray<uint8>& out;
+	/** out is kept at its capacity while writing, len bytes of it are used. */
+	uint8* buf;
+	int32 len;
+	int32 cap;
+	const char* error;
+
+	/** Index of tables written so far, by order of first occurrence. */
+	TMap<const void*, uint32> tableIds;
+
+	FWriter(lua_State* inL, TArray<uint8>& inOut):
+		L(inL),
+		out(inOut),
+		buf(inOut.GetData()),
+		len(inOut.Num()),
+		cap(inOut.Num()),
+		error(nullptr)
+	{
+	}
+
+	void finish()
+	{
+		out.SetNum(len, false);
+	}
+
+	/** Make room for n more bytes. */
+	uint8* reserve(int32 n)
+	{
+		if (cap - len < n)
+		{
+			cap = (int32)FMath::Min<int64>(FMath::Max<int64>((int64)cap * 2, (int64)len + n + 64), MAX_int32);
+			out.SetNumUninitialized(cap, false);
+			buf = out.GetData();
+		}
+		return buf + len;
+	}
+
+	void write8(uint8 v)
+	{
+		*reserve(1) = v;
+		len++;
+	}
+
+	void writeBE(uint8 type, uint64 v, int32 bytes)
+	{
+		uint8* p = reserve(bytes + 1);
+		*p++ = type;
+		storeBE(p, v, bytes);
+		len += bytes + 1;
+	}
+
+	void writeInteger(lua_Integer v)
+	{
+		if (v >= 0)
+		{
+			if (v < 0x80)
+				write8((uint8)v);
+			else if (v <= 0xff)
+				writeBE(MP_UInt8, v, 1);
+			else if (v <= 0xffff)
+				writeBE(MP_UInt16, v, 2);
+			else if (v <= 0xffffffffll)
+				writeBE(MP_UInt32, v, 4);
+			else
+				writeBE(MP_Int64, v, 8);
+		}
+		else
+		{
+			if (v >= -32)
+				write8((uint8)v);
+			else if (v >= -0x80)
+				writeBE(MP_Int8, (uint64)v, 1);
+			else if (v >= -0x8000)
+				writeBE(MP_Int16, (uint64)v, 2);
+			else if (v >= -0x80000000ll)
+				writeBE(MP_Int32, (uint64)v, 4);
+			else
+				writeBE(MP_Int64, (uint64)v, 8);
+		}
+	}
+
+	void writeFloat(lua_Number v)
+	{
+		float f = (float)v;
+		if ((lua_Number)f == v)
+		{
+			uint32 bits;
+			FMemory::Memcpy(&bits, &f, 4);
+			writeBE(MP_Float32, bits, 4);
+		}
+		else
+		{
+			double d = v;
+			uint64 bits;
+			FMemory::Memcpy(&bits, &d, 8);
+			writeBE(MP_Float64, bits, 8);
+		}
+	}
+
+	/** Check that n more payload bytes fit in the output. */
+	bool fits(size_t n)
+	{
+		if (n > (size_t)(MAX_int32 - 16 - len))
+		{
+			error = "data too large";
+			return false;
+		}
+		return true;
+	}
+
+	bool writeString(const char* s, size_t n)
+	{
+		if (!fits(n))
+			return false;
+		uint8* p = reserve((int32)n + 5);
+		if (n <= 31)
+			*p++ = (uint8)(MP_FixStr | n);
+		else if (n <= 0xff)
+		{
+			*p++ = MP_Str8;
+			p = storeBE(p, n, 1);
+		}
+		else if (n <= 0xffff)
+		{
+			*p++ = MP_Str16;
+			p = storeBE(p, n, 2);
+		}
+		else
+		{
+			*p++ = MP_Str32;
+			p = storeBE(p, n, 4);
+		}
+		FMemory::Memcpy(p, s, n);
+		len = (int32)(p + n - buf);
+		return true;
+	}
+
+	/** Write an extension header, the caller writes the n payload bytes. */
+	uint8* writeExtHeader(int8 type, size_t n)
+	{
+		uint8* p = reserve((int32)n + 6);
+		if (n <= 0xff)
+		{
+			*p++ = MP_Ext8;
+			p = storeBE(p, n, 1);
+		}
+		else if (n <= 0xffff)
+		{
+			*p++ = MP_Ext16;
+			p = storeBE(p, n, 2);
+		}
+		else
+		{
+			*p++ = MP_Ext32;
+			p = storeBE(p, n, 4);
+		}
+		*p++ = (uint8)type;
+		len = (int32)(p + n - buf);
+		return p;
+	}
+
+	void writeRef(uint32 id)
+	{
+		if (id <= 0xff)
+			writeBE(MP_FixExt1, ((uint64)ExtRef << 8) | id, 2);
+		else if (id <= 0xffff)
+			writeBE(MP_FixExt2, ((uint64)ExtRef << 16) | id, 3);
+		else
+			writeBE(MP_FixExt4, ((uint64)ExtRef << 32) | id, 5);
+	}
+
+	/** Write the header of a container of n elements. */
+	void writeHeader(uint8 fixType, uint8 type16, uint8 type32, uint64 n)
+	{
+		if (n <= 15)
+			write8((uint8)(fixType | n));
+		else if (n <= 0xffff)
+			writeBE(type16, n, 2);
+		else
+			writeBE(type32, n, 4);
+	}
+
+	bool writeTable(int idx, int depth)
+	{
+		const void* t = lua_topointer(L, idx);
+		if (uint32* id = tableIds.Find(t))
+		{
+			writeRef(*id);
+			return true;
+		}
+		if (depth >= FLuaSerializer::MaxDepth)
+		{
+			error = "table too deep";
+			return false;
+		}
+		if (!lua_checkstack(L, 8))
+		{
+			error = "stack overflow";
+			return false;
+		}
+		tableIds.Add(t, tableIds.Num());
+
+		// Keys are exactly 1..n if there are n of them, keys 1..n being set
+		// up to the border found by rawlen. Counting first writes each value
+		// once, whatever the table turns out to be.
+		lua_Unsigned n = (lua_Unsigned)lua_rawlen(L, idx);
+		lua_Unsigned count = 0;
+		lua_pushnil(L);
+		while (lua_next(L, idx) != 0)
+		{
+			lua_pop(L, 1);
+			count++;
+		}
+		if (count > 0xffffffffull)
+		{
+			error = "table too large";
+			return false;
+		}
+		if (count == n)
+		{
+			writeHeader(MP_FixArray, MP_Array16, MP_Array32, count);
+			for (lua_Unsigned i = 1; i <= n; i++)
+			{
+				lua_rawgeti(L, idx, (lua_Integer)i);
+				if (!writeValue(lua_gettop(L), depth + 1))
+					return false;
+				lua_pop(L, 1);
+			}
+			return true;
+		}
+		writeHeader(MP_FixMap, MP_Map16, MP_Map32, count);
+		lua_pushnil(L);
+		while (lua_next(L, idx) != 0)
+		{
+			int top = lua_gettop(L);
+			if (!writeValue(top - 1, depth + 1) || !writeValue(top, depth + 1))
+				return false;
+			lua_pop(L, 1);
+		}
+		return true;
+	}
+
+	bool writeUObject(FUObjectProxy* p)
+	{
+		if (!p->ptr || p->ptr->IsPendingKill())
+		{
+			write8(MP_Nil);
+			return true;
+		}
+		FTCHARToUTF8 path(*p->ptr->GetPathName());
+		if (!fits(path.Length()))
+			return false;
+		FMemory::Memcpy(writeExtHeader(ExtUObject, path.Length()), path.Get(), path.Length());
+		return true;
+	}
+
+	bool writeUStruct(FUStructProxy* p)
+	{
+		FString text;
+		p->type->ExportText(text, p->ptr, nullptr, nullptr, PPF_None, nullptr);
+		FTCHARToUTF8 path(*p->type->GetPathName());
+		FTCHARToUTF8 value(*text);
+		size_t n = (size_t)path.Length() + 1 + value.Length();
+		if (!fits(n))
+			return false;
+		uint8* dst = writeExtHeader(ExtUStruct, n);
+		FMemory::Memcpy(dst, path.Get(), path.Length());
+		dst[path.Length()] = 0;
+		FMemory::Memcpy(dst + path.Length() + 1, value.Get(), value.Length());
+		return true;
+	}
+
+	bool writeValue(int idx, int depth)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TNIL:
+			write8(MP_Nil);
+			return true;
+		case LUA_TBOOLEAN:
+			write8(lua_toboolean(L, idx) ? MP_True : MP_False);
+			return true;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, idx))
+				writeInteger(lua_tointeger(L, idx));
+			else
+				writeFloat(lua_tonumber(L, idx));
+			return true;
+		case LUA_TSTRING:
+		{
+			size_t n;
+			const char* s = lua_tolstring(L, idx, &n);
+			if (n > 0xffffffffu)
+			{
+				error = "string too large";
+				return false;
+			}
+			return writeString(s, n);
+		}
+		case LUA_TTABLE:
+			return writeTable(idx, depth);
+		case LUA_TUSERDATA:
+			if (void* p = luaL_testudata(L, idx, "UObjectMT"))
+				return writeUObject((FUObjectProxy*)p);
+			if (void* p = luaL_testudata(L, idx, "UStructMT"))
+				return writeUStruct((FUStructProxy*)p);
+			if (void* p = luaL_testudata(L, idx, "UStringMT"))
+			{
+				FTCHARToUTF8 utf8(*((FUStringProxy*)p)->str());
+				return writeString(utf8.Get(), utf8.Length());
+			}
+			// fall through
+		default:
+			error = lua_typename(L, lua_type(L, idx));
+			return false;
+		}
+	}
+};
+
+struct FLuaSerializer::FReader
+{
+	lua_State* L;
+	const uint8* p;
+	const uint8* end;
+	const char* error;
+
+	/** Stack index of the table of tables read so far, by index from 1. */
+	int refs;
+	lua_Integer numTables;
+	FLuaEnv* env;
+
+	bool need(uint64 n)
+	{
+		if ((uint64)(end - p) < n)
+		{
+			error = "truncated data";
+			return false;
+		}
+		return true;
+	}
+
+	uint64 readBE(int32 bytes)
+	{
+		uint64 v = 0;
+		for (int32 i = 0; i < bytes; i++)
+			v = (v << 8) | p[i];
+		p += bytes;
+		return v;
+	}
+
+	bool readString(uint64 n)
+	{
+		if (!need(n))
+			return false;
+		lua_pushlstring(L, (const char*)p, (size_t)n);
+		p += n;
+		return true;
+	}
+
+	bool newTable(int narr, int nrec, int depth)
+	{
+		if (depth >= FLuaSerializer::MaxDepth)
+		{
+			error = "table too deep";
+			return false;
+		}
+		if (!lua_checkstack(L, 8))
+		{
+			error = "stack overflow";
+			return false;
+		}
+		lua_createtable(L, narr, nrec);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, refs, ++numTables);
+		return true;
+	}
+
+	bool readArray(uint64 n, int depth)
+	{
+		// Each element takes a byte at least.
+		if (!need(n) || !newTable((int)n, 0, depth))
+			return false;
+		for (uint64 i = 1; i <= n; i++)
+		{
+			if (!readValue(depth + 1))
+				return false;
+			lua_rawseti(L, -2, (lua_Integer)i);
+		}
+		return true;
+	}
+
+	bool readMap(uint64 n, int depth)
+	{
+		if (!need(n * 2) || !newTable(0, (int)n, depth))
+			return false;
+		for (uint64 i = 0; i < n; i++)
+		{
+			if (!readValue(depth + 1))
+				return false;
+			if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+			{
+				error = "invalid table key";
+				return false;
+			}
+			if (!readValue(depth + 1))
+				return false;
+			lua_rawset(L, -3);
+		}
+		return true;
+	}
+
+	bool readExt(uint64 n)
+	{
+		if (!need(n + 1))
+			return false;
+		int8 type = (int8)*p++;
+		const uint8* data = p;
+		p += n;
+		switch (type)
+		{
+		case ExtRef:
+		{
+			if (n > 4)
+				break;
+			uint64 id = 0;
+			for (uint64 i = 0; i < n; i++)
+				id = (id << 8) | data[i];
+			if ((lua_Integer)id >= numTables)
+			{
+				error = "invalid table reference";
+				return false;
+			}
+			lua_rawgeti(L, refs, (lua_Integer)id + 1);
+			return true;
+		}
+		case ExtUObject:
+		{
+			if (!env)
+			{
+				error = "UObject outside of an env";
+				return false;
+			}
+			FUTF8ToTCHAR path((const ANSICHAR*)data, (int32)n);
+			UObject* obj = StaticFindObject(UObject::StaticClass(), nullptr, *FString(path.Length(), path.Get()));
+			FLuaSerializer::pushUObject(env, L, obj);
+			return true;
+		}
+		case ExtUStruct:
+		{
+			if (!env)
+			{
+				error = "UStruct outside of an env";
+				return false;
+			}
+			const uint8* sep = data;
+			while (sep < p && *sep)
+				sep++;
+			if (sep == p)
+				break;
+			FUTF8ToTCHAR path((const ANSICHAR*)data, (int32)(sep - data));
+			UScriptStruct* structType = FindObject<UScriptStruct>(nullptr, *FString(path.Length(), path.Get()));
+			if (!structType)
+			{
+				error = "unknown struct type";
+				return false;
+			}
+			FUTF8ToTCHAR value((const ANSICHAR*)sep + 1, (int32)(data + n - sep - 1));
+			void* ptr = FLuaSerializer::pushNewUStruct(env, L, structType);
+			FOutputDeviceNull errors;
+			structType->ImportText(*FString(value.Length(), value.Get()), ptr, nullptr, PPF_None, &errors, structType->GetName());
+			return true;
+		}
+		default:
+			break;
+		}
+		error = "unsupported extension type";
+		return false;
+	}
+
+	bool readValue(int depth)
+	{
+		if (!need(1))
+			return false;
+		uint8 type = *p++;
+		if (type < 0x80)
+		{
+			lua_pushinteger(L, type);
+			return true;
+		}
+		if (type >= 0xe0)
+		{
+			lua_pushinteger(L, (int8)type);
+			return true;
+		}
+		if ((type & 0xe0) == MP_FixStr)
+			return readString(type & 0x1f);
+		if ((type & 0xf0) == MP_FixArray)
+			return readArray(type & 0x0f, depth);
+		if ((type & 0xf0) == MP_FixMap)
+			return readMap(type & 0x0f, depth);
+
+		switch (type)
+		{
+		case MP_Nil:
+			lua_pushnil(L);
+			return true;
+		case MP_False:
+		case MP_True:
+			lua_pushboolean(L, type == MP_True);
+			return true;
+		case MP_UInt8:
+		case MP_UInt16:
+		case MP_UInt32:
+		case MP_UInt64:
+		{
+			int32 bytes = 1 << (type - MP_UInt8);
+			if (!need(bytes))
+				return false;
+			uint64 v = readBE(bytes);
+			if (v > (uint64)LUA_MAXINTEGER)
+				lua_pushnumber(L, (lua_Number)v);
+			else
+				lua_pushinteger(L, (lua_Integer)v);
+			return true;
+		}
+		case MP_Int8:
+		case MP_Int16:
+		case MP_Int32:
+		case MP_Int64:
+		{
+			int32 bytes = 1 << (type - MP_Int8);
+			if (!need(bytes))
+				return false;
+			// Sign extend.
+			int32 shift = 64 - bytes * 8;
+			lua_pushinteger(L, (lua_Integer)((int64)(readBE(bytes) << shift) >> shift));
+			return true;
+		}
+		case MP_Float32:
+		{
+			if (!need(4))
+				return false;
+			uint32 bits = (uint32)readBE(4);
+			float f;
+			FMemory::Memcpy(&f, &bits, 4);
+			lua_pushnumber(L, f);
+			return true;
+		}
+		case MP_Float64:
+		{
+			if (!need(8))
+				return false;
+			uint64 bits = readBE(8);
+			double d;
+			FMemory::Memcpy(&d, &bits, 8);
+			lua_pushnumber(L, d);
+			return true;
+		}
+		case MP_Str8:
+		case MP_Bin8:
+			return need(1) && readString(readBE(1));
+		case MP_Str16:
+		case MP_Bin16:
+			return need(2) && readString(readBE(2));
+		case MP_Str32:
+		case MP_Bin32:
+			return need(4) && readString(readBE(4));
+		case MP_Array16:
+			return need(2) && readArray(readBE(2), depth);
+		case MP_Array32:
+			return need(4) && readArray(readBE(4), depth);
+		case MP_Map16:
+			return need(2) && readMap(readBE(2), depth);
+		case MP_Map32:
+			return need(4) && readMap(readBE(4), depth);
+		case MP_FixExt1:
+		case MP_FixExt2:
+		case MP_FixExt4:
+		case MP_FixExt8:
+		case MP_FixExt16:
+			return readExt(1ull << (type - MP_FixExt1));
+		case MP_Ext8:
+			return need(1) && readExt(readBE(1));
+		case MP_Ext16:
+			return need(2) && readExt(readBE(2));
+		case MP_Ext32:
+			return need(4) && readExt(readBE(4));
+		default:
+			error = "unsupported type";
+			return false;
+		}
+	}
+};
+
+FLuaEnv* FLuaSerializer::findLuaEnv(lua_State* L)
+{
+	void* ud = nullptr;
+	return lua_getallocf(L, &ud) == &FLuaEnv::_lua_cb_memAlloc ? (FLuaEnv*)ud : nullptr;
+}
+
+void FLuaSerializer::pushUObject(FLuaEnv* env, lua_State* L, UObject* obj)
+{
+	lua_State* prev = env->luaState_;
+	env->luaState_ = L;
+	env->pushUObject(obj);
+	env->luaState_ = prev;
+}
+
+void* FLuaSerializer::pushNewUStruct(FLuaEnv* env, lua_State* L, UScriptStruct* type)
+{
+	env->structs_.Add(type);
+	FUStructProxy* p = (FUStructProxy*)lua_newuserdata(L, sizeof(FUStructProxy) + type->GetStructureSize());
+	p->type = type;
+	p->ptr = p + 1;
+	p->type->InitializeStruct(p->ptr);
+	luaL_setmetatable(L, "UStructMT");
+	return p->ptr;
+}
+
+bool FLuaSerializer::pack(lua_State* L, int first, int n, TArray<uint8>& out, FString& error)
+{
+	first = lua_absindex(L, first);
+	int top = lua_gettop(L);
+	FWriter w(L, out);
+	bool ok = lua_checkstack(L, 8);
+	if (!ok)
+		w.error = "stack overflow";
+	for (int i = 0; ok && i < n; i++)
+		ok = w.writeValue(first + i, 0);
+	w.finish();
+	if (!ok)
+	{
+		error = FString::Printf(TEXT("can not serialize %s"), UTF8_TO_TCHAR(w.error));
+		lua_settop(L, top);
+	}
+	return ok;
+}
+
+int FLuaSerializer::unpack(lua_State* L, const uint8* data, int32 size, FString& error)
+{
+	int top = lua_gettop(L);
+	FReader r = { L, data, data + size, nullptr, top + 1, 0, findLuaEnv(L) };
+	if (!lua_checkstack(L, 8))
+	{
+		error = TEXT("can not deserialize, stack overflow");
+		return -1;
+	}
+	lua_newtable(L);
+	int n = 0;
+	while (r.p < r.end)
+	{
+		if (!lua_checkstack(L, 8))
+			r.error = "stack overflow";
+		if (r.error || !r.readValue(0))
+		{
+			error = FString::Printf(TEXT("can not deserialize, %s"), UTF8_TO_TCHAR(r.error));
+			lua_settop(L, top);
+			return -1;
+		}
+		n++;
+	}
+	lua_remove(L, r.refs);
+	return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/************************************************************************/
+/* Lua library.                                                         */
+/************************************************************************/
+
+/** Registry key of the buffer reused by msgpack.pack. */
+static char packBufferKey;
+
+static int packBufferGC(lua_State* L)
+{
+	((TArray<uint8>*)lua_touserdata(L, 1))->~TArray<uint8>();
+	return 0;
+}
+
+static int msgpackPack(lua_State* L)
+{
+	int n = lua_gettop(L);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &packBufferKey);
+	TArray<uint8>* buffer = (TArray<uint8>*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	buffer->Reset();
+	bool ok;
+	{
+		FString error;
+		ok = FLuaSerializer::pack(L, 1, n, *buffer, error);
+		if (!ok)
+			lua_pushstring(L, TCHAR_TO_UTF8(*error));
+	}
+	if (!ok)
+		return lua_error(L);
+	lua_pushlstring(L, (const char*)buffer->GetData(), buffer->Num());
+	// Do not keep a large buffer after a large message.
+	if (buffer->Max() > 64 * 1024)
+		buffer->Empty();
+	return 1;
+}
+
+static int msgpackUnpack(lua_State* L)
+{
+	size_t size;
+	const char* s = luaL_checklstring(L, 1, &size);
+	if (size > MAX_int32)
+		return luaL_error(L, "string too large");
+	int n;
+	{
+		FString error;
+		n = FLuaSerializer::unpack(L, (const uint8*)s, (int32)size, error);
+		if (n < 0)
+			lua_pushstring(L, TCHAR_TO_UTF8(*error));
+	}
+	if (n < 0)
+		return lua_error(L);
+	return n;
+}
+
+void FLuaSerializer::openLibrary(lua_State* L)
+{
+	new(lua_newuserdata(L, sizeof(TArray<uint8>))) TArray<uint8>();
+	lua_newtable(L);
+	lua_pushcfunction(L, packBufferGC);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &packBufferKey);
+
+	static const luaL_Reg funcs[] =
+	{
+		{ "pack", msgpackPack },
+		{ "unpack", msgpackUnpack },
+		{ nullptr, nullptr },
+	};
+	luaL_newlib(L, funcs);
+	lua_setglobal(L, "msgpack");
+}
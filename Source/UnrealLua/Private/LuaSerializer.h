@@ -0,0 +1,67 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "lua.hpp"
+
+class FLuaEnv;
+
+/**
+ * Binary serialization of lua values in MessagePack format, used to pass
+ * values between lua states.
+ * nil, booleans, integers, floats, strings, tables of them, and UObject and
+ * UStruct proxies are supported. Lazy strings are written as strings.
+ * Tables whose keys are exactly 1..n are written as arrays, other ones as maps.
+ * A table met again is written as a reference to its first occurrence, so
+ * shared tables and cycles are kept. References and proxies use extension
+ * types:
+ *  ExtRef		index of the table, by order of first occurrence from 0.
+ *  ExtUObject	path name of the object, unpacked to nil if it is not loaded.
+ *				Destroyed objects are packed as nil.
+ *  ExtUStruct	path name of the struct type, a zero byte, and the struct as
+ *				exported text.
+ * Proxies can only be unpacked into env states.
+ * Values are written straight to the output buffer and read straight from the
+ * input, without intermediate lua strings or tables.
+ */
+class FLuaSerializer
+{
+public:
+	/**
+	 * Append n values from stack index first to out.
+	 * @return false on unsupported values, with the reason in error.
+	 */
+	static bool pack(lua_State* L, int first, int n, TArray<uint8>& out, FString& error);
+
+	/**
+	 * Push all values serialized in data.
+	 * @return number of values pushed, -1 on malformed data with the reason in error.
+	 */
+	static int unpack(lua_State* L, const uint8* data, int32 size, FString& error);
+
+	/** Deeper tables are refused. */
+	enum { MaxDepth = 128 };
+
+	enum EExtType : int8
+	{
+		ExtRef = 1,
+		ExtUObject = 2,
+		ExtUStruct = 3,
+	};
+
+	/**
+	 * Open the "msgpack" lua table in L.
+	 * msgpack.pack(...)		string of the serialized values.
+	 * msgpack.unpack(s)		values serialized in s.
+	 */
+	static void openLibrary(lua_State* L);
+
+private:
+	struct FWriter;
+	struct FReader;
+
+	/** Env owning L, nullptr for other states, as the job workers'. */
+	static FLuaEnv* findLuaEnv(lua_State* L);
+	static void pushUObject(FLuaEnv* env, lua_State* L, UObject* obj);
+	/** Push a proxy of a new initialized struct, return the struct. */
+	static void* pushNewUStruct(FLuaEnv* env, lua_State* L, UScriptStruct* type);
+};
@@ -0,0 +1,731 @@
+#include "LuaSharedTable.h"
+#include "Misc/ScopeLock.h"
+
+FCriticalSection FLuaSharedTable::registryLock_;
+TMap<FString, FLuaSharedTable*> FLuaSharedTable::registry_;
+
+/**
+ * Registry key of the weak table of handle caches by graph, in each state.
+ * A cache is a weak table of handles by node index + 1, and the user value of
+ * all its handles. It also maps lua strings used as keys to their pooled
+ * string, and holds the string cache at 0.
+ */
+static char handleCachesKey;
+
+static const char* sharedTableMT = "LuaSharedTableMT";
+
+struct FLuaSharedTableHandle
+{
+	FLuaSharedTable* table;
+	int32 node;
+	/** Of the handle cache. */
+	FLuaSharedTable::FStringCache* strings;
+};
+
+FLuaSharedTable::FLuaSharedTable()
+{
+	refs_.Set(1);
+}
+
+void FLuaSharedTable::release()
+{
+	if (refs_.Decrement() == 0)
+		delete this;
+}
+
+SIZE_T FLuaSharedTable::memorySize() const
+{
+	return sizeof(*this) + nodes_.GetAllocatedSize() + values_.GetAllocatedSize() + entries_.GetAllocatedSize() + strings_.GetAllocatedSize()
+		+ stringKeys_.GetAllocatedSize() + stringHashes_.GetAllocatedSize() + stringSlots_.GetAllocatedSize();
+}
+
+void FLuaSharedTable::publish(const FString& name, FLuaSharedTable* table)
+{
+	FLuaSharedTable* prev;
+	{
+		FScopeLock lock(&registryLock_);
+		FLuaSharedTable*& slot = registry_.FindOrAdd(name);
+		prev = slot;
+		slot = table;
+	}
+	if (prev)
+		prev->release();
+}
+
+void FLuaSharedTable::unpublish(const FString& name)
+{
+	FLuaSharedTable* prev = nullptr;
+	{
+		FScopeLock lock(&registryLock_);
+		registry_.RemoveAndCopyValue(name, prev);
+	}
+	if (prev)
+		prev->release();
+}
+
+FLuaSharedTable* FLuaSharedTable::find(const FString& name)
+{
+	FScopeLock lock(&registryLock_);
+	FLuaSharedTable** table = registry_.Find(name);
+	if (!table)
+		return nullptr;
+	(*table)->addRef();
+	return *table;
+}
+
+uint32 FLuaSharedTable::hashString(const char* s, size_t len)
+{
+	// FNV-1a.
+	uint32 h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (uint8)s[i]) * 16777619u;
+	return h;
+}
+
+static inline uint32 hashBits(uint64 bits)
+{
+	return (uint32)((bits * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+uint32 FLuaSharedTable::hashValue(const FValue& v, const char* pool)
+{
+	switch (v.type)
+	{
+	case EType::Boolean:
+		return v.b ? 1 : 2;
+	case EType::Integer:
+		return hashBits((uint64)v.i);
+	case EType::Number:
+	{
+		uint64 bits;
+		FMemory::Memcpy(&bits, &v.n, sizeof(bits));
+		return hashBits(bits);
+	}
+	case EType::String:
+		return hashString(pool + v.s.offset, v.s.len);
+	default:
+		return 0;
+	}
+}
+
+int32 FLuaSharedTable::findSlot(const FNode& n, const FValue& key, uint32 hash) const
+{
+	if (n.hashMask < 0)
+		return -1;
+	const FEntry* entries = entries_.GetData() + n.hashFirst;
+	for (int32 slot = hash & n.hashMask; ; slot = (slot + 1) & n.hashMask)
+	{
+		const FEntry& e = entries[slot];
+		if (e.key.type == EType::Nil)
+			return -1;
+		if (e.key.type != key.type)
+			continue;
+		switch (key.type)
+		{
+		case EType::Boolean:
+			if (e.key.b == key.b)
+				return slot;
+			break;
+		case EType::Integer:
+			if (e.key.i == key.i)
+				return slot;
+			break;
+		case EType::Number:
+			if (e.key.n == key.n)
+				return slot;
+			break;
+		case EType::String:
+			// Equal strings are pooled once.
+			if (e.key.s.offset == key.s.offset)
+				return slot;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+int32 FLuaSharedTable::findString(lua_State* L, int idx, int cache, FStringCache* strings) const
+{
+	size_t len;
+	const char* s = lua_tolstring(L, idx, &len);
+	FStringCache::FSlot& cached = strings->slots[((UPTRINT)s >> 3) & (FStringCache::NumSlots - 1)];
+	if (cached.str == s)
+		return cached.id;
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, cache) == LUA_TNUMBER)
+	{
+		int32 id = (int32)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		cached.str = s;
+		cached.id = id;
+		return id;
+	}
+	lua_pop(L, 1);
+	if (stringSlots_.Num() == 0)
+		return -1;
+	int32 mask = stringSlots_.Num() - 1;
+	for (int32 slot = hashString(s, len) & mask; stringSlots_[slot] >= 0; slot = (slot + 1) & mask)
+	{
+		int32 id = stringSlots_[slot];
+		const FValue& v = stringKeys_[id];
+		if (v.s.len == len && FMemory::Memcmp(strings_.GetData() + v.s.offset, s, len) == 0)
+		{
+			lua_pushvalue(L, idx);
+			lua_pushinteger(L, id);
+			lua_rawset(L, cache);
+			cached.str = s;
+			cached.id = id;
+			return id;
+		}
+	}
+	// Not cached, strings missing from the pool are never keys.
+	return -1;
+}
+
+bool FLuaSharedTable::toKey(const FNode& n, lua_State* L, int idx, int cache, FStringCache* strings, FKey& out) const
+{
+	out.arrayPos = -1;
+	switch (lua_type(L, idx))
+	{
+	case LUA_TNUMBER:
+	{
+		lua_Integer i;
+		if (lua_isinteger(L, idx))
+			i = lua_tointeger(L, idx);
+		else
+		{
+			// Floats with an integer value are integer keys, as in tables.
+			lua_Number f = lua_tonumber(L, idx);
+			if (!lua_numbertointeger(f, &i) || (lua_Number)i != f)
+			{
+				out.key.type = EType::Number;
+				out.key.n = f;
+				out.hash = hashValue(out.key, nullptr);
+				return true;
+			}
+		}
+		if ((lua_Unsigned)i - 1u < (lua_Unsigned)n.arrayNum)
+			out.arrayPos = (int32)(i - 1);
+		out.key.type = EType::Integer;
+		out.key.i = i;
+		out.hash = hashValue(out.key, nullptr);
+		return true;
+	}
+	case LUA_TSTRING:
+	{
+		int32 id = findString(L, idx, cache, strings);
+		if (id < 0)
+			return false;
+		out.key = stringKeys_[id];
+		out.hash = stringHashes_[id];
+		return true;
+	}
+	case LUA_TBOOLEAN:
+		out.key.type = EType::Boolean;
+		out.key.b = lua_toboolean(L, idx) != 0;
+		out.hash = hashValue(out.key, nullptr);
+		return true;
+	default:
+		return false;
+	}
+}
+
+const FLuaSharedTable::FValue* FLuaSharedTable::find(const FNode& n, lua_State* L, int idx, int cache, FStringCache* strings) const
+{
+	FKey key;
+	if (!toKey(n, L, idx, cache, strings, key))
+		return nullptr;
+	if (key.arrayPos >= 0)
+		return &values_[n.arrayFirst + key.arrayPos];
+	int32 slot = findSlot(n, key.key, key.hash);
+	return slot < 0 ? nullptr : &entries_[n.hashFirst + slot].value;
+}
+
+bool FLuaSharedTable::next(const FNode& n, lua_State* L, int idx, int cache, FStringCache* strings)
+{
+	// Positions are the array part, then the hash slots.
+	int32 pos = 0;
+	if (!lua_isnil(L, idx))
+	{
+		FKey key;
+		int32 slot = -1;
+		if (toKey(n, L, idx, cache, strings, key))
+			slot = key.arrayPos >= 0 ? key.arrayPos : findSlot(n, key.key, key.hash);
+		if (slot < 0)
+			luaL_error(L, "invalid key to 'next'");
+		pos = key.arrayPos >= 0 ? slot + 1 : n.arrayNum + slot + 1;
+	}
+	if (pos < n.arrayNum)
+	{
+		lua_pushinteger(L, pos + 1);
+		pushValue(L, values_[n.arrayFirst + pos], cache);
+		return true;
+	}
+	for (int32 slot = pos - n.arrayNum; slot <= n.hashMask; slot++)
+	{
+		const FEntry& e = entries_[n.hashFirst + slot];
+		if (e.key.type != EType::Nil)
+		{
+			pushValue(L, e.key, cache);
+			pushValue(L, e.value, cache);
+			return true;
+		}
+	}
+	return false;
+}
+
+void FLuaSharedTable::pushValue(lua_State* L, const FValue& v, int cache)
+{
+	switch (v.type)
+	{
+	case EType::Boolean:
+		lua_pushboolean(L, v.b);
+		break;
+	case EType::Integer:
+		lua_pushinteger(L, v.i);
+		break;
+	case EType::Number:
+		lua_pushnumber(L, v.n);
+		break;
+	case EType::String:
+		lua_pushlstring(L, strings_.GetData() + v.s.offset, v.s.len);
+		break;
+	case EType::Table:
+	{
+		// Reuse the handle of the node in this state.
+		if (lua_rawgeti(L, cache, v.node + 1) == LUA_TNIL)
+		{
+			lua_pop(L, 1);
+			FLuaSharedTableHandle* h = (FLuaSharedTableHandle*)lua_newuserdata(L, sizeof(FLuaSharedTableHandle));
+			h->table = nullptr;
+			luaL_setmetatable(L, sharedTableMT);
+			h->table = this;
+			h->node = v.node;
+			lua_rawgeti(L, cache, 0);
+			h->strings = (FStringCache*)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+			addRef();
+			lua_pushvalue(L, cache);
+			lua_setuservalue(L, -2);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, cache, v.node + 1);
+		}
+		break;
+	}
+	default:
+		lua_pushnil(L);
+		break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+/************************************************************************/
+/* Building.                                                            */
+/************************************************************************/
+
+struct FLuaSharedTableBuilder
+{
+	typedef FLuaSharedTable::FValue FValue;
+	typedef FLuaSharedTable::EType EType;
+
+	lua_State* L;
+	FLuaSharedTable* table;
+	const char* error;
+
+	/** Node of each table built so far. */
+	TMap<const void*, int32> nodes;
+
+	bool makeString(int idx, FValue& out)
+	{
+		size_t len;
+		const char* s = lua_tolstring(L, idx, &len);
+		uint32 hash = FLuaSharedTable::hashString(s, len);
+		TArray<int32>& stringSlots = table->stringSlots_;
+		if (table->stringKeys_.Num() * 2 >= stringSlots.Num())
+		{
+			// Grow and rehash.
+			stringSlots.Init(-1, FMath::Max(64, stringSlots.Num() * 2));
+			int32 mask = stringSlots.Num() - 1;
+			for (int32 i = 0; i < table->stringKeys_.Num(); i++)
+			{
+				int32 slot = table->stringHashes_[i] & mask;
+				while (stringSlots[slot] >= 0)
+					slot = (slot + 1) & mask;
+				stringSlots[slot] = i;
+			}
+		}
+		int32 mask = stringSlots.Num() - 1;
+		int32 slot = hash & mask;
+		for (; stringSlots[slot] >= 0; slot = (slot + 1) & mask)
+		{
+			const FValue& v = table->stringKeys_[stringSlots[slot]];
+			if (v.s.len == len && FMemory::Memcmp(table->strings_.GetData() + v.s.offset, s, len) == 0)
+			{
+				out = v;
+				return true;
+			}
+		}
+		if (len > (size_t)(MAX_int32 - table->strings_.Num()))
+		{
+			error = "strings too large";
+			return false;
+		}
+		out.type = EType::String;
+		out.s.offset = (uint32)table->strings_.Num();
+		out.s.len = (uint32)len;
+		table->strings_.AddUninitialized((int32)len);
+		FMemory::Memcpy(table->strings_.GetData() + out.s.offset, s, len);
+		stringSlots[slot] = table->stringKeys_.Add(out);
+		table->stringHashes_.Add(hash);
+		return true;
+	}
+
+	bool makeKey(int idx, FValue& out)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TNUMBER:
+			// Lua already turned floats with an integer value into integers.
+			if (lua_isinteger(L, idx))
+			{
+				out.type = EType::Integer;
+				out.i = lua_tointeger(L, idx);
+			}
+			else
+			{
+				out.type = EType::Number;
+				out.n = lua_tonumber(L, idx);
+			}
+			return true;
+		case LUA_TBOOLEAN:
+			out.type = EType::Boolean;
+			out.b = lua_toboolean(L, idx) != 0;
+			return true;
+		case LUA_TSTRING:
+			return makeString(idx, out);
+		default:
+			error = "unsupported key type";
+			return false;
+		}
+	}
+
+	bool makeValue(int idx, int depth, FValue& out)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TTABLE:
+			out.type = EType::Table;
+			return makeNode(idx, depth + 1, out.node);
+		case LUA_TNUMBER:
+		case LUA_TBOOLEAN:
+		case LUA_TSTRING:
+			return makeKey(idx, out);
+		default:
+			error = "unsupported value type";
+			return false;
+		}
+	}
+
+	bool makeNode(int idx, int depth, int32& outNode)
+	{
+		const void* t = lua_topointer(L, idx);
+		if (int32* node = nodes.Find(t))
+		{
+			outNode = *node;
+			return true;
+		}
+		if (depth >= FLuaSharedTable::MaxDepth)
+		{
+			error = "table too deep";
+			return false;
+		}
+		if (!lua_checkstack(L, 4))
+		{
+			error = "stack overflow";
+			return false;
+		}
+		outNode = table->nodes_.AddUninitialized();
+		nodes.Add(t, outNode);
+
+		// Array part, keys 1..n.
+		int32 arrayNum = 0;
+		while (arrayNum < MAX_int32 && lua_rawgeti(L, idx, arrayNum + 1) != LUA_TNIL)
+		{
+			lua_pop(L, 1);
+			arrayNum++;
+		}
+		lua_pop(L, 1);
+		int32 arrayFirst = table->values_.AddUninitialized(arrayNum);
+		for (int32 i = 0; i < arrayNum; i++)
+		{
+			lua_rawgeti(L, idx, i + 1);
+			FValue v;
+			if (!makeValue(lua_gettop(L), depth, v))
+				return false;
+			table->values_[arrayFirst + i] = v;
+			lua_pop(L, 1);
+		}
+
+		// Hash part, sized as in lua with a free slot at least to end probes.
+		int32 count = 0;
+		lua_pushnil(L);
+		while (lua_next(L, idx) != 0)
+		{
+			lua_pop(L, 1);
+			if (!isArrayKey(-1, arrayNum))
+				count++;
+		}
+		int32 hashFirst = table->entries_.Num();
+		int32 hashMask = -1;
+		if (count > 0)
+		{
+			int32 capacity = (int32)FMath::RoundUpToPowerOfTwo(count + 1);
+			hashMask = capacity - 1;
+			table->entries_.AddZeroed(capacity);
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0)
+			{
+				if (isArrayKey(-2, arrayNum))
+				{
+					lua_pop(L, 1);
+					continue;
+				}
+				int top = lua_gettop(L);
+				FValue key;
+				FValue value;
+				if (!makeKey(top - 1, key) || !makeValue(top, depth, value))
+					return false;
+				lua_pop(L, 1);
+				uint32 hash = FLuaSharedTable::hashValue(key, table->strings_.GetData());
+				FLuaSharedTable::FEntry* entries = table->entries_.GetData() + hashFirst;
+				int32 slot = hash & hashMask;
+				while (entries[slot].key.type != EType::Nil)
+					slot = (slot + 1) & hashMask;
+				entries[slot].key = key;
+				entries[slot].value = value;
+			}
+		}
+
+		FLuaSharedTable::FNode& node = table->nodes_[outNode];
+		node.arrayFirst = arrayFirst;
+		node.arrayNum = arrayNum;
+		node.hashFirst = hashFirst;
+		node.hashMask = hashMask;
+		return true;
+	}
+
+	bool isArrayKey(int idx, int32 arrayNum)
+	{
+		return lua_isinteger(L, idx) && (lua_Unsigned)lua_tointeger(L, idx) - 1u < (lua_Unsigned)arrayNum;
+	}
+};
+
+FLuaSharedTable* FLuaSharedTable::build(lua_State* L, int idx, FString& error)
+{
+	idx = lua_absindex(L, idx);
+	int top = lua_gettop(L);
+	FLuaSharedTableBuilder b;
+	b.L = L;
+	b.table = new FLuaSharedTable();
+	b.error = nullptr;
+	int32 root;
+	if (!b.makeNode(idx, 0, root))
+	{
+		error = FString::Printf(TEXT("can not share table, %s"), UTF8_TO_TCHAR(b.error));
+		lua_settop(L, top);
+		b.table->release();
+		return nullptr;
+	}
+	b.table->nodes_.Shrink();
+	b.table->values_.Shrink();
+	b.table->entries_.Shrink();
+	b.table->strings_.Shrink();
+	b.table->stringKeys_.Shrink();
+	b.table->stringHashes_.Shrink();
+	return b.table;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/************************************************************************/
+/* Lua library.                                                         */
+/************************************************************************/
+
+static int sharedTableIndex(lua_State* L)
+{
+	FLuaSharedTableHandle* h = (FLuaSharedTableHandle*)lua_touserdata(L, 1);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	const FLuaSharedTable::FValue* v = h->table->find(h->table->node(h->node), L, 2, 3, h->strings);
+	if (!v)
+		return 0;
+	h->table->pushValue(L, *v, 3);
+	return 1;
+}
+
+static int sharedTableNewIndex(lua_State* L)
+{
+	return luaL_error(L, "attempt to modify a shared table");
+}
+
+static int sharedTableLen(lua_State* L)
+{
+	FLuaSharedTableHandle* h = (FLuaSharedTableHandle*)lua_touserdata(L, 1);
+	lua_pushinteger(L, h->table->node(h->node).arrayNum);
+	return 1;
+}
+
+static int sharedTableNext(lua_State* L)
+{
+	FLuaSharedTableHandle* h = (FLuaSharedTableHandle*)luaL_checkudata(L, 1, sharedTableMT);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	if (!h->table->next(h->table->node(h->node), L, 2, 3, h->strings))
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	return 2;
+}
+
+static int sharedTablePairs(lua_State* L)
+{
+	lua_pushcfunction(L, sharedTableNext);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int sharedTableToString(lua_State* L)
+{
+	FLuaSharedTableHandle* h = (FLuaSharedTableHandle*)lua_touserdata(L, 1);
+	lua_pushfstring(L, "sharedtable: %p", &h->table->node(h->node));
+	return 1;
+}
+
+static int sharedTableGC(lua_State* L)
+{
+	FLuaSharedTableHandle* h = (FLuaSharedTableHandle*)lua_touserdata(L, 1);
+	if (h->table)
+	{
+		h->table->release();
+		h->table = nullptr;
+	}
+	return 0;
+}
+
+/** Push the root handle of table, taking over the reference of the caller. */
+static void pushRoot(lua_State* L, FLuaSharedTable* table)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &handleCachesKey);
+	if (lua_rawgetp(L, -1, table) == LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_getmetatable(L, -2); // weak value metatable.
+		lua_setmetatable(L, -2);
+		FLuaSharedTable::FStringCache* strings = (FLuaSharedTable::FStringCache*)lua_newuserdata(L, sizeof(FLuaSharedTable::FStringCache));
+		FMemory::Memzero(strings, sizeof(*strings));
+		// Values are weak, also a key to keep it alive.
+		lua_pushvalue(L, -1);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -4);
+		lua_rawseti(L, -2, 0);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, -3, table);
+	}
+	FLuaSharedTable::FValue root;
+	root.type = FLuaSharedTable::EType::Table;
+	root.node = 0;
+	table->pushValue(L, root, lua_gettop(L));
+	table->release();
+	//=========================================
+	//=>caches
+	//=>cache
+	//=>root
+	//=========================================
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+static int sharedTablesPublish(lua_State* L)
+{
+	const char* name = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	FLuaSharedTable* table;
+	{
+		FString error;
+		table = FLuaSharedTable::build(L, 2, error);
+		if (!table)
+			lua_pushstring(L, TCHAR_TO_UTF8(*error));
+	}
+	if (!table)
+		return lua_error(L);
+	table->addRef();
+	FLuaSharedTable::publish(UTF8_TO_TCHAR(name), table);
+	pushRoot(L, table);
+	return 1;
+}
+
+static int sharedTablesGet(lua_State* L)
+{
+	FLuaSharedTable* table = FLuaSharedTable::find(UTF8_TO_TCHAR(luaL_checkstring(L, 1)));
+	if (!table)
+		return 0;
+	pushRoot(L, table);
+	return 1;
+}
+
+static int sharedTablesUnpublish(lua_State* L)
+{
+	FLuaSharedTable::unpublish(UTF8_TO_TCHAR(luaL_checkstring(L, 1)));
+	return 0;
+}
+
+static int sharedTablesMemory(lua_State* L)
+{
+	FLuaSharedTable* table = FLuaSharedTable::find(UTF8_TO_TCHAR(luaL_checkstring(L, 1)));
+	if (!table)
+		return 0;
+	lua_pushinteger(L, (lua_Integer)table->memorySize());
+	table->release();
+	return 1;
+}
+
+void FLuaSharedTable::openLibrary(lua_State* L)
+{
+	static const luaL_Reg metamethods[] =
+	{
+		{ "__index", sharedTableIndex },
+		{ "__newindex", sharedTableNewIndex },
+		{ "__len", sharedTableLen },
+		{ "__pairs", sharedTablePairs },
+		{ "__tostring", sharedTableToString },
+		{ "__gc", sharedTableGC },
+		{ nullptr, nullptr },
+	};
+	luaL_newmetatable(L, sharedTableMT);
+	luaL_setfuncs(L, metamethods, 0);
+	// Hide the metatable, metamethods trust their first argument.
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	lua_newtable(L); // metatable.
+	lua_pushstring(L, "v");
+	lua_setfield(L, -2, "__mode"); // weak value table.
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &handleCachesKey);
+
+	static const luaL_Reg funcs[] =
+	{
+		{ "publish", sharedTablesPublish },
+		{ "get", sharedTablesGet },
+		{ "unpublish", sharedTablesUnpublish },
+		{ "memory", sharedTablesMemory },
+		{ nullptr, nullptr },
+	};
+	luaL_newlib(L, funcs);
+	lua_setglobal(L, "sharedtables");
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "lua.hpp"
+
+/**
+ * Frozen graph of lua tables, built once from a lua table into native
+ * arrays and read in place by any lua state of the process, whatever its
+ * thread, through userdata handles.
+ * Handles behave as read-only tables: indexing, #, pairs and ipairs work,
+ * assignments raise an error. Reading a nested table gives the handle of its
+ * node, one per node and state, so equal tables stay equal. The graph is not
+ * traversed by the GC of the states, handles keep it alive.
+ * Values are nil, booleans, numbers, strings and tables; shared subtables and
+ * cycles are kept. Keys are booleans, numbers and strings.
+ * Tables are split as in lua: keys 1..n in an array, the others in an open
+ * addressing hash. Equal strings are stored once, with their hash: a lua
+ * string used as a key is looked up in the pool once per state and cached
+ * by address, keys are then compared by their offset in the pool.
+ */
+class FLuaSharedTable
+{
+public:
+	/**
+	 * Build from the table at idx.
+	 * @return nullptr on unsupported values, with the reason in error.
+	 */
+	static FLuaSharedTable* build(lua_State* L, int idx, FString& error);
+
+	/** Publish table under name, releasing the previous one. */
+	static void publish(const FString& name, FLuaSharedTable* table);
+	static void unpublish(const FString& name);
+	/** Find table published under name, with a reference for the caller. */
+	static FLuaSharedTable* find(const FString& name);
+
+	void addRef() { refs_.Increment(); }
+	void release();
+
+	/** Bytes used by the graph. */
+	SIZE_T memorySize() const;
+
+	/**
+	 * Open the "sharedtables" lua table in L.
+	 * sharedtables.publish(name, t)	build a frozen copy of t, published under name.
+	 * sharedtables.get(name)			root of the table published under name, nil if none.
+	 * sharedtables.unpublish(name)	handles got before keep the table alive.
+	 * sharedtables.memory(name)		bytes used by the table published under name.
+	 */
+	static void openLibrary(lua_State* L);
+
+	enum { MaxDepth = 128 };
+
+	enum class EType : uint8
+	{
+		Nil,
+		Boolean,
+		Integer,
+		Number,
+		String,
+		Table,
+	};
+
+	struct FValue
+	{
+		EType type;
+		union
+		{
+			bool b;
+			lua_Integer i;
+			lua_Number n;
+			/** Offset in the string pool, and length. */
+			struct { uint32 offset; uint32 len; } s;
+			int32 node;
+		};
+	};
+
+	struct FEntry
+	{
+		FValue key;
+		FValue value;
+	};
+
+	struct FNode
+	{
+		/** Values of keys 1..arrayNum in values_. */
+		int32 arrayFirst;
+		int32 arrayNum;
+		/** Other keys in entries_, no hash part if hashMask is -1. */
+		int32 hashFirst;
+		int32 hashMask;
+	};
+
+	/**
+	 * Pooled strings of lua strings used as keys in a state, by address.
+	 * The strings are also keys of the handle cache, which keeps them alive.
+	 */
+	struct FStringCache
+	{
+		enum { NumSlots = 128 };
+		struct FSlot
+		{
+			const char* str;
+			int32 id;
+		};
+		FSlot slots[NumSlots];
+	};
+
+	const FNode& node(int32 i) const { return nodes_[i]; }
+	/**
+	 * Value of the key at idx in L, nullptr if absent. cache is the absolute
+	 * stack index of the handle cache of the graph in L, the user value of
+	 * its handles, and strings its string cache.
+	 */
+	const FValue* find(const FNode& n, lua_State* L, int idx, int cache, FStringCache* strings) const;
+	/** Push v, tables as their handle. */
+	void pushValue(lua_State* L, const FValue& v, int cache);
+	/**
+	 * Push key and value following the key at idx in L, false at the end.
+	 * Raises an error if the key is not in the table, as next does.
+	 */
+	bool next(const FNode& n, lua_State* L, int idx, int cache, FStringCache* strings);
+
+private:
+	FLuaSharedTable();
+
+	/** Lookup key made from a lua value. */
+	struct FKey
+	{
+		FValue key;
+		uint32 hash;
+		/** Index in the array part, -1 if the key is not there. */
+		int32 arrayPos;
+	};
+	/** false if the value at idx can not be a key, or is a string not in the pool. */
+	bool toKey(const FNode& n, lua_State* L, int idx, int cache, FStringCache* strings, FKey& out) const;
+	/** Pooled string of the lua string at idx, -1 if none. */
+	int32 findString(lua_State* L, int idx, int cache, FStringCache* strings) const;
+
+	/** Slot of key in the hash part of n, -1 if absent. */
+	int32 findSlot(const FNode& n, const FValue& key, uint32 hash) const;
+	static uint32 hashString(const char* s, size_t len);
+	static uint32 hashValue(const FValue& v, const char* pool);
+
+	TArray<FNode> nodes_;
+	TArray<FValue> values_;
+	TArray<FEntry> entries_;
+	TArray<char> strings_;
+	/** Each pooled string, its hash, and an open addressing set of them. */
+	TArray<FValue> stringKeys_;
+	TArray<uint32> stringHashes_;
+	TArray<int32> stringSlots_;
+
+	FThreadSafeCounter refs_;
+	static FCriticalSection registryLock_;
+	static TMap<FString, FLuaSharedTable*> registry_;
+
+	friend struct FLuaSharedTableBuilder;
+};
@@ -0,0 +1,269 @@
+#include "LuaTickBatch.h"
+#include "LuaEnv.h"
+#include "LuaProxy.h"
+#include "Engine/World.h"
+#include "Engine/Level.h"
+
+void FLuaBatchTickFunction::ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+{
+	batch->dispatch(world, TickGroup, DeltaTime);
+}
+
+FString FLuaBatchTickFunction::DiagnosticMessage()
+{
+	return FString::Printf(TEXT("FLuaBatchTickFunction[%s, %d]"), *world->GetName(), (int32)TickGroup.GetValue());
+}
+
+FLuaTickBatch::FLuaTickBatch(FLuaEnv* luaEnv, lua_State* L):
+	luaEnv_(luaEnv),
+	luaState_(L)
+{
+	for (int32 i = 0; i < NumGroups; i++)
+		handlerRefs_[i] = LUA_NOREF;
+	worldCleanupHandle_ = FWorldDelegates::OnWorldCleanup.AddRaw(this, &FLuaTickBatch::onWorldCleanup);
+}
+
+FLuaTickBatch::~FLuaTickBatch()
+{
+	FWorldDelegates::OnWorldCleanup.Remove(worldCleanupHandle_);
+	// The lua state is closed next, objects go with it.
+	for (auto& it : worlds_)
+		releaseWorld(nullptr, it.Value);
+}
+
+FLuaTickBatch::FWorldBatch* FLuaTickBatch::findOrAddWorld(UWorld* world)
+{
+	FWorldBatch*& w = worlds_.FindOrAdd(world);
+	if (w)
+		return w;
+	w = new FWorldBatch();
+	lua_State* L = luaState_;
+	for (int32 i = 0; i < NumGroups; i++)
+	{
+		FGroup& g = w->groups[i];
+		g.tickFunction.batch = this;
+		g.tickFunction.world = world;
+		g.tickFunction.TickGroup = (ETickingGroup)i;
+		g.tickFunction.bCanEverTick = true;
+		g.tickFunction.bStartWithTickEnabled = true;
+		lua_newtable(L);
+		g.objsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_newtable(L);
+		g.indexRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		g.num = 0;
+		g.holes = 0;
+		g.dispatching = false;
+	}
+	return w;
+}
+
+void FLuaTickBatch::onWorldCleanup(UWorld* world, bool sessionEnded, bool cleanupResources)
+{
+	FWorldBatch* w = nullptr;
+	if (worlds_.RemoveAndCopyValue(world, w))
+		releaseWorld(luaState_, w);
+}
+
+void FLuaTickBatch::releaseWorld(lua_State* L, FWorldBatch* w)
+{
+	for (FGroup& g : w->groups)
+	{
+		if (g.tickFunction.IsTickFunctionRegistered())
+			g.tickFunction.UnRegisterTickFunction();
+		if (L)
+		{
+			luaL_unref(L, LUA_REGISTRYINDEX, g.objsRef);
+			luaL_unref(L, LUA_REGISTRYINDEX, g.indexRef);
+		}
+	}
+	delete w;
+}
+
+void FLuaTickBatch::setHandler(lua_State* L, ETickingGroup group, int idx)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, handlerRefs_[group]);
+	handlerRefs_[group] = LUA_NOREF;
+	if (!lua_isnil(L, idx))
+	{
+		lua_pushvalue(L, idx);
+		handlerRefs_[group] = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+}
+
+bool FLuaTickBatch::add(lua_State* L, ETickingGroup group, UObject* obj, int idx)
+{
+	UWorld* world = obj->GetWorld();
+	if (!world || !world->PersistentLevel)
+		return false;
+	FGroup& g = findOrAddWorld(world)->groups[group];
+	if (!g.tickFunction.IsTickFunctionRegistered())
+		g.tickFunction.RegisterTickFunction(world->PersistentLevel);
+
+	idx = lua_absindex(L, idx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.objsRef);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.indexRef);
+	//=========================================
+	//=>objs
+	//=>index
+	//=========================================
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, -2) == LUA_TNIL)
+	{
+		g.num++;
+		lua_pushvalue(L, idx);
+		lua_rawseti(L, -4, g.num);
+		lua_pushvalue(L, idx);
+		lua_pushinteger(L, g.num);
+		lua_rawset(L, -4);
+	}
+	lua_pop(L, 3);
+	return true;
+}
+
+bool FLuaTickBatch::remove(lua_State* L, ETickingGroup group, int idx)
+{
+	// The object may have left its world, look in all of them.
+	for (auto& it : worlds_)
+	{
+		if (removeFrom(L, it.Value->groups[group], idx))
+			return true;
+	}
+	return false;
+}
+
+bool FLuaTickBatch::removeFrom(lua_State* L, FGroup& g, int idx)
+{
+	idx = lua_absindex(L, idx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.objsRef);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.indexRef);
+	int objs = lua_absindex(L, -2);
+	int index = lua_absindex(L, -1);
+	lua_pushvalue(L, idx);
+	lua_rawget(L, index);
+	lua_Integer slot = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (slot == 0)
+	{
+		lua_pop(L, 2);
+		return false;
+	}
+
+	lua_pushvalue(L, idx);
+	lua_pushnil(L);
+	lua_rawset(L, index);
+	if (g.dispatching)
+	{
+		// Keep slots of the running dispatch, compacted after it.
+		lua_pushboolean(L, 0);
+		lua_rawseti(L, objs, slot);
+		g.holes++;
+	}
+	else
+	{
+		// Move last object to the slot.
+		lua_rawgeti(L, objs, g.num);
+		lua_pushnil(L);
+		lua_rawseti(L, objs, g.num);
+		g.num--;
+		if (slot <= g.num)
+		{
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, objs, slot);
+			lua_pushinteger(L, slot);
+			lua_rawset(L, index);
+		}
+		else
+			lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	return true;
+}
+
+void FLuaTickBatch::dispatch(UWorld* world, ETickingGroup group, float deltaSeconds)
+{
+	FWorldBatch** w = worlds_.Find(world);
+	if (!w || handlerRefs_[group] == LUA_NOREF)
+		return;
+	FGroup& g = (*w)->groups[group];
+	removeDestroyed(g);
+	if (g.num == 0)
+		return;
+	lua_rawgeti(luaState_, LUA_REGISTRYINDEX, handlerRefs_[group]);
+	lua_rawgeti(luaState_, LUA_REGISTRYINDEX, g.objsRef);
+	lua_pushinteger(luaState_, g.num);
+	lua_pushnumber(luaState_, deltaSeconds);
+	g.dispatching = true;
+	luaEnv_->pcall(3, 0);
+	g.dispatching = false;
+	if (g.holes > 0)
+		compact(g);
+}
+
+void FLuaTickBatch::removeDestroyed(FGroup& g)
+{
+	lua_State* L = luaState_;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.objsRef);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.indexRef);
+	int objs = lua_absindex(L, -2);
+	int index = lua_absindex(L, -1);
+	for (int32 i = 1; i <= g.num; i++)
+	{
+		lua_rawgeti(L, objs, i);
+		FUObjectProxy* p = (FUObjectProxy*)lua_touserdata(L, -1);
+		if (p && !p->ptr)
+		{
+			lua_pushnil(L);
+			lua_rawset(L, index);
+			lua_pushboolean(L, 0);
+			lua_rawseti(L, objs, i);
+			g.holes++;
+		}
+		else
+			lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	if (g.holes > 0)
+		compact(g);
+}
+
+void FLuaTickBatch::compact(FGroup& g)
+{
+	lua_State* L = luaState_;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.objsRef);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, g.indexRef);
+	int objs = lua_absindex(L, -2);
+	int index = lua_absindex(L, -1);
+	int32 i = 1;
+	while (i <= g.num)
+	{
+		lua_rawgeti(L, objs, i);
+		bool hole = !lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (!hole)
+		{
+			i++;
+			continue;
+		}
+		// Fill the hole with the last slot, which may be a hole too.
+		lua_rawgeti(L, objs, g.num);
+		lua_pushnil(L);
+		lua_rawseti(L, objs, g.num);
+		g.num--;
+		if (i <= g.num)
+		{
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, objs, i);
+			if (lua_toboolean(L, -1))
+			{
+				lua_pushinteger(L, i);
+				lua_rawset(L, index);
+			}
+			else
+				lua_pop(L, 1);
+		}
+		else
+			lua_pop(L, 1);
+	}
+	g.holes = 0;
+	lua_pop(L, 2);
+}
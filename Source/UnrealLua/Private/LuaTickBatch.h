@@ -0,0 +1,91 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "Engine/EngineBaseTypes.h"
+#include "lua.hpp"
+
+class FLuaTickBatch;
+class UWorld;
+
+/** Tick function of a tick group in a world, ticking all objects of the group there. */
+struct FLuaBatchTickFunction : public FTickFunction
+{
+	FLuaTickBatch* batch;
+	UWorld* world;
+
+	/** FTickFunction Interface */
+	virtual void ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent) override;
+	virtual FString DiagnosticMessage() override;
+};
+
+/**
+ * Objects ticked by lua, batched per world and tick group: each group of a
+ * world makes a single lua call per frame, handler(objects, n, deltaSeconds),
+ * objects[1..n] being the proxies of the objects registered there.
+ * The tick functions of a world are registered in its persistent level, so
+ * its pause and time dilation apply, and are dropped with their objects when
+ * the world is cleaned up.
+ * The objects array lives in lua and is kept up to date on registration, so
+ * ticking pushes nothing per object. Registration and unregistration are
+ * O(1); during a dispatch an unregistered object leaves false in its slot
+ * (compacted after the call) and a registered one is appended after n.
+ * Objects destroyed since, whose proxy is cleared, are removed before each
+ * dispatch.
+ */
+class FLuaTickBatch
+{
+public:
+	FLuaTickBatch(FLuaEnv* luaEnv, lua_State* L);
+	~FLuaTickBatch();
+
+	/** Groups objects can be registered to. */
+	static bool isValidGroup(lua_Integer group) { return group >= 0 && group < NumGroups; }
+
+	/** Set handler of group to the function at idx, or nil. */
+	void setHandler(lua_State* L, ETickingGroup group, int idx);
+	/**
+	 * Register obj, whose proxy is at idx, to group in the world of obj.
+	 * @return false if obj has no world.
+	 */
+	bool add(lua_State* L, ETickingGroup group, UObject* obj, int idx);
+	/** Unregister proxy at idx from group, false if it was not registered. */
+	bool remove(lua_State* L, ETickingGroup group, int idx);
+
+	void dispatch(UWorld* world, ETickingGroup group, float deltaSeconds);
+
+private:
+	enum { NumGroups = TG_NewlySpawned };
+
+	struct FGroup
+	{
+		FLuaBatchTickFunction tickFunction;
+		/** Array of proxies. */
+		int objsRef;
+		/** Proxy to its slot in objs. */
+		int indexRef;
+		int32 num;
+		int32 holes;
+		bool dispatching;
+	};
+
+	struct FWorldBatch
+	{
+		FGroup groups[NumGroups];
+	};
+
+	FWorldBatch* findOrAddWorld(UWorld* world);
+	void onWorldCleanup(UWorld* world, bool sessionEnded, bool cleanupResources);
+	/** Unregister the tick functions of w, and release its objects if L. */
+	void releaseWorld(lua_State* L, FWorldBatch* w);
+
+	bool removeFrom(lua_State* L, FGroup& g, int idx);
+	/** Turn the slots of destroyed objects into holes. */
+	void removeDestroyed(FGroup& g);
+	void compact(FGroup& g);
+
+	FLuaEnv* luaEnv_;
+	lua_State* luaState_;
+	int handlerRefs_[NumGroups];
+	TMap<UWorld*, FWorldBatch*> worlds_;
+	FDelegateHandle worldCleanupHandle_;
+};
@@ -2,12 +2,28 @@
 
 #include "UnrealLua.h"
 #include "GCObject.h"
+#include "Engine/EngineBaseTypes.h"
 #include "lua.hpp"
 
+class FLuaProfiler;
+class FLuaCrossingStats;
+class FLuaAllocProfiler;
+class FLuaScheduler;
+class FLuaTickBatch;
+class FLuaJobPool;
+class FLuaActorPool;
+class FLuaOverrides;
+class FLuaHotReload;
+class UMulticastDelegateProperty;
+class UWorld;
+struct FFrame;
+
 class UNREALLUA_API FLuaEnv : public FGCObject
 {
 public:
 	friend class FLuaObject;
+	friend class FLuaSerializer;
+	friend class FLuaOverrides;
 
 	FLuaEnv();
 	~FLuaEnv();
@@ -22,6 +38,7 @@ public:
 	lua_Number	toNumber(int idx)	{ return lua_tonumber(luaState_, idx); }
 	lua_Integer	toInteger(int idx)	{ return lua_tointeger(luaState_, idx); }
 	bool		toBoolean(int idx)	{ return lua_toboolean(luaState_, idx); }
+	void		pop(int n = 1)		{ lua_pop(luaState_, n); }
 	UObject*	toUObject(int idx, UClass* cls, bool check);
 	void*		toUStruct(int idx, UScriptStruct* structType, bool check);
 	FString		toFString(int idx, bool check);
@@ -44,6 +61,9 @@ public:
 	void pushFString(const FString& str);
 	void pushFText(const FText& txt);
 	void pushFName(FName name);
+	/** Push a lazy string keeping str, see enableLazyStrings. */
+	void pushLazyFString(const FString& str);
+	void pushLazyFText(const FText& txt);
 
 	void pushPropertyValue(void* obj, UProperty* prop);
 
@@ -53,19 +73,175 @@ public:
 	bool loadString(const char* s);
 	bool pcall(int n, int r);
 
+	//////////////////////////////////////////////////////////////////////////
+	// Profiling.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Start sampling lua call stacks, discarding previous samples.
+	 * @param sampleIntervalUs time between two samples, in microseconds.
+	 * @param maxSamples samples kept, older ones are overwritten.
+	 * @return false if a debug hook is set, the profiler leaves them alone.
+	 */
+	bool startProfiler(int32 sampleIntervalUs = 1000, int32 maxSamples = 16384);
+	void stopProfiler();
+	/** Write samples taken so far to a file, in folded-stack format for flame graphs. */
+	bool dumpProfiler(const FString& filename);
+
+	/**
+	 * Count calls and time of lua to cpp crossings per UFunction and per property,
+	 * shown by "stat UnrealLua".
+	 */
+	void enableCrossingStats(bool enable);
+	/** Write crossing stats gathered since the last dump as CSV. */
+	bool dumpCrossingStats(const FString& filename);
+
+	/**
+	 * Start sampling lua allocations by source line, discarding previous samples.
+	 * @param sampleBytes average allocated bytes between two samples.
+	 */
+	void startAllocProfiler(int32 sampleBytes = 64 * 1024);
+	/** Stop sampling, samples are discarded. */
+	void stopAllocProfiler();
+	/** Write total and live bytes per allocation site as CSV. */
+	bool dumpAllocProfiler(const FString& filename);
+
+	//////////////////////////////////////////////////////////////////////////
+	// Strings.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Read FString and FText properties and return values as lazy strings,
+	 * also set by strings.lazy([enable]) which returns the previous setting.
+	 * A lazy string keeps the native value, passed as is to a FString, FText or
+	 * FName parameter or property, and is converted to a lua string once when
+	 * lua needs its bytes: tostring, .., #, <, <=, == with a lua string, table
+	 * keys, string methods and C functions reading strings, as string.find.
+	 * == compares two lazy strings without converting them. rawget, rawset
+	 * and rawequal see the userdata. Keys of maps and sets are lua strings.
+	 */
+	void enableLazyStrings(bool enable) { lazyStrings_ = enable; }
+
+	//////////////////////////////////////////////////////////////////////////
+	// Logging.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * print and the "log" table queue lines for a background thread, shared
+	 * with job workers, that passes them to GLog, see FLuaLogSink.
+	 * log.info(fmt, ...)			line of category UnrealLua, formatted by
+	 *								string.format; also error, warning, display,
+	 *								verbose and veryVerbose.
+	 * log.category(name)			the same functions for log category name.
+	 * log.setRateLimit(n)			drop lines over n per second, 0 for no limit.
+	 * log.stats()					lines written, dropped with the buffer full, and
+	 *								dropped by rate limits.
+	 */
+
+	//////////////////////////////////////////////////////////////////////////
+	// Scheduler.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Resume coroutines waiting on the "scheduler" lua table, and call back
+	 * completed jobs. Called once per frame by the core ticker.
+	 * scheduler.start(f, ...)				run f in a new coroutine.
+	 * scheduler.wait(seconds)				resume after seconds.
+	 * scheduler.waitFrame()				resume next frame.
+	 * scheduler.waitDelegate(obj, name)	resume when multicast delegate obj.name fires,
+	 *										returning its parameters.
+	 * Coroutines waiting on the scheduler must not be resumed by other means.
+	 */
+	bool tick(float deltaSeconds);
+
+	//////////////////////////////////////////////////////////////////////////
+	// Jobs.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Lua functions run on worker threads, see FLuaJobPool.
+	 * jobs.run(f, ...)					run f(...) on a worker from a coroutine, which
+	 *									waits for it and gets true and its results, or
+	 *									false and an error message.
+	 * jobs.submit(f, callback, ...)	run f(...) on a worker, callback gets the same
+	 *									values in a later frame.
+	 * f may have no upvalue but _ENV, and arguments and results are copied,
+	 * see FLuaSerializer for the types supported.
+	 */
+
+	//////////////////////////////////////////////////////////////////////////
+	// Batched tick.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Objects ticked from lua in one call per world and tick group, see
+	 * FLuaTickBatch.
+	 * batchTick.setHandler(group, function(objects, n, deltaSeconds) end)
+	 * batchTick.register(obj[, group])
+	 * batchTick.unregister(obj[, group])
+	 * Groups are batchTick.PrePhysics (default), StartPhysics, DuringPhysics,
+	 * EndPhysics, PostPhysics, PostUpdateWork and LastDemotable.
+	 */
+
+	//////////////////////////////////////////////////////////////////////////
+	// Construction.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Calling a class or struct proxy constructs one:
+	 * ActorClass(worldContext[, transform | location[, rotation]])	spawn an actor.
+	 * Class([outer[, name]])			new object, in the transient package by default.
+	 * Struct([struct | {field = value, ...}])	new struct, copied or initialized by fields.
+	 * findObject(name)					class, struct or other object by name, or
+	 *									loaded by path name.
+	 * Actors can be pooled per class, see FLuaActorPool:
+	 * actorPool.spawn(cls, worldContext[, transform | location[, rotation]])
+	 *									pooled actor or a new one, and whether it is reused.
+	 * actorPool.release(actor)			deactivate and pool actor.
+	 * actorPool.clear([cls])			destroy pooled actors.
+	 * actorPool.num(cls)				pooled actors of cls.
+	 */
+
+	//////////////////////////////////////////////////////////////////////////
+	// Event overrides.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Blueprint events of classes implemented in lua, see FLuaOverrides.
+	 * overrides.bind(cls, t)	override each event of cls named by a key of t with
+	 *							its function, called as f(self, ...) and returning
+	 *							the return value then out parameters, as calls do.
+	 * overrides.unbind(cls)	restore the events of cls, once the overridden
+	 *							events running have returned.
+	 */
+
+	//////////////////////////////////////////////////////////////////////////
+	// Hot reload.
+	//////////////////////////////////////////////////////////////////////////
+	/**
+	 * Modules required from the project directory or package.path are
+	 * reloaded in place, see FLuaHotReload.
+	 * hotReload.reload([name])	reload module name, or all changed modules.
+	 * hotReload.watch(seconds)	reload changed modules every seconds, 0 stops.
+	 */
+
 private:
 	void throwError(const char* fmt, ...);
 
 	int callUFunction(UFunction* func);
 	int callUClass(UClass* cls);
 	int callStruct(UScriptStruct* s);
+	/** World of the context object at idx. */
+	UWorld* toWorld(int idx);
+	/** Transform at idx, or location at idx and optional rotation after it. */
+	FTransform toSpawnTransform(int idx);
 
 	friend class ULuaDelegate;
+	ULuaDelegate* bindDelegate(UObject* obj, UMulticastDelegateProperty* prop, int luaObjRef);
 	void invokeDelegate(ULuaDelegate* d, void* params);
 	bool isDelegateUnused(ULuaDelegate* d);
 	void clearUnusedDelegate(ULuaDelegate* d);
 
+	/**
+	 * Thread running lua: that of the current callback, or the coroutine
+	 * resumed last, main thread outside of lua.
+	 */
 	lua_State* luaState_;
+	lua_State* mainState_;
+	/** Set luaState_ when lua switches threads, telling the profiler. */
+	void setRunningThread(lua_State* L);
 	/** Total memory used by this lua state. */
 	size_t memUsed_;
 
@@ -86,16 +262,96 @@ private:
 	 */
 	TArray<ULuaDelegate*> delegates_;
 
-	static FLuaEnv* getLuaEnv(lua_State* L) { return luaEnvMap_[L]; }
+	/** Sampling profiler, created by startProfiler. */
+	FLuaProfiler* profiler_;
+	static void _lua_cb_profilerHook(lua_State* L, lua_Debug* ar);
+
+	/** Crossing counters, null when disabled. */
+	FLuaCrossingStats* crossingStats_;
+
+	/** Allocation sampler, null when stopped. */
+	FLuaAllocProfiler* allocProfiler_;
+
+	/** Coroutines waiting for a time or the next frame. */
+	FLuaScheduler* scheduler_;
+	FDelegateHandle tickerHandle_;
+	/** Resume a waiting coroutine ref with n values on top of luaState_, and release the ref. */
+	void resumeThread(int threadRef, int n);
+	/** Ref to the running coroutine, which must be able to yield. */
+	int refYieldingThread();
+
+	/** Worker states running jobs, created by the first job. */
+	FLuaJobPool* jobPool_;
+	/** Weak table of job functions to their bytecode. */
+	int jobCodeTable_;
+	/** Make a job calling function at idx with nargs arguments after it. */
+	struct FLuaJob* newJob(int idx, int nargs);
+	void dispatchCompletedJobs();
+
+	/** Objects ticked by lua. */
+	FLuaTickBatch* tickBatch_;
+	ETickingGroup toTickGroup(int idx);
+
+	/** Actors released to the "actorPool" table. */
+	FLuaActorPool* actorPool_;
+
+	/** Events overridden by the "overrides" table. */
+	FLuaOverrides* overrides_;
+	/** Call lua function funcRef for the event run by stack, result is its return value. */
+	void invokeOverride(int funcRef, FFrame& stack, void* result);
+
+	/** Modules reloaded by the "hotReload" table. */
+	FLuaHotReload* hotReload_;
+
+	/** Read strings as lazy strings. */
+	bool lazyStrings_;
+	/** Lua string of the lazy string or string at idx, nullptr for other types. */
+	const char* toLuaString(int idx, size_t* len);
+	/** Compare the lazy strings or strings at 1 and 2 with lua_compare op. */
+	int ustringCompare(int op);
+	/** String hook of lazy strings, see lua_setstringhook. */
+	static int ustringHook(lua_State* L);
+
+	/** Row of view at the index at idx, nullptr if out of range. */
+	uint8* columnRow(struct FUColumnViewProxy* v, int idx);
+	int32 columnRowNum(struct FUColumnViewProxy* v);
+
+	/** The allocator data is shared by all threads of the state. */
+	static FLuaEnv* getLuaEnv(lua_State* L) { void* ud = nullptr; lua_getallocf(L, &ud); return (FLuaEnv*)ud; }
 	/** Memory allocation function for lua vm. */
 	void* memAlloc(void* ptr, size_t osize, size_t nsize);
 	static void* _lua_cb_memAlloc(void* ud, void* ptr, size_t osize, size_t nsize) { return ((FLuaEnv*)ud)->memAlloc(ptr, osize, nsize); }
 
+	// Callbacks run on the calling thread, which may be a coroutine. The previous
+	// thread is not restored when the callback raises an error or yields: whatever
+	// catches it restores it, cpp code calling into lua and the lua functions below.
 #define DECLARE_LUA_CALLBACK(NAME) \
 	int NAME();\
-	static int _lua_cb_##NAME(lua_State* L) { return getLuaEnv(L)->NAME(); }
+	static int _lua_cb_##NAME(lua_State* L) \
+	{ \
+		FLuaEnv* env = getLuaEnv(L); \
+		lua_State* prev = env->luaState_; \
+		env->luaState_ = L; \
+		int r = env->NAME(); \
+		env->luaState_ = prev; \
+		return r; \
+	}
 #define LUA_CALLBACK(NAME) _lua_cb_##NAME
 
+	/**
+	 * Replace pcall, xpcall, coroutine.resume and coroutine.wrap of L by
+	 * functions calling them, then pointing luaState_ back at their thread.
+	 * The coroutine functions point luaState_ at the coroutine while it runs.
+	 */
+	static void wrapCatchingFunctions(lua_State* L);
+	/** Call upvalue 1 with the arguments, then restore luaState_. */
+	static int callCatching(lua_State* L);
+	static int callCatchingK(lua_State* L, int status, lua_KContext ctx);
+	static int coroutineResume(lua_State* L);
+	static int coroutineWrap(lua_State* L);
+	static int coroutineWrapCall(lua_State* L);
+	static int coroutineWrapCallK(lua_State* L, int status, lua_KContext ctx);
+
 	DECLARE_LUA_CALLBACK(handlePanic);
 	DECLARE_LUA_CALLBACK(uobjMTIndex);
 	DECLARE_LUA_CALLBACK(uobjMTNewIndex);
@@ -106,5 +362,41 @@ private:
 	DECLARE_LUA_CALLBACK(ustructMTNewIndex);
 	DECLARE_LUA_CALLBACK(ustructMTGC);
 
-	static TMap<lua_State*, FLuaEnv*> luaEnvMap_;
+	DECLARE_LUA_CALLBACK(stringsLazy);
+	DECLARE_LUA_CALLBACK(ustringMethod);
+	DECLARE_LUA_CALLBACK(ustringMTToString);
+	DECLARE_LUA_CALLBACK(ustringMTConcat);
+	DECLARE_LUA_CALLBACK(ustringMTLen);
+	DECLARE_LUA_CALLBACK(ustringMTEq);
+	DECLARE_LUA_CALLBACK(ustringMTLt);
+	DECLARE_LUA_CALLBACK(ustringMTLe);
+	DECLARE_LUA_CALLBACK(ustringMTGC);
+
+	DECLARE_LUA_CALLBACK(columnsOf);
+	DECLARE_LUA_CALLBACK(columnViewMTIndex);
+	DECLARE_LUA_CALLBACK(columnViewMTLen);
+	DECLARE_LUA_CALLBACK(columnMTIndex);
+	DECLARE_LUA_CALLBACK(columnMTNewIndex);
+	DECLARE_LUA_CALLBACK(columnMTLen);
+
+	DECLARE_LUA_CALLBACK(schedulerStart);
+	DECLARE_LUA_CALLBACK(schedulerWait);
+	DECLARE_LUA_CALLBACK(schedulerWaitFrame);
+	DECLARE_LUA_CALLBACK(schedulerWaitDelegate);
+
+	DECLARE_LUA_CALLBACK(jobsRun);
+	DECLARE_LUA_CALLBACK(jobsSubmit);
+
+	DECLARE_LUA_CALLBACK(batchTickSetHandler);
+	DECLARE_LUA_CALLBACK(batchTickRegister);
+	DECLARE_LUA_CALLBACK(batchTickUnregister);
+
+	DECLARE_LUA_CALLBACK(findObject);
+	DECLARE_LUA_CALLBACK(actorPoolSpawn);
+	DECLARE_LUA_CALLBACK(actorPoolRelease);
+	DECLARE_LUA_CALLBACK(actorPoolClear);
+	DECLARE_LUA_CALLBACK(actorPoolNum);
+
+	DECLARE_LUA_CALLBACK(overridesBind);
+	DECLARE_LUA_CALLBACK(overridesUnbind);
 };
\ No newline at end of file
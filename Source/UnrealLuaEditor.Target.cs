@@ -9,6 +9,6 @@ public class UnrealLuaEditorTarget : TargetRules
 	{
 		Type = TargetType.Editor;
 
-		ExtraModuleNames.AddRange( new string[] { "UnrealLua" } );
+		ExtraModuleNames.AddRange( new string[] { "UnrealLua", "UnrealLuaTests" } );
 	}
 }
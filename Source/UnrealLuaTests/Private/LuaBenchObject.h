@@ -0,0 +1,108 @@
+#pragma once
+
+#include "UnrealLua.h"
+#include "UObject/Interface.h"
+#include "LuaBenchObject.generated.h"
+
+UENUM()
+enum class ELuaBenchEnum : uint8
+{
+	A,
+	B,
+	C,
+};
+
+UINTERFACE()
+class ULuaBenchInterface : public UInterface
+{
+	GENERATED_BODY()
+};
+
+class ILuaBenchInterface
+{
+	GENERATED_BODY()
+};
+
+/**
+ * Object with one property of each kind handled by FLuaEnv and UFunctions
+ * of varying arity, used by the binding benchmarks.
+ */
+UCLASS()
+class ULuaBenchObject : public UObject, public ILuaBenchInterface
+{
+	GENERATED_BODY()
+public:
+	UPROPERTY()
+	uint8 ByteProp;
+	UPROPERTY()
+	int8 Int8Prop;
+	UPROPERTY()
+	int16 Int16Prop;
+	UPROPERTY()
+	int32 IntProp;
+	UPROPERTY()
+	int64 Int64Prop;
+	UPROPERTY()
+	uint16 UInt16Prop;
+	UPROPERTY()
+	uint32 UInt32Prop;
+	UPROPERTY()
+	uint64 UInt64Prop;
+	UPROPERTY()
+	float FloatProp;
+	UPROPERTY()
+	double DoubleProp;
+	UPROPERTY()
+	bool BoolProp;
+	UPROPERTY()
+	UObject* ObjectProp;
+	UPROPERTY()
+	TWeakObjectPtr<UObject> WeakObjectProp;
+	UPROPERTY()
+	UClass* ClassProp;
+	UPROPERTY()
+	TScriptInterface<ILuaBenchInterface> InterfaceProp;
+	UPROPERTY()
+	FName NameProp;
+	UPROPERTY()
+	FString StrProp;
+	UPROPERTY()
+	FText TextProp;
+	UPROPERTY()
+	ELuaBenchEnum EnumProp;
+	UPROPERTY()
+	FVector StructProp;
+	UPROPERTY()
+	TArray<int32> ArrayProp;
+	UPROPERTY()
+	TArray<int32> LargeArrayProp;
+	UPROPERTY()
+	TArray<FVector> VectorArrayProp;
+	UPROPERTY()
+	TMap<FString, int32> MapProp;
+	UPROPERTY()
+	TSet<int32> SetProp;
+
+	UFUNCTION()
+	void Call0() {}
+	UFUNCTION()
+	void Call1(int32 a) {}
+	UFUNCTION()
+	void Call2(int32 a, int32 b) {}
+	UFUNCTION()
+	void Call4(int32 a, int32 b, int32 c, int32 d) {}
+	UFUNCTION()
+	void Call8(int32 a, int32 b, int32 c, int32 d, int32 e, int32 f, int32 g, int32 h) {}
+	UFUNCTION()
+	int32 CallRet(int32 a) { return a; }
+	UFUNCTION()
+	void CallOut(int32 a, int32& b) { b = a; }
+	UFUNCTION()
+	void CallStr(const FString& s) {}
+	UFUNCTION()
+	void CallText(const FText& t) {}
+	UFUNCTION()
+	FVector CallStruct(const FVector& v) { return v; }
+	UFUNCTION()
+	static int32 CallStatic(int32 a) { return a; }
+};
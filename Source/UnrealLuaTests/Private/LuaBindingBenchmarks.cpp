@@ -0,0 +1,298 @@
+#include "LuaBenchObject.h"
+#include "LuaEnv.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/CommandLine.h"
+#include "UObject/Package.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+/**
+ * Binding microbenchmarks: time of FLuaEnv binding paths in ns/op, checked
+ * against LuaBindingBaselines.csv next to this file. A case over its baseline
+ * times the tolerance fails; a case without one only warns. Baselines are
+ * recorded on the reference machine, the one running the benchmarks in CI,
+ * and recorded again when a change makes a path faster or slower on purpose.
+ *
+ * Run headless with:
+ *   UE4Editor-Cmd UnrealLua -nullrhi -unattended -ExecCmds="Automation RunTests UnrealLua.Bench.Binding;Quit"
+ * Command line switches:
+ *   -LuaBenchTolerance=1.5		fail when slower than baseline * tolerance.
+ *   -LuaBenchUpdateBaselines	write measured values as new baselines.
+ */
+namespace LuaBindingBench
+{
+	struct FCase
+	{
+		const TCHAR* name;
+		/** Lua code run once before the loop, "o" is the ULuaBenchObject. */
+		const char* setup;
+		/** Lua code of one operation. */
+		const char* body;
+	};
+
+	static const FCase cases[] =
+	{
+		// Property get/set for each kind of pushPropertyValue/toPropertyValue.
+		{ TEXT("Get.Byte"),			"",								"local v = o.ByteProp" },
+		{ TEXT("Set.Byte"),			"",								"o.ByteProp = 7" },
+		{ TEXT("Get.Int8"),			"",								"local v = o.Int8Prop" },
+		{ TEXT("Set.Int8"),			"",								"o.Int8Prop = 7" },
+		{ TEXT("Get.Int16"),		"",								"local v = o.Int16Prop" },
+		{ TEXT("Set.Int16"),		"",								"o.Int16Prop = 7" },
+		{ TEXT("Get.Int"),			"",								"local v = o.IntProp" },
+		{ TEXT("Set.Int"),			"",								"o.IntProp = 7" },
+		{ TEXT("Get.Int64"),		"",								"local v = o.Int64Prop" },
+		{ TEXT("Set.Int64"),		"",								"o.Int64Prop = 7" },
+		{ TEXT("Get.UInt16"),		"",								"local v = o.UInt16Prop" },
+		{ TEXT("Set.UInt16"),		"",								"o.UInt16Prop = 7" },
+		{ TEXT("Get.UInt32"),		"",								"local v = o.UInt32Prop" },
+		{ TEXT("Set.UInt32"),		"",								"o.UInt32Prop = 7" },
+		{ TEXT("Get.UInt64"),		"",								"local v = o.UInt64Prop" },
+		{ TEXT("Set.UInt64"),		"",								"o.UInt64Prop = 7" },
+		{ TEXT("Get.Float"),		"",								"local v = o.FloatProp" },
+		{ TEXT("Set.Float"),		"",								"o.FloatProp = 0.5" },
+		{ TEXT("Get.Double"),		"",								"local v = o.DoubleProp" },
+		{ TEXT("Set.Double"),		"",								"o.DoubleProp = 0.5" },
+		{ TEXT("Get.Bool"),			"",								"local v = o.BoolProp" },
+		{ TEXT("Set.Bool"),			"",								"o.BoolProp = true" },
+		{ TEXT("Get.Object"),		"",								"local v = o.ObjectProp" },
+		{ TEXT("Set.Object"),		"",								"o.ObjectProp = o" },
+		{ TEXT("Get.WeakObject"),	"",								"local v = o.WeakObjectProp" },
+		{ TEXT("Set.WeakObject"),	"",								"o.WeakObjectProp = o" },
+		{ TEXT("Get.Class"),		"",								"local v = o.ClassProp" },
+		{ TEXT("Set.Class"),		"local c = o.ClassProp",		"o.ClassProp = c" },
+		{ TEXT("Get.Interface"),	"",								"local v = o.InterfaceProp" },
+		{ TEXT("Set.Interface"),	"",								"o.InterfaceProp = o" },
+		{ TEXT("Get.Name"),			"",								"local v = o.NameProp" },
+		{ TEXT("Set.Name"),			"",								"o.NameProp = 'BenchName'" },
+		{ TEXT("Get.Str"),			"",								"local v = o.StrProp" },
+		{ TEXT("Set.Str"),			"",								"o.StrProp = 'bench string'" },
+		{ TEXT("Get.Text"),			"",								"local v = o.TextProp" },
+		{ TEXT("Set.Text"),			"",								"o.TextProp = 'bench text'" },
+		{ TEXT("Get.TextLazy"),		"strings.lazy(true)",			"local v = o.TextProp" },
+		{ TEXT("Get.Enum"),			"",								"local v = o.EnumProp" },
+		{ TEXT("Set.Enum"),			"",								"o.EnumProp = 2" },
+
+		// Struct push (a new userdata per read) and its collection.
+		{ TEXT("Struct.Get"),		"",								"local v = o.StructProp" },
+		{ TEXT("Struct.Set"),		"local v = o.StructProp",		"o.StructProp = v" },
+		{ TEXT("Struct.Field"),		"local v = o.StructProp",		"v.X = v.Y" },
+		{ TEXT("Struct.New"),		"local V = findObject('Vector')",	"local v = V{ X = 1, Y = 2, Z = 3 }" },
+		{ TEXT("Struct.PushGC"),	"collectgarbage('stop')",		"local v = o.StructProp if i % 256 == 0 then collectgarbage() end" },
+
+		// Container conversion.
+		{ TEXT("Array16.Get"),		"",								"local v = o.ArrayProp" },
+		{ TEXT("Array16.Set"),		"local t = o.ArrayProp",		"o.ArrayProp = t" },
+		{ TEXT("Array256.Get"),		"",								"local v = o.LargeArrayProp" },
+		{ TEXT("Array256.Set"),		"local t = o.LargeArrayProp",	"o.LargeArrayProp = t" },
+		{ TEXT("Map16.Get"),		"",								"local v = o.MapProp" },
+		{ TEXT("Map16.Set"),		"local t = o.MapProp",			"o.MapProp = t" },
+		{ TEXT("Set16.Get"),		"",								"local v = o.SetProp" },
+		{ TEXT("Set16.Set"),		"local t = o.SetProp",			"o.SetProp = t" },
+
+		// Field of an array of structs, by row copy and by column view.
+		{ TEXT("Rows.Field"),		"local c = columns.of(o, 'VectorArrayProp')",	"local v = c[i % 256 + 1].X" },
+		{ TEXT("Column.Get"),		"local x = columns.of(o, 'VectorArrayProp').X",	"local v = x[i % 256 + 1]" },
+		{ TEXT("Column.Set"),		"local x = columns.of(o, 'VectorArrayProp').X",	"x[i % 256 + 1] = 1.5" },
+
+		// Log line below the category verbosity, dropped before formatting.
+		{ TEXT("Log.Suppressed"),	"",								"log.veryVerbose('bench %d', i)" },
+
+		// UFunction calls through callUFunction.
+		{ TEXT("Call.Arity0"),		"",								"o:Call0()" },
+		{ TEXT("Call.Arity1"),		"",								"o:Call1(1)" },
+		{ TEXT("Call.Arity2"),		"",								"o:Call2(1, 2)" },
+		{ TEXT("Call.Arity4"),		"",								"o:Call4(1, 2, 3, 4)" },
+		{ TEXT("Call.Arity8"),		"",								"o:Call8(1, 2, 3, 4, 5, 6, 7, 8)" },
+		{ TEXT("Call.Return"),		"",								"local v = o:CallRet(1)" },
+		{ TEXT("Call.OutParam"),	"",								"local v = o:CallOut(1, 0)" },
+		{ TEXT("Call.String"),		"",								"o:CallStr('bench')" },
+		{ TEXT("Call.Text"),		"local t = o.TextProp",			"o:CallText(t)" },
+		{ TEXT("Call.TextLazy"),	"strings.lazy(true) local t = o.TextProp",	"o:CallText(t)" },
+		{ TEXT("Call.Struct"),		"local v = o.StructProp",		"local r = o:CallStruct(v)" },
+		{ TEXT("Call.Static"),		"",								"local v = o.CallStatic(1)" },
+		{ TEXT("Call.Cached"),		"local f = o.Call1",			"f(o, 1)" },
+	};
+
+	/** Minimum time of one timed run. */
+	static const double MinTime = 0.02;
+	/** Timed runs per case, the median is reported. */
+	static const int32 Repeats = 5;
+
+	static FString baselinePath()
+	{
+		return FPaths::ProjectDir() / TEXT("Source/UnrealLuaTests/Private/LuaBindingBaselines.csv");
+	}
+
+	static void loadBaselines(TMap<FString, double>& baselines)
+	{
+		TArray<FString> lines;
+		FFileHelper::LoadFileToStringArray(lines, *baselinePath());
+		for (int32 i = 1; i < lines.Num(); i++) // skip header.
+		{
+			FString name, value;
+			if (lines[i].Split(TEXT(","), &name, &value))
+				baselines.Add(name, FCString::Atod(*value));
+		}
+	}
+
+	static bool saveBaselines(const TMap<FString, double>& baselines)
+	{
+		TArray<FString> names;
+		baselines.GetKeys(names);
+		names.Sort();
+		FString csv = TEXT("Name,NsPerOp\n");
+		for (const FString& name : names)
+			csv += FString::Printf(TEXT("%s,%.1f\n"), *name, baselines[name]);
+		return FFileHelper::SaveStringToFile(csv, *baselinePath());
+	}
+
+	/**
+	 * Time n iterations of body, in seconds. Parsing is not timed.
+	 * @return negative on lua error.
+	 */
+	static double timeLoop(FLuaEnv& env, UObject* obj, const FCase& c, const char* body, int64 n)
+	{
+		FString code = FString::Printf(TEXT("local o, n = ...\n%s\nfor i = 1, n do %s end\n"),
+			UTF8_TO_TCHAR(c.setup), UTF8_TO_TCHAR(body));
+		if (!env.loadString(TCHAR_TO_UTF8(*code)))
+			return -1.0;
+		env.pushUObject(obj);
+		env.pushInteger(n);
+		double start = FPlatformTime::Seconds();
+		if (!env.pcall(2, 0))
+			return -1.0;
+		return FPlatformTime::Seconds() - start;
+	}
+
+	/**
+	 * Measure ns/op of a case, minus the cost of an empty loop.
+	 * @return negative on lua error.
+	 */
+	static double measure(FLuaEnv& env, UObject* obj, const FCase& c)
+	{
+		// Calibrate.
+		int64 n = 1000;
+		for (;;)
+		{
+			double t = timeLoop(env, obj, c, c.body, n);
+			if (t < 0.0)
+				return -1.0;
+			if (t >= MinTime || n >= (1LL << 30))
+				break;
+			n *= 2;
+		}
+
+		TArray<double> samples;
+		for (int32 r = 0; r < Repeats; r++)
+		{
+			double t = timeLoop(env, obj, c, c.body, n);
+			double empty = timeLoop(env, obj, c, "", n);
+			if (t < 0.0 || empty < 0.0)
+				return -1.0;
+			samples.Add(FMath::Max(t - empty, 0.0) * 1e9 / n);
+		}
+		samples.Sort();
+		return samples[Repeats / 2];
+	}
+
+	static ULuaBenchObject* createBenchObject()
+	{
+		ULuaBenchObject* obj = NewObject<ULuaBenchObject>(GetTransientPackage());
+		obj->AddToRoot();
+		obj->ObjectProp = obj;
+		obj->WeakObjectProp = obj;
+		obj->ClassProp = ULuaBenchObject::StaticClass();
+		obj->InterfaceProp = obj;
+		obj->NameProp = TEXT("BenchName");
+		obj->StrProp = TEXT("bench string");
+		obj->TextProp = FText::FromString(TEXT("bench text"));
+		obj->EnumProp = ELuaBenchEnum::B;
+		obj->StructProp = FVector(1.0f, 2.0f, 3.0f);
+		for (int32 i = 0; i < 16; i++)
+		{
+			obj->ArrayProp.Add(i);
+			obj->MapProp.Add(FString::Printf(TEXT("key%d"), i), i);
+			obj->SetProp.Add(i);
+		}
+		for (int32 i = 0; i < 256; i++)
+		{
+			obj->LargeArrayProp.Add(i);
+			obj->VectorArrayProp.Add(FVector((float)i));
+		}
+		return obj;
+	}
+}
+
+IMPLEMENT_COMPLEX_AUTOMATION_TEST(FLuaBindingBenchmark, "UnrealLua.Bench.Binding", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::PerfFilter)
+
+void FLuaBindingBenchmark::GetTests(TArray<FString>& OutBeautifiedNames, TArray<FString>& OutTestCommands) const
+{
+	for (const LuaBindingBench::FCase& c : LuaBindingBench::cases)
+	{
+		OutBeautifiedNames.Add(c.name);
+		OutTestCommands.Add(c.name);
+	}
+}
+
+bool FLuaBindingBenchmark::RunTest(const FString& Parameters)
+{
+	using namespace LuaBindingBench;
+
+	const FCase* c = nullptr;
+	for (const FCase& it : cases)
+	{
+		if (Parameters == it.name)
+			c = &it;
+	}
+	if (!c)
+	{
+		AddError(FString::Printf(TEXT("Unknown benchmark \"%s\"."), *Parameters));
+		return false;
+	}
+
+	ULuaBenchObject* obj = createBenchObject();
+	double nsPerOp;
+	{
+		FLuaEnv env;
+		nsPerOp = measure(env, obj, *c);
+	}
+	obj->RemoveFromRoot();
+	if (nsPerOp < 0.0)
+	{
+		AddError(FString::Printf(TEXT("%s: lua error, see log."), c->name));
+		return false;
+	}
+
+	TMap<FString, double> baselines;
+	loadBaselines(baselines);
+	float tolerance = 1.5f;
+	FParse::Value(FCommandLine::Get(), TEXT("LuaBenchTolerance="), tolerance);
+
+	if (FParse::Param(FCommandLine::Get(), TEXT("LuaBenchUpdateBaselines")))
+	{
+		baselines.Add(c->name, nsPerOp);
+		if (!saveBaselines(baselines))
+			AddError(FString::Printf(TEXT("Can not write \"%s\"."), *baselinePath()));
+		AddInfo(FString::Printf(TEXT("%s: %.1f ns/op (new baseline)"), c->name, nsPerOp));
+	}
+	else if (const double* baseline = baselines.Find(c->name))
+	{
+		FString msg = FString::Printf(TEXT("%s: %.1f ns/op, baseline %.1f ns/op (%+.0f%%)"),
+			c->name, nsPerOp, *baseline, (nsPerOp / FMath::Max(*baseline, 0.1) - 1.0) * 100.0);
+		if (nsPerOp > *baseline * tolerance)
+			AddError(msg + FString::Printf(TEXT(", more than %.2fx slower"), tolerance));
+		else
+			AddInfo(msg);
+	}
+	else
+	{
+		// Values of other machines mean nothing, wait for the reference one.
+		AddWarning(FString::Printf(TEXT("%s: %.1f ns/op, no baseline (run with -LuaBenchUpdateBaselines on the reference machine)"), c->name, nsPerOp));
+	}
+	return true;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,87 @@
+#include "LuaEnv.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+/**
+ * Jobs run on workers end to end: submitted twice with the same function, so
+ * the second job uses the cached bytecode, and run from a coroutine.
+ */
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLuaJobRunTest, "UnrealLua.Jobs.Run", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FLuaJobRunTest::RunTest(const FString& Parameters)
+{
+	FLuaEnv env;
+	const char* code =
+		"results = {}\n"
+		"local function add(a, b) return a + b end\n"
+		"jobs.submit(add, function(ok, r) results.first = ok and r end, 1, 2)\n"
+		"jobs.submit(add, function(ok, r) results.second = ok and r end, 3, 4)\n"
+		"scheduler.start(function()\n"
+		"	local ok, s, n = jobs.run(function(t) return table.concat(t, ','), #t end, { 'a', 'b' })\n"
+		"	results.run = ok and s == 'a,b' and n == 2\n"
+		"end)\n";
+	if (!env.loadString(code) || !env.pcall(0, 0))
+	{
+		AddError(TEXT("Can not submit jobs, see log."));
+		return false;
+	}
+
+	bool done = false;
+	for (double timeout = FPlatformTime::Seconds() + 10.0; !done && FPlatformTime::Seconds() < timeout; )
+	{
+		FPlatformProcess::Sleep(0.001f);
+		env.tick(0.001f);
+		if (!env.loadString("return results.first == 3 and results.second == 7 and results.run == true") || !env.pcall(0, 1))
+			break;
+		done = env.toBoolean(-1);
+		env.pop();
+	}
+	TestTrue(TEXT("Jobs completed with their results"), done);
+	return done;
+}
+
+/**
+ * Globals set by a job are not seen by later jobs, whatever the worker state
+ * running them, while the globals of the state still read through.
+ */
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLuaJobGlobalsTest, "UnrealLua.Jobs.Globals", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FLuaJobGlobalsTest::RunTest(const FString& Parameters)
+{
+	FLuaEnv env;
+	const char* code =
+		"scheduler.start(function()\n"
+		"	local leaked = false\n"
+		"	for i = 1, 32 do\n"
+		"		local ok, seen = jobs.run(function(i)\n"
+		"			local seen = counter\n"
+		"			counter, _G.other = i, i\n"
+		"			assert(counter == i and other == i and string.format('%d', i))\n"
+		"			return seen\n"
+		"		end, i)\n"
+		"		leaked = leaked or not ok or seen ~= nil\n"
+		"	end\n"
+		"	globalsDone = not leaked\n"
+		"end)\n";
+	if (!env.loadString(code) || !env.pcall(0, 0))
+	{
+		AddError(TEXT("Can not submit jobs, see log."));
+		return false;
+	}
+
+	bool done = false;
+	for (double timeout = FPlatformTime::Seconds() + 10.0; !done && FPlatformTime::Seconds() < timeout; )
+	{
+		FPlatformProcess::Sleep(0.001f);
+		env.tick(0.001f);
+		if (!env.loadString("return globalsDone") || !env.pcall(0, 1))
+			break;
+		done = env.toBoolean(-1);
+		env.pop();
+	}
+	TestTrue(TEXT("Jobs did not see globals of earlier jobs"), done);
+	return done;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
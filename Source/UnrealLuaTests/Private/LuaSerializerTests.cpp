@@ -0,0 +1,44 @@
+#include "LuaEnv.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+/**
+ * Nested mixed tables, { child, n = level }, pack each value once: the packed
+ * size and time follow the same tree of arrays, { child, level }, instead of
+ * doubling at each level. The tree also reads back unchanged.
+ */
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FLuaSerializerMixedTableTest, "UnrealLua.Serializer.MixedTables", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FLuaSerializerMixedTableTest::RunTest(const FString& Parameters)
+{
+	FLuaEnv env;
+	const char* code =
+		"local depth = 20\n"
+		"local mixed, array = {}, {}\n"
+		"for level = 1, depth do\n"
+		"	mixed = { mixed, n = level }\n"
+		"	array = { array, level }\n"
+		"end\n"
+		"local function time(t)\n"
+		"	local start = os.clock()\n"
+		"	for i = 1, 1000 do msgpack.pack(t) end\n"
+		"	return os.clock() - start\n"
+		"end\n"
+		"local mixedSize, arraySize = #msgpack.pack(mixed), #msgpack.pack(array)\n"
+		"-- A map node adds its header, key 1, then the key n and its value.\n"
+		"assert(mixedSize == arraySize + 3 * depth, string.format('mixed tree packed to %d bytes, expected %d', mixedSize, arraySize + 3 * depth))\n"
+		"local mixedTime, arrayTime = time(mixed), time(array)\n"
+		"assert(mixedTime < arrayTime * 4 + 0.01, string.format('mixed tree packed in %fs, array tree in %fs', mixedTime, arrayTime))\n"
+		"local t = msgpack.unpack(msgpack.pack(mixed))\n"
+		"for level = depth, 1, -1 do\n"
+		"	assert(t.n == level, 'mixed tree read back wrong')\n"
+		"	t = t[1]\n"
+		"end\n"
+		"assert(next(t) == nil, 'mixed tree read back wrong')\n";
+	bool ok = env.loadString(code) && env.pcall(0, 0);
+	TestTrue(TEXT("Mixed tables packed once, see log"), ok);
+	return ok;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
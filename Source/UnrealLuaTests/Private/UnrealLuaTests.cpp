@@ -0,0 +1,7 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "CoreMinimal.h"
+#include "Modules/ModuleManager.h"
+
+// Automation tests and benchmarks of UnrealLua, built for the editor only.
+IMPLEMENT_MODULE(FDefaultModuleImpl, UnrealLuaTests);
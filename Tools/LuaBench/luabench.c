@@ -0,0 +1,375 @@
+/*
+** luabench: fixed benchmark suite for the Lua module, runnable without
+** the engine.
+**
+** usage: luabench [-f text|csv|json] [-t seconds] [-r repeats] [-l] [name...]
+**
+**   -f   output format (default text); csv and json are one record per
+**        benchmark: name, ns_per_op (median of the repeats), min_ns_per_op,
+**        max_ns_per_op, ops (per repeat)
+**   -t   minimum time of each repeat (default 0.2)
+**   -r   repeats per benchmark (default 5)
+**   -l   list benchmarks and exit
+**   name run only benchmarks whose name contains one of these strings
+**
+** Each benchmark is a chunk returning a function 'run(n)' that performs
+** n operations. 'n' is doubled until a run takes at least the minimum
+** time, then each repeat runs that many operations in a fresh state.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+typedef struct Bench {
+  const char *name;
+  const char *code;
+} Bench;
+
+
+static const Bench benches[] = {
+  {"table_get_array",
+   "local t = {} for i = 1, 1024 do t[i] = i end\n"
+   "return function (n)\n"
+   "  local s = 0\n"
+   "  for i = 1, n do s = s + t[(i & 1023) + 1] end\n"
+   "  return s\n"
+   "end\n"},
+  {"table_set_array",
+   "local t = {} for i = 1, 1024 do t[i] = i end\n"
+   "return function (n)\n"
+   "  for i = 1, n do t[(i & 1023) + 1] = i end\n"
+   "end\n"},
+  {"table_get_hash",
+   "local t, k = {}, {}\n"
+   "for i = 1, 1024 do k[i] = 'key' .. i; t[k[i]] = i end\n"
+   "return function (n)\n"
+   "  local s = 0\n"
+   "  for i = 1, n do s = s + t[k[(i & 1023) + 1]] end\n"
+   "  return s\n"
+   "end\n"},
+  {"table_set_hash",
+   "local t, k = {}, {}\n"
+   "for i = 1, 1024 do k[i] = 'key' .. i end\n"
+   "return function (n)\n"
+   "  for i = 1, n do t[k[(i & 1023) + 1]] = i end\n"
+   "end\n"},
+  {"table_field",
+   "local o = {x = 1, y = 2, z = 3}\n"
+   "return function (n)\n"
+   "  for i = 1, n do o.x = o.y + o.z end\n"
+   "end\n"},
+  {"table_insert_new",
+   "return function (n)\n"
+   "  local t = {}\n"
+   "  for i = 1, n do t[#t + 1] = i end\n"
+   "end\n"},
+  {"string_intern_short",
+   "return function (n)\n"
+   "  for i = 1, n do local s = 'k' .. (i & 4095) end\n"
+   "end\n"},
+  {"string_intern_new",
+   "return function (n)\n"
+   "  for i = 1, n do local s = 'name_' .. i end\n"
+   "end\n"},
+  {"string_long_hash",
+   "local s = string.rep('abcdefgh', 64)\n"
+   "return function (n)\n"
+   "  local t = {}\n"
+   "  for i = 1, n do t[s .. (i & 7)] = i end\n"
+   "end\n"},
+  {"string_concat_buffer",
+   "local concat = table.concat\n"
+   "return function (n)\n"
+   "  local t = {}\n"
+   "  for i = 1, n do t[i] = 'x' end\n"
+   "  return concat(t)\n"
+   "end\n"},
+  {"string_format",
+   "local format = string.format\n"
+   "return function (n)\n"
+   "  for i = 1, n do local s = format('%d:%s:%.2f', i, 'v', i * 0.5) end\n"
+   "end\n"},
+  {"closure_create",
+   "return function (n)\n"
+   "  local f\n"
+   "  for i = 1, n do f = function () return i end end\n"
+   "  return f\n"
+   "end\n"},
+  {"closure_call",
+   "local c = 0\n"
+   "local function inc (x) c = c + x end\n"
+   "return function (n)\n"
+   "  for i = 1, n do inc(1) end\n"
+   "end\n"},
+  {"vararg_call",
+   "local select = select\n"
+   "local function count (...) return select('#', ...) end\n"
+   "return function (n)\n"
+   "  for i = 1, n do count(i, i, i) end\n"
+   "end\n"},
+  {"method_call",
+   "local C = {} C.__index = C\n"
+   "function C:get () return self.v end\n"
+   "local o = setmetatable({v = 1}, C)\n"
+   "return function (n)\n"
+   "  local s = 0\n"
+   "  for i = 1, n do s = s + o:get() end\n"
+   "  return s\n"
+   "end\n"},
+  {"coroutine_create",
+   "local create = coroutine.create\n"
+   "local function f () end\n"
+   "return function (n)\n"
+   "  for i = 1, n do create(f) end\n"
+   "end\n"},
+  {"coroutine_resume",
+   "local yield = coroutine.yield\n"
+   "local co = coroutine.wrap(function () while true do yield() end end)\n"
+   "return function (n)\n"
+   "  for i = 1, n do co() end\n"
+   "end\n"},
+  {"coroutine_lifecycle",
+   "local create, resume = coroutine.create, coroutine.resume\n"
+   "local function f (a) return a end\n"
+   "return function (n)\n"
+   "  for i = 1, n do resume(create(f), i) end\n"
+   "end\n"},
+  {"pattern_find_plain",
+   "local s = string.rep('lorem ipsum dolor sit amet ', 20) .. 'needle'\n"
+   "local find = string.find\n"
+   "return function (n)\n"
+   "  for i = 1, n do find(s, 'needle', 1, true) end\n"
+   "end\n"},
+  {"pattern_match_capture",
+   "local match = string.match\n"
+   "return function (n)\n"
+   "  for i = 1, n do match('key_123 = value_456', '^(%w+)%s*=%s*(%w+)$') end\n"
+   "end\n"},
+  {"pattern_gmatch",
+   "local s = string.rep('alpha beta gamma delta ', 10)\n"
+   "return function (n)\n"
+   "  local c = 0\n"
+   "  for i = 1, n do for w in s:gmatch('%a+') do c = c + 1 end end\n"
+   "  return c\n"
+   "end\n"},
+  {"pattern_gsub",
+   "local s = string.rep('a,b;c ', 20)\n"
+   "local gsub = string.gsub\n"
+   "return function (n)\n"
+   "  for i = 1, n do gsub(s, '[,;]', ' ') end\n"
+   "end\n"},
+  {"table_sort_numbers",
+   "local src = {} math.randomseed(42)\n"
+   "for i = 1, 256 do src[i] = math.random(1000000) end\n"
+   "local sort, move = table.sort, table.move\n"
+   "return function (n)\n"
+   "  local t = {}\n"
+   "  for i = 1, n do move(src, 1, 256, 1, t) sort(t) end\n"
+   "end\n"},
+  {"gc_small_tables",
+   "return function (n)\n"
+   "  for i = 1, n do local t = {i, i} end\n"
+   "end\n"},
+  {"gc_retained_graph",
+   "local keep = {}\n"
+   "return function (n)\n"
+   "  for i = 1, n do\n"
+   "    keep[(i & 8191) + 1] = {v = i, next = keep[(i & 4095) + 1]}\n"
+   "  end\n"
+   "end\n"},
+  {"gc_full_collect",
+   "local keep = {}\n"
+   "for i = 1, 10000 do keep[i] = {i, tostring(i)} end\n"
+   "local collect = collectgarbage\n"
+   "return function (n)\n"
+   "  for i = 1, n do collect() end\n"
+   "end\n"},
+  {"parse_load",
+   "local src = [[\n"
+   "local M = {}\n"
+   "function M.f (a, b) if a > b then return a - b else return b - a end end\n"
+   "function M.g (t) local s = 0 for i, v in ipairs(t) do s = s + v end return s end\n"
+   "M.name = 'module' M.list = {1, 2, 3, 'four', five = 5}\n"
+   "return M\n"
+   "]]\n"
+   "local load = load\n"
+   "return function (n)\n"
+   "  for i = 1, n do load(src) end\n"
+   "end\n"},
+};
+
+#define NUMBENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+typedef struct Options {
+  int format;
+  double mintime;
+  int repeats;
+  int nfilters;
+  char **filters;
+} Options;
+
+
+static double now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+** Create a state with the benchmark function on top.
+*/
+static lua_State *prepare (const Bench *b) {
+  lua_State *L = luaL_newstate();
+  if (L == NULL) {
+    fprintf(stderr, "luabench: cannot create state\n");
+    exit(EXIT_FAILURE);
+  }
+  luaL_openlibs(L);
+  if (luaL_loadbuffer(L, b->code, strlen(b->code), b->name) != LUA_OK ||
+      lua_pcall(L, 0, 1, 0) != LUA_OK) {
+    fprintf(stderr, "luabench: %s: %s\n", b->name, lua_tostring(L, -1));
+    exit(EXIT_FAILURE);
+  }
+  return L;
+}
+
+
+/*
+** Time 'run(n)' on the function on top of L (which is kept).
+*/
+static double timerun (lua_State *L, const Bench *b, lua_Integer n) {
+  double t;
+  lua_pushvalue(L, -1);
+  lua_pushinteger(L, n);
+  t = now();
+  if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+    fprintf(stderr, "luabench: %s: %s\n", b->name, lua_tostring(L, -1));
+    exit(EXIT_FAILURE);
+  }
+  return now() - t;
+}
+
+
+static int cmpdouble (const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+static void runbench (const Bench *b, const Options *opt, int first) {
+  double *ns = (double *)malloc(opt->repeats * sizeof(double));
+  lua_Integer n = 1;
+  int i;
+  lua_State *L = prepare(b);
+  /* calibrate: double 'n' until one run takes the minimum time */
+  while (timerun(L, b, n) < opt->mintime && n < ((lua_Integer)1 << 40))
+    n *= 2;
+  lua_close(L);
+  for (i = 0; i < opt->repeats; i++) {
+    L = prepare(b);
+    ns[i] = timerun(L, b, n) * 1e9 / (double)n;
+    lua_close(L);
+  }
+  qsort(ns, opt->repeats, sizeof(double), cmpdouble);
+  switch (opt->format) {
+    case FMT_TEXT:
+      printf("%-24s %12.2f ns/op  (min %.2f, max %.2f, %lld ops)\n", b->name,
+             ns[opt->repeats / 2], ns[0], ns[opt->repeats - 1], (long long)n);
+      break;
+    case FMT_CSV:
+      printf("%s,%.3f,%.3f,%.3f,%lld\n", b->name,
+             ns[opt->repeats / 2], ns[0], ns[opt->repeats - 1], (long long)n);
+      break;
+    case FMT_JSON:
+      printf("%s\n    {\"name\": \"%s\", \"ns_per_op\": %.3f, "
+             "\"min_ns_per_op\": %.3f, \"max_ns_per_op\": %.3f, \"ops\": %lld}",
+             first ? "" : ",", b->name, ns[opt->repeats / 2], ns[0],
+             ns[opt->repeats - 1], (long long)n);
+      break;
+  }
+  fflush(stdout);
+  free(ns);
+}
+
+
+static int selected (const Bench *b, const Options *opt) {
+  int i;
+  if (opt->nfilters == 0)
+    return 1;
+  for (i = 0; i < opt->nfilters; i++) {
+    if (strstr(b->name, opt->filters[i]) != NULL)
+      return 1;
+  }
+  return 0;
+}
+
+
+static void usage (const char *progname) {
+  fprintf(stderr,
+    "usage: %s [-f text|csv|json] [-t seconds] [-r repeats] [-l] [name...]\n",
+    progname);
+  exit(EXIT_FAILURE);
+}
+
+
+int main (int argc, char **argv) {
+  Options opt;
+  size_t i;
+  int arg, first = 1;
+  opt.format = FMT_TEXT;
+  opt.mintime = 0.2;
+  opt.repeats = 5;
+  for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+    const char *o = argv[arg];
+    if (strcmp(o, "-l") == 0) {
+      for (i = 0; i < NUMBENCHES; i++)
+        printf("%s\n", benches[i].name);
+      return EXIT_SUCCESS;
+    }
+    if (arg + 1 >= argc)
+      usage(argv[0]);
+    if (strcmp(o, "-f") == 0) {
+      const char *f = argv[++arg];
+      if (strcmp(f, "text") == 0) opt.format = FMT_TEXT;
+      else if (strcmp(f, "csv") == 0) opt.format = FMT_CSV;
+      else if (strcmp(f, "json") == 0) opt.format = FMT_JSON;
+      else usage(argv[0]);
+    }
+    else if (strcmp(o, "-t") == 0)
+      opt.mintime = atof(argv[++arg]);
+    else if (strcmp(o, "-r") == 0) {
+      opt.repeats = atoi(argv[++arg]);
+      if (opt.repeats < 1) usage(argv[0]);
+    }
+    else
+      usage(argv[0]);
+  }
+  opt.nfilters = argc - arg;
+  opt.filters = argv + arg;
+
+  if (opt.format == FMT_CSV)
+    printf("name,ns_per_op,min_ns_per_op,max_ns_per_op,ops\n");
+  else if (opt.format == FMT_JSON)
+    printf("{\n  \"lua\": \"%s\",\n  \"results\": [", LUA_RELEASE);
+  for (i = 0; i < NUMBENCHES; i++) {
+    if (selected(&benches[i], &opt)) {
+      runbench(&benches[i], &opt, first);
+      first = 0;
+    }
+  }
+  if (opt.format == FMT_JSON)
+    printf("\n  ]\n}\n");
+  return EXIT_SUCCESS;
+}
+